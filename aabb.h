@@ -40,12 +40,17 @@ class aabb {
     }
 
     bool hit(const ray& r, interval ray_t) const {
+        return clip(r, ray_t);
+    }
+
+    bool clip(const ray& r, interval& ray_t) const {
+        // Narrows ray_t to the part of the ray inside the box, returning false if none is.
         const point3& ray_orig = r.origin();
         const vec3&   ray_dir  = r.direction();
 
         for (int axis = 0; axis < 3; axis++) {
             const interval& ax = axis_interval(axis);
-            const double adinv = 1.0 / ray_dir[axis];
+            const real adinv = 1.0 / ray_dir[axis];
 
             auto t0 = (ax.min - ray_orig[axis]) * adinv;
             auto t1 = (ax.max - ray_orig[axis]) * adinv;
@@ -64,6 +69,26 @@ class aabb {
         return true;
     }
 
+    bool is_empty() const {
+        return x.min > x.max || y.min > y.max || z.min > z.max;
+    }
+
+    aabb intersect(const aabb& other) const {
+        // Returns the overlap of the two boxes, which may be empty. Unlike the constructors,
+        // this doesn't pad thin results.
+        aabb result;
+        result.x = interval(std::fmax(x.min, other.x.min), std::fmin(x.max, other.x.max));
+        result.y = interval(std::fmax(y.min, other.y.min), std::fmin(y.max, other.y.max));
+        result.z = interval(std::fmax(z.min, other.z.min), std::fmin(z.max, other.z.max));
+        return result;
+    }
+
+    real surface_area() const {
+        auto dx = x.size(), dy = y.size(), dz = z.size();
+        if (dx < 0 || dy < 0 || dz < 0) return 0;  // Empty box
+        return 2 * (dx*dy + dy*dz + dz*dx);
+    }
+
     int longest_axis() const {
         // Returns the index of the longest axis of the bounding box.
 
@@ -80,7 +105,7 @@ class aabb {
     void pad_to_minimums() {
         // Adjust the AABB so that no side is narrower than some delta, padding if necessary.
 
-        double delta = 0.0001;
+        real delta = 0.0001;
         if (x.size() < delta) x = x.expand(delta);
         if (y.size() < delta) y = y.expand(delta);
         if (z.size() < delta) z = z.expand(delta);
@@ -98,4 +123,57 @@ aabb operator+(const vec3& offset, const aabb& bbox) {
     return bbox + offset;
 }
 
+inline aabb clipped_polygon_bounds(const point3* vertices, int count, const aabb& clip) {
+    // Returns the bounds of the part of a convex planar polygon inside the clip box, clipping
+    // it against each of the box's six planes in turn (Sutherland-Hodgman). The bounds are
+    // padded like the polygon's own, so a part lying in an axis plane isn't flat.
+
+    const int max_vertices = 16;  // Each plane adds at most one vertex to the polygon
+    point3 buffers[2][max_vertices];
+    int n = count < max_vertices - 6 ? count : max_vertices - 6;
+    for (int i = 0; i < n; i++)
+        buffers[0][i] = vertices[i];
+    int current = 0;
+
+    for (int axis = 0; axis < 3 && n > 0; axis++) {
+        for (int side = 0; side < 2 && n > 0; side++) {
+            const interval& bounds = clip.axis_interval(axis);
+            real plane = side == 0 ? bounds.min : bounds.max;
+            real sign = side == 0 ? 1 : -1;   // Inside is p[axis] >= min, or p[axis] <= max
+
+            const point3* in = buffers[current];
+            point3* out = buffers[1 - current];
+            int out_count = 0;
+
+            for (int i = 0; i < n; i++) {
+                const point3& a = in[i];
+                const point3& b = in[(i + 1) % n];
+                real da = sign * (a[axis] - plane);
+                real db = sign * (b[axis] - plane);
+
+                if (da >= 0)
+                    out[out_count++] = a;
+                if ((da >= 0) != (db >= 0)) {
+                    auto t = da / (da - db);
+                    auto p = a + t * (b - a);
+                    p[axis] = plane;  // Avoid round-off pushing the point past the plane
+                    out[out_count++] = p;
+                }
+            }
+
+            n = out_count;
+            current = 1 - current;
+        }
+    }
+
+    aabb result = aabb::empty;
+    for (int i = 0; i < n; i++) {
+        const point3& p = buffers[current][i];
+        result.x = interval(std::fmin(result.x.min, p.x()), std::fmax(result.x.max, p.x()));
+        result.y = interval(std::fmin(result.y.min, p.y()), std::fmax(result.y.max, p.y()));
+        result.z = interval(std::fmin(result.z.min, p.z()), std::fmax(result.z.max, p.z()));
+    }
+    return n > 0 ? aabb(result.x, result.y, result.z) : result;
+}
+
 #endif
@@ -0,0 +1,224 @@
+#ifndef AFFINE_H
+#define AFFINE_H
+
+#include "aabb.h"
+
+/**
+ * Affine transform, stored as the top three rows of a 4x4 matrix: a 3x3 linear part in the
+ * first three columns and a translation in the last.
+ */
+class affine {
+  public:
+    real m[3][4];
+
+    affine() : m{{1,0,0,0}, {0,1,0,0}, {0,0,1,0}} {} // The default transform is the identity
+
+    static affine translation(const vec3& offset) {
+        affine a;
+        a.m[0][3] = offset.x();
+        a.m[1][3] = offset.y();
+        a.m[2][3] = offset.z();
+        return a;
+    }
+
+    static affine scaling(const vec3& factors) {
+        affine a;
+        a.m[0][0] = factors.x();
+        a.m[1][1] = factors.y();
+        a.m[2][2] = factors.z();
+        return a;
+    }
+
+    static affine rotation(const vec3& axis, real angle) {
+        // Rotation by angle degrees (counter-clockwise looking down the axis) about the axis
+        // through the origin.
+
+        auto n = unit_vector(axis);
+        auto radians = degrees_to_radians(angle);
+        auto c = std::cos(radians);
+        auto s = std::sin(radians);
+        auto t = 1 - c;
+
+        affine a;
+        a.m[0][0] = t*n.x()*n.x() + c;       a.m[0][1] = t*n.x()*n.y() - s*n.z();
+        a.m[0][2] = t*n.x()*n.z() + s*n.y();
+        a.m[1][0] = t*n.x()*n.y() + s*n.z(); a.m[1][1] = t*n.y()*n.y() + c;
+        a.m[1][2] = t*n.y()*n.z() - s*n.x();
+        a.m[2][0] = t*n.x()*n.z() - s*n.y(); a.m[2][1] = t*n.y()*n.z() + s*n.x();
+        a.m[2][2] = t*n.z()*n.z() + c;
+        return a;
+    }
+
+    point3 apply_point(const point3& p) const {
+        return point3(
+            m[0][0]*p.x() + m[0][1]*p.y() + m[0][2]*p.z() + m[0][3],
+            m[1][0]*p.x() + m[1][1]*p.y() + m[1][2]*p.z() + m[1][3],
+            m[2][0]*p.x() + m[2][1]*p.y() + m[2][2]*p.z() + m[2][3]
+        );
+    }
+
+    vec3 apply_vector(const vec3& v) const {
+        return vec3(
+            m[0][0]*v.x() + m[0][1]*v.y() + m[0][2]*v.z(),
+            m[1][0]*v.x() + m[1][1]*v.y() + m[1][2]*v.z(),
+            m[2][0]*v.x() + m[2][1]*v.y() + m[2][2]*v.z()
+        );
+    }
+
+    vec3 apply_transposed(const vec3& v) const {
+        // Multiplies by the transpose of the linear part. Normals transform by the transposed
+        // inverse, so this is called on the inverse transform.
+        return vec3(
+            m[0][0]*v.x() + m[1][0]*v.y() + m[2][0]*v.z(),
+            m[0][1]*v.x() + m[1][1]*v.y() + m[2][1]*v.z(),
+            m[0][2]*v.x() + m[1][2]*v.y() + m[2][2]*v.z()
+        );
+    }
+
+    real norm() const {
+        // Largest factor by which the linear part can scale a vector's largest coordinate (its
+        // infinity norm).
+        real result = 0;
+        for (int i = 0; i < 3; i++)
+            result = std::fmax(result, std::fabs(m[i][0]) + std::fabs(m[i][1]) + std::fabs(m[i][2]));
+        return result;
+    }
+
+    aabb apply_box(const aabb& box) const {
+        // Returns the box enclosing the transformed box, taking for each output axis the
+        // smaller and larger contribution of every input axis (Arvo's method).
+
+        if (box.x.min > box.x.max || box.y.min > box.y.max || box.z.min > box.z.max)
+            return aabb::empty;
+
+        interval out[3];
+        for (int i = 0; i < 3; i++) {
+            real lo = m[i][3], hi = m[i][3];
+            for (int j = 0; j < 3; j++) {
+                const interval& in = box.axis_interval(j);
+                auto a = m[i][j] * in.min;
+                auto b = m[i][j] * in.max;
+                lo += std::fmin(a, b);
+                hi += std::fmax(a, b);
+            }
+            out[i] = interval(lo, hi);
+        }
+
+        return aabb(out[0], out[1], out[2]);
+    }
+
+    real determinant() const {
+        return m[0][0]*(m[1][1]*m[2][2] - m[1][2]*m[2][1])
+             - m[0][1]*(m[1][0]*m[2][2] - m[1][2]*m[2][0])
+             + m[0][2]*(m[1][0]*m[2][1] - m[1][1]*m[2][0]);
+    }
+
+    bool invertible() const {
+        // Whether the linear part is far enough from singular to invert, relative to its scale.
+        auto scale = norm();
+        return std::fabs(determinant()) > std::numeric_limits<real>::epsilon() * scale*scale*scale;
+    }
+
+    affine inverse() const {
+        // Inverts the linear part by its adjugate, then undoes the translation.
+
+        affine inv;
+        auto cofactor = [this](int r0, int r1, int c0, int c1) {
+            return m[r0][c0]*m[r1][c1] - m[r0][c1]*m[r1][c0];
+        };
+
+        inv.m[0][0] =  cofactor(1,2, 1,2);
+        inv.m[0][1] = -cofactor(0,2, 1,2);
+        inv.m[0][2] =  cofactor(0,1, 1,2);
+        inv.m[1][0] = -cofactor(1,2, 0,2);
+        inv.m[1][1] =  cofactor(0,2, 0,2);
+        inv.m[1][2] = -cofactor(0,1, 0,2);
+        inv.m[2][0] =  cofactor(1,2, 0,1);
+        inv.m[2][1] = -cofactor(0,2, 0,1);
+        inv.m[2][2] =  cofactor(0,1, 0,1);
+
+        auto det = m[0][0]*inv.m[0][0] + m[0][1]*inv.m[1][0] + m[0][2]*inv.m[2][0];
+        auto inv_det = 1 / det;
+        for (int i = 0; i < 3; i++)
+            for (int j = 0; j < 3; j++)
+                inv.m[i][j] *= inv_det;
+
+        auto t = inv.apply_vector(vec3(m[0][3], m[1][3], m[2][3]));
+        inv.m[0][3] = -t.x();
+        inv.m[1][3] = -t.y();
+        inv.m[2][3] = -t.z();
+
+        return inv;
+    }
+
+    static affine lerp(const affine& a, const affine& b, real t) {
+        // Entry-wise interpolation. Every transformed point moves in a straight line from its
+        // position under a to its position under b.
+        affine result;
+        for (int i = 0; i < 3; i++)
+            for (int j = 0; j < 4; j++)
+                result.m[i][j] = (1-t)*a.m[i][j] + t*b.m[i][j];
+        return result;
+    }
+
+    static bool invertible_between(const affine& a, const affine& b) {
+        // Whether lerp(a, b, t) is invertible for every t in [0,1]. Its determinant is a cubic
+        // in t, so it keeps one sign on [0,1] if it does at the ends and at the cubic's
+        // turning points, found from its forward differences at t = 0, 1/3, 2/3, 1.
+        real d[4];
+        for (int i = 0; i < 4; i++) {
+            auto step = lerp(a, b, real(i) / 3);
+            if (!step.invertible())
+                return false;
+            d[i] = step.determinant();
+        }
+
+        // The derivative in s = 3t is A s^2 + B s + C.
+        auto d1 = d[1] - d[0];
+        auto d2 = d[2] - 2*d[1] + d[0];
+        auto d3 = d[3] - 3*d[2] + 3*d[1] - d[0];
+        auto A = d3 / 2, B = d2 - d3, C = d1 - d2/2 + d3/3;
+
+        real turning[2];
+        int count = 0;
+        if (A == 0) {
+            if (B != 0) turning[count++] = -C / B;
+        } else {
+            auto discriminant = B*B - 4*A*C;
+            if (discriminant >= 0) {
+                auto root = std::sqrt(discriminant);
+                turning[count++] = (-B - root) / (2*A);
+                turning[count++] = (-B + root) / (2*A);
+            }
+        }
+
+        for (int i = 0; i < count; i++) {
+            if (turning[i] <= 0 || turning[i] >= 3)
+                continue;
+            auto step = lerp(a, b, turning[i] / 3);
+            if (!step.invertible() || (step.determinant() > 0) != (d[0] > 0))
+                return false;
+        }
+
+        // The samples themselves must agree in sign as well.
+        for (int i = 1; i < 4; i++)
+            if ((d[i] > 0) != (d[0] > 0))
+                return false;
+        return true;
+    }
+};
+
+inline affine operator*(const affine& a, const affine& b) {
+    // Returns the transform that applies b first, then a.
+
+    affine result;
+    for (int i = 0; i < 3; i++) {
+        for (int j = 0; j < 4; j++) {
+            result.m[i][j] = a.m[i][0]*b.m[0][j] + a.m[i][1]*b.m[1][j] + a.m[i][2]*b.m[2][j];
+        }
+        result.m[i][3] += a.m[i][3];
+    }
+    return result;
+}
+
+#endif
@@ -0,0 +1,79 @@
+#ifndef ALIAS_TABLE_H
+#define ALIAS_TABLE_H
+
+#include <algorithm>
+#include <cstdint>
+#include <vector>
+
+/**
+ * Discrete distribution over the indices of a list of nonnegative weights, sampled in constant
+ * time by Walker's alias method (built with Vose's algorithm). Each index owns a bucket of
+ * equal probability, and keeps the part of it its weight fills; the rest of the bucket goes to
+ * an alias whose weight overflowed its own. A sample picks a bucket and then one of its two
+ * indices, whatever the number or spread of the weights.
+ */
+class alias_table {
+  public:
+    alias_table() = default;
+
+    alias_table(const std::vector<double>& weights) {
+        auto n = weights.size();
+        double total = 0;
+        for (auto w : weights)
+            total += w;
+        if (n == 0 || !(total > 0))
+            return;
+
+        buckets.resize(n);
+        std::vector<double> scaled(n);
+        std::vector<size_t> small, large;
+        for (size_t i = 0; i < n; i++) {
+            buckets[i].probability = float(weights[i] / total);
+            scaled[i] = weights[i] / total * n;
+            (scaled[i] < 1 ? small : large).push_back(i);
+        }
+
+        // Fill each underfull bucket from an overfull index, which then becomes underfull or
+        // stays overfull. Whatever is left fills its bucket to within rounding.
+        while (!small.empty() && !large.empty()) {
+            auto under = small.back(), over = large.back();
+            small.pop_back();
+            buckets[under].keep = float(scaled[under]);
+            buckets[under].alias = uint32_t(over);
+            scaled[over] -= 1 - scaled[under];
+            if (scaled[over] < 1) {
+                large.pop_back();
+                small.push_back(over);
+            }
+        }
+        for (auto i : large) buckets[i].keep = 1;
+        for (auto i : small) buckets[i].keep = 1;
+    }
+
+    bool empty() const { return buckets.empty(); }
+    size_t size() const { return buckets.size(); }
+    size_t memory_bytes() const { return buckets.size() * sizeof(bucket); }
+
+    size_t sample(double u) const {
+        // Returns an index drawn with probability proportional to its weight, given u uniform
+        // in [0,1). u's fraction of its bucket picks between the index and its alias.
+        auto scaled = u * buckets.size();
+        auto i = std::min(size_t(scaled), buckets.size() - 1);
+        return scaled - i < buckets[i].keep ? i : buckets[i].alias;
+    }
+
+    size_t sample() const { return sample(random_double()); }
+
+    real probability(size_t i) const { return buckets[i].probability; }
+
+  private:
+    struct bucket {
+        float    probability;  // Of index i, its weight over the total
+        float    keep = 1;     // Share of the bucket that stays with index i
+        uint32_t alias = 0;    // Index that takes the rest of the bucket
+    };
+
+    std::vector<bucket> buckets;
+};
+
+#endif
@@ -0,0 +1,106 @@
+#ifndef ANIMATION_H
+#define ANIMATION_H
+
+#include "camera.h"
+#include "flat_bvh.h"
+#include "hittable_list.h"
+
+#include <chrono>
+#include <fstream>
+#include <functional>
+#include <iomanip>
+#include <sstream>
+#include <stdexcept>
+#include <string>
+
+/**
+ * Renders a sequence of frames of a changing scene. Static objects share one BVH, built once
+ * and kept for every frame. Dynamic objects share another, which is refit after each frame's
+ * update and only rebuilt once refitting has degraded it past rebuild_threshold, so the setup
+ * cost of a frame follows how much of the scene moves rather than the scene's size.
+ *
+ * Each frame's update function changes the dynamic objects in place, for instance with
+ * transform_instance::set_transform() or triangle_mesh::set_vertices().
+ */
+class animation {
+  public:
+    camera cam;
+    double rebuild_threshold = 1.5;  // Rebuild the dynamic BVH when refitting has raised its
+                                     // SAH cost past this multiple of its cost when built
+
+    void add_static(shared_ptr<hittable> object) {
+        static_objects.add(object);
+        static_bvh = nullptr;
+    }
+
+    void add_dynamic(shared_ptr<hittable> object) {
+        dynamic_objects.add(object);
+        dynamic_bvh = nullptr;
+    }
+
+    void render_frame(std::ostream& out) {
+        // Brings the BVHs up to date with the objects' current state and renders one frame.
+
+        auto start = std::chrono::high_resolution_clock::now();
+        auto action = prepare();
+        std::chrono::duration<double> duration = std::chrono::high_resolution_clock::now() - start;
+        std::clog << "Frame setup (" << action << ") took " << duration.count() << " seconds\n";
+
+        cam.render_parallelized(world, out);
+    }
+
+    void render_frames(int frame_count, const std::function<void(int frame)>& update,
+                       const std::string& path_prefix) {
+        // Calls update for each frame in turn and renders it to path_prefix followed by the
+        // zero-padded frame number and ".ppm".
+
+        for (int frame = 0; frame < frame_count; frame++) {
+            update(frame);
+
+            std::ostringstream path;
+            path << path_prefix << std::setw(4) << std::setfill('0') << frame << ".ppm";
+            std::ofstream file(path.str());
+            if (!file)
+                throw std::runtime_error("Error: Cannot write file " + path.str());
+
+            std::clog << "Frame " << frame << " -> " << path.str() << '\n';
+            render_frame(file);
+        }
+    }
+
+  private:
+    hittable_list static_objects;
+    hittable_list dynamic_objects;
+    shared_ptr<flat_bvh> static_bvh;
+    shared_ptr<flat_bvh> dynamic_bvh;
+    hittable_list world;  // The two BVHs, as passed to the camera
+
+    std::string prepare() {
+        // Returns what was done, for the frame log.
+
+        std::string action = "refit";
+        bool rebuilt_static = false;
+
+        if (!static_bvh) {
+            static_bvh = make_shared<flat_bvh>(static_objects);
+            rebuilt_static = true;
+        }
+
+        if (!dynamic_bvh) {
+            dynamic_bvh = make_shared<flat_bvh>(dynamic_objects);
+            action = "built";
+        } else if (dynamic_bvh->update(rebuild_threshold)) {
+            action = "rebuilt";
+        }
+
+        if (rebuilt_static)
+            action += ", static BVH built";
+
+        world.clear();
+        world.add(static_bvh);
+        world.add(dynamic_bvh);
+        return action;
+    }
+};
+
+#endif
@@ -0,0 +1,291 @@
+#ifndef AREA_LIGHT_H
+#define AREA_LIGHT_H
+
+#include "alias_table.h"
+#include "hittable.h"
+#include "material.h"
+#include "onb.h"
+#include "triangle_mesh.h"
+
+/**
+ * Emitting sphere, quad, triangle or triangle mesh as seen by light sampling: enough of its
+ * geometry to pick points on it as seen from a shading point, and the emitter's material. A
+ * light is sampled by the solid angle it covers: spheres by the cone of directions toward
+ * them (by area from inside them), flat shapes by area, converted to a density over
+ * directions. A mesh picks one of its triangles by area, from an alias table, then a point on
+ * it, so the mesh as a whole is sampled uniformly by area. Power, for choosing between
+ * lights, comes from the emission averaged over the surface.
+ *
+ * The shape itself is still what rays hit; a light only describes it. Radiance is read from
+ * the hit of a ray toward the chosen point, so textured emission is evaluated where it lands.
+ */
+class area_light {
+  public:
+    enum class shape : uint8_t { sphere, quad, triangle, mesh };
+
+    static area_light sphere(const point3& center, real radius, const material* mat) {
+        area_light light(shape::sphere, center, vec3(), vec3(), mat);
+        light.radius = std::fabs(radius);
+        light.area = 4 * pi * light.radius * light.radius;
+        light.estimate_power();
+        return light;
+    }
+
+    static area_light quad(const point3& Q, const vec3& u, const vec3& v, const material* mat) {
+        area_light light(shape::quad, Q, u, v, mat);
+        light.area = cross(u, v).length();
+        light.estimate_power();
+        return light;
+    }
+
+    static area_light triangle(const point3& Q, const vec3& u, const vec3& v,
+                               const material* mat) {
+        area_light light(shape::triangle, Q, u, v, mat);
+        light.area = cross(u, v).length() / 2;
+        light.estimate_power();
+        return light;
+    }
+
+    static area_light mesh(shared_ptr<const mesh_data> data, const point3& offset,
+                           const material* mat) {
+        // Lights the mesh's faces as they are in data, moved by offset. Meshes animated with
+        // triangle_mesh::set_vertices need a new light for each frame.
+
+        area_light light(shape::mesh, offset, vec3(), vec3(), mat);
+        light.mesh_faces = data;
+
+        std::vector<double> areas(data->faces.size());
+        point3 lo(infinity, infinity, infinity), hi(-infinity, -infinity, -infinity);
+        for (size_t i = 0; i < areas.size(); i++) {
+            point3 corner;
+            vec3 u, v;
+            light.face(i, corner, u, v);
+            areas[i] = cross(u, v).length() / 2;
+            light.area += areas[i];
+
+            for (const auto& vertex : { corner, corner + u, corner + v }) {
+                for (int axis = 0; axis < 3; axis++) {
+                    lo[axis] = std::fmin(lo[axis], vertex[axis]);
+                    hi[axis] = std::fmax(hi[axis], vertex[axis]);
+                }
+            }
+        }
+
+        light.faces_by_area = make_shared<alias_table>(areas);
+        light.mesh_bounds = areas.empty() ? aabb() : aabb(lo, hi);
+        light.estimate_power();
+        return light;
+    }
+
+    shape kind() const { return light_shape; }
+    const material* emitter() const { return mat; }
+    real surface_area() const { return area; }
+    real luminance() const { return emitted_luminance; }  // Mean over the surface
+
+    real power() const {
+        // Luminance the light emits in total, for choosing between lights. Flat lights and
+        // meshes emit from both faces, as diffuse_light has no front.
+        return emitted_luminance * area * pi * (light_shape == shape::sphere ? 1 : 2);
+    }
+
+    aabb bounding_box() const {
+        if (light_shape == shape::sphere) {
+            auto rvec = vec3(radius, radius, radius);
+            return aabb(Q - rvec, Q + rvec);
+        }
+        if (light_shape == shape::mesh)
+            return mesh_bounds;
+        auto far = light_shape == shape::quad ? Q + u + v : Q + v;
+        return aabb(aabb(Q, Q + u), aabb(Q + v, far));
+    }
+
+    vec3 normal() const {
+        // Axis the light's emission is centered on: the plane normal of flat lights, which emit
+        // on both sides of it. Spheres and meshes emit in every direction.
+        return plane_normal;
+    }
+
+    bool sample(const point3& p, vec3& direction, real& distance, real& pdf) const {
+        // Chooses a point of the light visible from p. Returns false if there is none, or the
+        // unit direction and distance to the point and the density of the direction over
+        // solid angle.
+
+        if (light_shape == shape::sphere)
+            return sample_sphere(p, direction, distance, pdf);
+
+        // A mesh face is chosen with probability its share of the area, and a point on it
+        // uniformly, so the density over the mesh is that of the whole area.
+        auto corner = Q;
+        auto edge_u = u, edge_v = v, normal = plane_normal;
+        if (light_shape == shape::mesh) {
+            if (faces_by_area->empty())
+                return false;
+            face(faces_by_area->sample(), corner, edge_u, edge_v);
+            normal = unit_vector(cross(edge_u, edge_v));
+        }
+
+        real a = random_double(), b = random_double();
+        if (light_shape != shape::quad)
+            warp_to_triangle(a, b);
+
+        auto to_light = corner + a * edge_u + b * edge_v - p;
+        auto distance_squared = to_light.length_squared();
+        distance = std::sqrt(distance_squared);
+        if (!(distance > 0))
+            return false;
+        direction = to_light / distance;
+
+        auto cosine = std::fabs(dot(direction, normal));
+        if (cosine <= 0)
+            return false;
+        pdf = distance_squared / (cosine * area);
+        return true;
+    }
+
+    point3 sample_point(vec3& surface_normal) const {
+        // Returns a point chosen uniformly over the light's surface, with the surface's unit
+        // normal there, for starting light paths (see bidirectional_tracer).
+
+        if (light_shape == shape::sphere) {
+            surface_normal = random_unit_vector();
+            return Q + radius * surface_normal;
+        }
+
+        auto corner = Q;
+        auto edge_u = u, edge_v = v;
+        surface_normal = plane_normal;
+        if (light_shape == shape::mesh) {
+            if (faces_by_area->empty())
+                return Q;
+            face(faces_by_area->sample(), corner, edge_u, edge_v);
+            surface_normal = unit_vector(cross(edge_u, edge_v));
+        }
+
+        real a = random_double(), b = random_double();
+        if (light_shape != shape::quad)
+            warp_to_triangle(a, b);
+        return corner + a * edge_u + b * edge_v;
+    }
+
+  private:
+    shape  light_shape;
+    point3 Q;        // Corner of flat lights, center of spheres, offset of meshes
+    vec3   u, v;     // Edges of flat lights
+    vec3   plane_normal = vec3(0,1,0);
+    real   radius = 0;
+    real   area = 0;
+    real   emitted_luminance = 0;
+    const material* mat;
+    shared_ptr<const mesh_data>   mesh_faces;
+    shared_ptr<const alias_table> faces_by_area;
+    aabb mesh_bounds;
+
+    area_light(shape light_shape, const point3& Q, const vec3& u, const vec3& v,
+               const material* mat)
+      : light_shape(light_shape), Q(Q), u(u), v(v), mat(mat)
+    {
+        if (light_shape == shape::quad || light_shape == shape::triangle)
+            plane_normal = unit_vector(cross(u, v));
+    }
+
+    void estimate_power() {
+        // Averages the emission over a grid of points spread evenly over the light, with the
+        // texture coordinates its shape gives them, so that a textured emitter counts all of
+        // its texture rather than what lies at one point of it.
+
+        const int n = 16;
+        real sum = 0, total_weight = 0;
+        for (int j = 0; j < n; j++) {
+            for (int i = 0; i < n; i++) {
+                real a = (i + real(0.5)) / n, b = (j + real(0.5)) / n, weight = 1;
+                point3 p;
+                if (light_shape == shape::sphere) {
+                    // (a, b) are the sphere's (u, v); rows of equal v weigh as their length.
+                    auto theta = pi * b, phi = 2 * pi * a - pi;
+                    weight = std::sin(theta);
+                    p = Q + radius * vec3(std::sin(theta) * std::cos(phi), -std::cos(theta),
+                                          -std::sin(theta) * std::sin(phi));
+                } else {
+                    auto corner = Q;
+                    auto edge_u = u, edge_v = v;
+                    if (light_shape == shape::mesh) {
+                        if (faces_by_area->empty())
+                            return;
+                        face(faces_by_area->sample((j * n + i + 0.5) / (n * n)), corner,
+                             edge_u, edge_v);
+                    }
+                    if (light_shape != shape::quad)
+                        warp_to_triangle(a, b);
+                    p = corner + a * edge_u + b * edge_v;
+                }
+
+                auto c = mat->emitted(a, b, p);
+                sum += weight * (real(0.2126) * c.x() + real(0.7152) * c.y()
+                                 + real(0.0722) * c.z());
+                total_weight += weight;
+            }
+        }
+        emitted_luminance = sum / total_weight;
+    }
+
+    static void warp_to_triangle(real& a, real& b) {
+        // Maps a point uniform in the unit square to one uniform in the triangle a + b <= 1
+        // (the square-root warp). The triangle's cross sections a + b = s grow in proportion to
+        // s, so s = sqrt(a) is distributed like them, and b picks a point along the one at s.
+        auto s = std::sqrt(a);
+        a = s * (1 - b);
+        b = s * b;
+    }
+
+    void face(size_t i, point3& corner, vec3& edge_u, vec3& edge_v) const {
+        const auto& indices = mesh_faces->faces[i];
+        const auto& vertices = mesh_faces->vertices;
+        corner = vertices[indices[0]] + Q;
+        edge_u = vertices[indices[1]] - vertices[indices[0]];
+        edge_v = vertices[indices[2]] - vertices[indices[0]];
+    }
+
+    bool sample_sphere(const point3& p, vec3& direction, real& distance, real& pdf) const {
+        // Directions toward the sphere form a cone around its center, sampled uniformly.
+        auto to_center = Q - p;
+        auto distance_squared = to_center.length_squared();
+        if (distance_squared <= radius * radius) {
+            // From inside, every direction meets the sphere once, so a point is chosen by area
+            // instead, and its density converted to one over directions as for flat lights.
+            auto normal = random_unit_vector();
+            auto to_light = Q + radius * normal - p;
+            auto length_squared = to_light.length_squared();
+            distance = std::sqrt(length_squared);
+            if (!(distance > 0))
+                return false;
+            direction = to_light / distance;
+            auto cosine = std::fabs(dot(direction, normal));
+            if (cosine <= 0)
+                return false;
+            pdf = length_squared / (cosine * area);
+            return true;
+        }
+
+        // 1 - cos_theta_max is kept as sin^2 / (1 + cos), which stays accurate for small cones.
+        auto sin_squared_max = radius * radius / distance_squared;
+        auto cos_theta_max = std::sqrt(1 - sin_squared_max);
+        auto cone = sin_squared_max / (1 + cos_theta_max);
+        auto cos_theta = 1 - random_double() * cone;
+        auto sin_theta = std::sqrt(std::fmax(real(0), 1 - cos_theta * cos_theta));
+        auto phi = 2 * pi * random_double();
+
+        onb uvw(to_center);
+        direction = uvw.transform(vec3(std::cos(phi) * sin_theta, std::sin(phi) * sin_theta,
+                                       cos_theta));
+
+        // Distance to the near side of the sphere along the direction.
+        auto along = dot(direction, to_center);
+        auto across_squared = distance_squared - along * along;
+        distance = along - std::sqrt(std::fmax(real(0), radius * radius - across_squared));
+
+        pdf = 1 / (2 * pi * cone);
+        return true;
+    }
+};
+
+#endif
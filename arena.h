@@ -0,0 +1,102 @@
+#ifndef ARENA_H
+#define ARENA_H
+
+#include <algorithm>
+#include <cstddef>
+#include <cstdint>
+#include <memory>
+#include <mutex>
+#include <utility>
+#include <vector>
+
+/**
+ * Memory for the objects of a scene, handed out from large blocks instead of one heap
+ * allocation per object. Objects made with arena_make() sit next to each other in the order
+ * they were made, and nothing is returned to the heap until the arena's last object is gone,
+ * when its blocks are freed in one go.
+ *
+ * Each object's shared_ptr keeps the arena alive, so objects may safely outlive whatever
+ * made them. Their destructors still run when their last owner lets go. Allocation is
+ * thread-safe, so scenes can be built in parallel.
+ */
+class arena {
+  public:
+    explicit arena(size_t block_size = 1 << 20) : block_size(block_size) {}
+
+    arena(const arena&) = delete;
+    arena& operator=(const arena&) = delete;
+
+    void* allocate(size_t bytes, size_t alignment) {
+        std::lock_guard<std::mutex> lock(mutex);
+
+        auto start = align(next, alignment);
+        if (blocks.empty() || start + bytes > block_end) {
+            // Objects bigger than a block get a block of their own.
+            auto size = std::max(block_size, bytes + alignment);
+            blocks.emplace_back(new unsigned char[size]);
+            next = reinterpret_cast<std::uintptr_t>(blocks.back().get());
+            block_end = next + size;
+            start = align(next, alignment);
+        }
+
+        next = start + bytes;
+        bytes_allocated += bytes;
+        return reinterpret_cast<void*>(start);
+    }
+
+    size_t size() const { return bytes_allocated; }  // Bytes handed out so far
+
+  private:
+    size_t block_size;
+    std::vector<std::unique_ptr<unsigned char[]>> blocks;
+    std::uintptr_t next = 0;       // Free space in the last block
+    std::uintptr_t block_end = 0;
+    size_t bytes_allocated = 0;
+    std::mutex mutex;
+
+    static std::uintptr_t align(std::uintptr_t address, size_t alignment) {
+        return (address + alignment - 1) & ~std::uintptr_t(alignment - 1);
+    }
+};
+
+/**
+ * Standard allocator drawing from an arena, for std::allocate_shared. Deallocation does
+ * nothing: the memory goes back with the arena's blocks.
+ */
+template <typename T>
+class arena_allocator {
+  public:
+    using value_type = T;
+
+    explicit arena_allocator(shared_ptr<arena> memory) : memory(std::move(memory)) {}
+
+    template <typename U>
+    arena_allocator(const arena_allocator<U>& other) : memory(other.memory) {}
+
+    T* allocate(size_t n) {
+        return static_cast<T*>(memory->allocate(n * sizeof(T), alignof(T)));
+    }
+
+    void deallocate(T*, size_t) {}
+
+    template <typename U>
+    bool operator==(const arena_allocator<U>& other) const { return memory == other.memory; }
+
+    template <typename U>
+    bool operator!=(const arena_allocator<U>& other) const { return memory != other.memory; }
+
+  private:
+    template <typename U> friend class arena_allocator;
+
+    shared_ptr<arena> memory;
+};
+
+template <typename T, typename... Args>
+inline shared_ptr<T> arena_make(const shared_ptr<arena>& memory, Args&&... args) {
+    // Like make_shared, but allocates the object in the arena, or on the heap if there is none.
+    if (!memory)
+        return make_shared<T>(std::forward<Args>(args)...);
+    return std::allocate_shared<T>(arena_allocator<T>(memory), std::forward<Args>(args)...);
+}
+
+#endif
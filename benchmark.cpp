@@ -0,0 +1,353 @@
+#include "rtweekend.h"
+
+#include "bvh.h"
+#include "flat_bvh.h"
+#include "hittable_list.h"
+#include "material.h"
+#include "onb.h"
+#include "perlin.h"
+#include "quad.h"
+#include "scene_loader.h"
+#include "sphere.h"
+#include "triangle.h"
+
+#include <chrono>
+#include <functional>
+#include <omp.h>
+#include <string>
+
+/*
+    Acceleration structure benchmarks, kept apart from main.cpp so they can be built with
+    optimizations without touching the renderer's build:
+    "g++ benchmark.cpp -Wall -fopenmp -O2 -o benchmark"
+    "benchmark [object count] [max threads]"
+    "benchmark --check" (make check) runs only the first step below.
+
+    First, each BVH build's nearest hits are checked against testing every object, on quads and
+    triangles lying in the coordinate planes; the benchmark stops with an error if any differ.
+
+    Next, the vector math done at each bounce is timed; build with -DFRT_SIMD_VEC3 (make
+    bench_simd) to compare the SIMD vec3 against the scalar one. Perlin turbulence follows,
+    with octaves one at a time, in SIMD lanes, and culled for a distant footprint.
+
+    Then each BVH build is timed at 1, 2, 4, ... threads up to the maximum (OpenMP's default if
+    not given), and traced with a fixed set of random rays so build speed can be weighed
+    against tree quality. The quantized node formats are then compared for memory and trace
+    speed.
+
+    Last, path guiding and bidirectional path tracing are each compared with the plain path
+    tracer on the Cornell scenes (run from the repository's root), at equal time: the time of
+    the technique's render, training included, sets the samples the plain one gets. Errors are
+    against a long plain render.
+*/
+
+using bench_clock = std::chrono::high_resolution_clock;
+
+double seconds_since(bench_clock::time_point start) {
+    std::chrono::duration<double> duration = bench_clock::now() - start;
+    return duration.count();
+}
+
+hittable_list random_scene(int object_count) {
+    // Small spheres mixed with thin, randomly oriented triangles, spread through a cube whose
+    // volume grows with the object count so density stays the same.
+
+    hittable_list list;
+    auto mat = make_shared<lambertian>(color(0.5, 0.5, 0.5));
+    auto half_size = 0.5 * std::cbrt(double(object_count));
+
+    for (int i = 0; i < object_count; i++) {
+        auto center = point3::random(-half_size, half_size);
+        if (i % 4 == 0)
+            list.add(make_shared<triangle>(center, vec3::random(-2, 2), vec3::random(-0.1, 0.1), mat));
+        else
+            list.add(make_shared<sphere>(center, 0.2, mat));
+    }
+
+    return list;
+}
+
+std::vector<ray> random_rays(const hittable_list& list, int count) {
+    auto box = list.bounding_box();
+    std::vector<ray> rays;
+    rays.reserve(count);
+    for (int i = 0; i < count; i++) {
+        point3 origin(random_double(box.x.min, box.x.max),
+                      random_double(box.y.min, box.y.max),
+                      random_double(box.z.min, box.z.max));
+        rays.emplace_back(origin, random_unit_vector());
+    }
+    return rays;
+}
+
+double trace_rays(const hittable& world, const std::vector<ray>& rays) {
+    // Returns millions of rays traced per second, using every thread.
+
+    auto start = bench_clock::now();
+    int hits = 0;
+
+    #pragma omp parallel for schedule(dynamic, 1024) reduction(+:hits)
+    for (int i = 0; i < int(rays.size()); i++) {
+        hit_record rec;
+        if (world.hit(rays[i], interval(0, infinity), rec))
+            hits++;
+    }
+
+    return rays.size() / seconds_since(start) / 1e6;
+}
+
+hittable_list axis_aligned_scene(int quad_count) {
+    // Overlapping quads and triangles lying in the coordinate planes, whose boxes are flat
+    // along one axis and only kept from zero thickness by padding.
+
+    hittable_list list;
+    auto mat = make_shared<lambertian>(color(0.5, 0.5, 0.5));
+    for (int i = 0; i < quad_count; i++) {
+        auto corner = point3::random(-5, 5);
+        int normal_axis = i % 3;
+        vec3 u, v;
+        u[(normal_axis + 1) % 3] = random_double(0.5, 4);
+        v[(normal_axis + 2) % 3] = random_double(0.5, 4);
+        if (i % 2 == 0)
+            list.add(make_shared<quad>(corner, u, v, mat));
+        else
+            list.add(make_shared<triangle>(corner, u, v, mat));
+    }
+    return list;
+}
+
+int check_bvh_hits(const std::string& name, const hittable_list& list, const hittable& bvh,
+                   const std::vector<ray>& rays) {
+    // Counts the rays whose nearest hit in the BVH differs from testing every object in turn.
+
+    int mismatches = 0;
+    #pragma omp parallel for schedule(dynamic, 1024) reduction(+:mismatches)
+    for (int i = 0; i < int(rays.size()); i++) {
+        hit_record expected, found;
+        bool expected_hit = list.hit(rays[i], interval(0, infinity), expected);
+        bool found_hit = bvh.hit(rays[i], interval(0, infinity), found);
+        if (expected_hit != found_hit || (expected_hit && expected.t != found.t))
+            mismatches++;
+    }
+
+    std::clog << name << ": " << mismatches << " of " << rays.size()
+              << " rays hit differently than brute force\n";
+    return mismatches;
+}
+
+void benchmark_bounce(int bounce_count) {
+    // The vector math of a bounce: an orthonormal basis around the normal, a cosine-weighted
+    // direction brought into it, and a reflection and refraction of the incoming direction.
+    // Inputs are generated up front so random number generation isn't timed.
+
+    std::vector<vec3> normals, directions, samples;
+    for (int i = 0; i < bounce_count; i++) {
+        normals.push_back(random_unit_vector());
+        directions.push_back(vec3::random(-1, 1));
+        samples.push_back(random_cosine_direction());
+    }
+
+    auto start = bench_clock::now();
+    vec3 sum;
+    for (int i = 0; i < bounce_count; i++) {
+        const auto& normal = normals[i];
+        auto unit_direction = unit_vector(directions[i]);
+
+        onb uvw(normal);
+        sum += uvw.transform(samples[i]);
+        sum += reflect(unit_direction, normal);
+        sum += refract(unit_direction, normal, 1 / 1.5);
+    }
+    auto duration = seconds_since(start);
+
+#ifdef FRT_SIMD_VEC3
+    const char* representation = "SIMD";
+#else
+    const char* representation = "scalar";
+#endif
+    std::clog << representation << " vec3 (" << sizeof(vec3) << " bytes): "
+              << duration / bounce_count * 1e9 << " ns per bounce (checksum " << sum.length()
+              << ")\n";
+}
+
+void benchmark_noise(int point_count) {
+    // Turbulence of 7 octaves, the marble texture's, at random points.
+
+    perlin noise;
+    std::vector<point3> points;
+    for (int i = 0; i < point_count; i++)
+        points.push_back(point3::random(-10, 10));
+
+    auto time = [&](const char* name, const std::function<real(const point3&)>& turb) {
+        auto start = bench_clock::now();
+        real sum = 0;
+        for (const auto& p : points)
+            sum += turb(p);
+        auto duration = seconds_since(start);
+        std::clog << "perlin turbulence, " << name << ": " << point_count / duration / 1e6
+                  << " M evaluations/s (checksum " << sum << ")\n";
+    };
+
+    time("octave by octave", [&](const point3& p) {
+        real accum = 0, weight = 1;
+        auto temp_p = p;
+        for (int i = 0; i < 7; i++) {
+            accum += weight * noise.noise(temp_p);
+            weight *= 0.5;
+            temp_p *= 2;
+        }
+        return std::fabs(accum);
+    });
+    time(("octaves in " + std::to_string(perlin::lane_count) + " lanes").c_str(),
+         [&](const point3& p) { return noise.turb(p, 7); });
+    time("footprint 0.05", [&](const point3& p) { return noise.turb(p, 7, 0.05); });
+}
+
+void benchmark_build(const std::string& name, const hittable_list& list,
+                     const std::vector<ray>& rays, int max_threads,
+                     const std::function<shared_ptr<hittable>()>& build) {
+    for (int threads = 1; threads <= max_threads; threads *= 2) {
+        omp_set_num_threads(threads);
+
+        auto start = bench_clock::now();
+        auto bvh = build();
+        auto build_time = seconds_since(start);
+
+        std::clog << name << ", " << threads << " thread(s): built in " << build_time
+                  << " s, traced " << trace_rays(*bvh, rays) << " Mrays/s\n";
+    }
+}
+
+void benchmark_quantization(const hittable_list& list, const std::vector<ray>& rays) {
+    for (int bits : { 0, 16, 8 }) {
+        bvh_build_options options;
+        options.quantization_bits = bits;
+        flat_bvh bvh(list, options);
+
+        std::clog << "flat_bvh, " << (bits == 0 ? "double" : std::to_string(bits) + "-bit")
+                  << " boxes: " << bvh.memory_bytes() / 1048576.0 << " MiB, traced "
+                  << trace_rays(bvh, rays) << " Mrays/s\n";
+    }
+}
+
+double image_error(const std::vector<std::vector<color>>& image,
+                   const std::vector<std::vector<color>>& reference) {
+    // Root mean square difference of the displayed values, as write_color would show them.
+    double sum = 0;
+    size_t count = 0;
+    for (size_t j = 0; j < image.size(); j++) {
+        for (size_t i = 0; i < image[j].size(); i++) {
+            for (int c = 0; c < 3; c++) {
+                auto shown = std::fmin(linear_to_gamma(image[j][i][c]), 1.0);
+                auto expected = std::fmin(linear_to_gamma(reference[j][i][c]), 1.0);
+                sum += (shown - expected) * (shown - expected);
+                count++;
+            }
+        }
+    }
+    return std::sqrt(sum / count);
+}
+
+void benchmark_equal_time(const std::string& technique, bool camera::*enabled,
+                          const std::string& filename, int image_width, int samples_per_pixel,
+                          int reference_samples) {
+    // Renders the scene with the camera setting enabled turned on, then plainly in the same
+    // time, and reports both errors.
+    auto loaded = load_scene(filename);
+    auto& cam = loaded.cam;
+    cam.image_width = image_width;
+
+    cam.samples_per_pixel = reference_samples;
+    auto reference = cam.render_pixels(loaded.world);
+
+    auto render = [&](bool on, int samples, double& seconds) {
+        cam.*enabled = on;
+        cam.samples_per_pixel = samples;
+        auto start = bench_clock::now();
+        auto image = cam.render_pixels(loaded.world);
+        seconds = seconds_since(start);
+        return image_error(image, reference);
+    };
+
+    double technique_time, plain_time;
+    auto technique_error = render(true, samples_per_pixel, technique_time);
+    render(false, samples_per_pixel, plain_time);
+
+    // The plain render gets the samples that fill the other render's time, in the square
+    // counts the camera stratifies.
+    auto root = std::max(1, int(std::round(std::sqrt(samples_per_pixel * technique_time
+                                                     / plain_time))));
+    auto plain_error = render(false, root * root, plain_time);
+
+    std::clog << filename << ": " << technique << " " << samples_per_pixel << " spp in "
+              << technique_time << " s, error " << technique_error << "; plain " << root * root
+              << " spp in " << plain_time << " s, error " << plain_error << "\n";
+}
+
+int main(int argc, char* argv[]) {
+    bool check_only = argc > 1 && std::string(argv[1]) == "--check";
+    int object_count = argc > 1 && !check_only ? std::stoi(argv[1]) : 1000000;
+    int max_threads = argc > 2 ? std::stoi(argv[2]) : omp_get_max_threads();
+
+    auto flat_list = axis_aligned_scene(400);
+    auto flat_rays = random_rays(flat_list, 200000);
+    bvh_build_options typed, spatial, lbvh;
+    typed.typed_leaves = true;
+    spatial.spatial_splits = true;
+    lbvh.method = bvh_build_method::lbvh;
+    int mismatches = check_bvh_hits("bvh_node", flat_list, bvh_node(flat_list), flat_rays)
+                   + check_bvh_hits("flat_bvh SAH", flat_list, flat_bvh(flat_list), flat_rays)
+                   + check_bvh_hits("flat_bvh SAH, typed leaves", flat_list,
+                                    flat_bvh(flat_list, typed), flat_rays)
+                   + check_bvh_hits("flat_bvh SAH + spatial splits", flat_list,
+                                    flat_bvh(flat_list, spatial), flat_rays)
+                   + check_bvh_hits("flat_bvh LBVH", flat_list, flat_bvh(flat_list, lbvh),
+                                    flat_rays);
+    if (mismatches > 0) {
+        std::cerr << "Error: BVH hits differ from brute force\n";
+        return 1;
+    }
+    if (check_only)
+        return 0;
+
+    benchmark_bounce(10000000);
+    benchmark_noise(2000000);
+
+    auto list = random_scene(object_count);
+    auto rays = random_rays(list, 1000000);
+    std::clog << object_count << " objects, " << rays.size() << " rays\n";
+
+    benchmark_build("bvh_node", list, rays, 1, [&] {
+        return make_shared<bvh_node>(list);
+    });
+
+    benchmark_build("flat_bvh SAH", list, rays, max_threads, [&] {
+        return make_shared<flat_bvh>(list);
+    });
+
+    benchmark_build("flat_bvh SAH, typed leaves", list, rays, 1, [&] {
+        bvh_build_options options;
+        options.typed_leaves = true;
+        return make_shared<flat_bvh>(list, options);
+    });
+
+    benchmark_build("flat_bvh SAH + spatial splits", list, rays, max_threads, [&] {
+        bvh_build_options options;
+        options.spatial_splits = true;
+        return make_shared<flat_bvh>(list, options);
+    });
+
+    benchmark_build("flat_bvh LBVH", list, rays, max_threads, [&] {
+        bvh_build_options options;
+        options.method = bvh_build_method::lbvh;
+        return make_shared<flat_bvh>(list, options);
+    });
+
+    benchmark_quantization(list, rays);
+
+    for (auto filename : { "scenes/cornell_box.scene", "scenes/cornell_smoke.scene",
+                           "scenes/cornell_hood.scene" }) {
+        benchmark_equal_time("guided", &camera::path_guiding, filename, 64, 64, 1024);
+        benchmark_equal_time("bidirectional", &camera::bidirectional, filename, 64, 64, 1024);
+    }
+}
@@ -0,0 +1,502 @@
+#ifndef BIDIRECTIONAL_H
+#define BIDIRECTIONAL_H
+
+#include "alias_table.h"
+#include "area_light.h"
+#include "environment_light.h"
+#include "hittable.h"
+#include "light_tree.h"
+#include "material.h"
+#include "onb.h"
+
+#include <unordered_map>
+#include <vector>
+
+/**
+ * What light tracing needs to know of the camera: where its rays start, and where they cross
+ * the plane of focus, whose pixels they were aimed at. Rays choose a pixel and then a point
+ * in it uniformly, so their density over directions follows from the pixels' area there.
+ */
+struct camera_film {
+    point3 center;         // Center of the lens
+    vec3   forward;        // Unit direction the camera looks in
+    point3 corner;         // Upper left corner of the image on the plane of focus
+    vec3   pixel_delta_u;  // Offset to the pixel to the right, on the plane of focus
+    vec3   pixel_delta_v;  // Offset to the pixel below
+    int    width, height;
+    real   focus_dist;
+    bool   pinhole;        // Whether every ray starts at center (no defocus blur)
+
+    real pixel_area() const { return cross(pixel_delta_u, pixel_delta_v).length(); }
+
+    real direction_density(const vec3& direction) const {
+        // Density over solid angle of a camera ray taking direction. A point of the plane of
+        // focus spans focus_dist^2 / cos^3 of area per unit solid angle.
+        auto cos_theta = dot(unit_vector(direction), forward);
+        if (cos_theta <= 0)
+            return 0;
+        return focus_dist * focus_dist
+             / (cos_theta * cos_theta * cos_theta * pixel_area() * width * height);
+    }
+
+    bool pixel_at(const point3& lens_point, const point3& p, int& i, int& j) const {
+        // Finds the pixel whose rays from lens_point pass through p, if it is in the image.
+        auto d = p - lens_point;
+        auto along = dot(d, forward);
+        if (along <= 0)
+            return false;
+        auto q = lens_point + d * (focus_dist / along) - corner;
+        auto x = dot(q, pixel_delta_u) / pixel_delta_u.length_squared();
+        auto y = dot(q, pixel_delta_v) / pixel_delta_v.length_squared();
+        if (!(x >= 0 && x < width && y >= 0 && y < height))
+            return false;
+        i = std::min(int(x), width - 1);
+        j = std::min(int(y), height - 1);
+        return true;
+    }
+};
+
+/**
+ * Bidirectional path tracing (Veach, "Robust Monte Carlo Methods for Light Transport
+ * Simulation", chapter 10; the formulation follows PBRT). Each sample traces a subpath from
+ * the camera and another from a light, and joins every prefix of one to every prefix of the
+ * other with a shadow ray, so a path of n bounces is found by n + 2 strategies: hitting the
+ * light from the camera, sampling a light from a camera vertex, joining two middle vertices,
+ * or tracing from the light to the camera. Light that reaches the camera through glass after
+ * a diffuse bounce (caustics) is found by the last, which the path tracer can't use.
+ *
+ * Strategies are weighed by the balance heuristic, from each vertex's density of being
+ * reached from either side; only ratios of densities are needed. Materials are used through
+ * scatter() and scattering_pdf() alone: a built-in material's reflectance times cosine is its
+ * attenuation times scattering_pdf, and it samples with density scattering_pdf. Materials
+ * without a density (metal, dielectric) can be passed through but not joined at.
+ *
+ * Light paths start on the light tree's lights, chosen by luminance times area so that every
+ * point of a material's emitters is equally likely, and leave by a cosine-weighted direction
+ * on either face. Emission is taken at each light's center there, which is exact for solid
+ * colors. Emitters outside the tree, the background and the environment are only found by
+ * camera paths, and count fully. Tracing to the camera needs a pinhole; with defocus blur
+ * that strategy is left out.
+ *
+ * Light traced to the camera lands in any pixel, so it is added to light_image(), which the
+ * camera adds to its own estimates divided by the number of samples in the image.
+ */
+class bidirectional_tracer {
+  public:
+    bidirectional_tracer(const hittable& world, shared_ptr<const light_tree> lights,
+                         const camera_film& film, int max_depth, const color& background,
+                         shared_ptr<const environment_light> environment)
+      : world(world), lights(lights), film(film), max_depth(max_depth),
+        background(background), environment(environment),
+        splats(3 * size_t(film.width) * film.height, 0)
+    {
+        if (!lights)
+            return;
+
+        // Every emitter of a material gets the luminance of its first, so that points of the
+        // material's emitters all have the same density.
+        std::vector<double> weights;
+        for (const auto& light : lights->all_lights()) {
+            emitters.push_back(&light);
+            auto luminance = density_of.emplace(light.emitter(), light.luminance()).first->second;
+            weights.push_back(luminance * light.surface_area());
+            total_weight += weights.back();
+        }
+        choice = alias_table(weights);
+        for (auto& [mat, density] : density_of)
+            density = total_weight > 0 ? density / total_weight : 0;
+    }
+
+    color light_image(int i, int j) const {
+        auto k = 3 * (size_t(j) * film.width + i);
+        return color(splats[k], splats[k+1], splats[k+2]);
+    }
+
+    color sample(const ray& camera_ray) {
+        // Returns the light reaching the camera along camera_ray, from every strategy that
+        // ends at the camera there, and adds the light traced to the camera to light_image().
+
+        thread_local std::vector<path_vertex> camera_path, light_path;
+        camera_path.clear();
+        light_path.clear();
+
+        path_vertex lens;
+        lens.type = vertex_kind::camera;
+        lens.rec.p = camera_ray.origin();
+        lens.rec.normal = film.forward;
+        lens.beta = color(1,1,1);
+        camera_path.push_back(lens);
+        color escaped(0,0,0);
+        walk(camera_path, camera_ray, lens.beta, film.direction_density(camera_ray.direction()),
+             max_depth + 2, &escaped);
+
+        trace_light_path(light_path, camera_ray.time());
+
+        color total = escaped;
+        for (int t = 1; t <= int(camera_path.size()); t++) {
+            for (int s = 0; s <= int(light_path.size()); s++) {
+                auto depth = s + t - 2;
+                if ((s == 1 && t == 1) || depth < 0 || depth > max_depth)
+                    continue;
+                if (t == 1)
+                    trace_to_camera(camera_path, light_path, s, camera_ray.time());
+                else
+                    total += connect(camera_path, light_path, s, t, camera_ray.time());
+            }
+        }
+        return total;
+    }
+
+  private:
+    enum class vertex_kind : uint8_t { camera, light, surface, medium };
+
+    struct path_vertex {
+        vertex_kind type;
+        hit_record  rec;          // Where the vertex is; the camera and lights set p and normal
+        ray         incoming;     // Ray that reached the vertex, for the material's calls
+        color       beta;         // Throughput from the subpath's start, over its density
+        color       attenuation;  // From the material's scatter()
+        color       emission;     // Emitted toward the subpath's previous vertex
+        bool        scatters = false;
+        bool        delta = false;  // Scatters in a single direction, so can't be joined at
+        real        pdf_fwd = 0;    // Area density of being reached by its own subpath
+        real        pdf_rev = 0;    // Area density of being reached by the other one
+    };
+
+    const hittable& world;
+    shared_ptr<const light_tree> lights;
+    camera_film film;
+    int    max_depth;
+    color  background;
+    shared_ptr<const environment_light> environment;
+    std::vector<const area_light*> emitters;
+    alias_table choice;  // Of emitters, by luminance times area
+    double total_weight = 0;
+    std::unordered_map<const material*, real> density_of;  // Area density of a point on it
+    std::vector<real> splats;  // Light traced to the camera, by pixel and channel
+
+    static real to_area(real solid_angle_pdf, const path_vertex& from, const path_vertex& to) {
+        // Converts the density of a direction leaving from into the density of reaching to.
+        auto d = to.rec.p - from.rec.p;
+        auto distance_squared = d.length_squared();
+        if (!(distance_squared > 0))
+            return 0;
+        auto pdf = solid_angle_pdf / distance_squared;
+        if (to.type != vertex_kind::medium && to.type != vertex_kind::camera)
+            pdf *= std::fabs(dot(to.rec.normal, d)) / std::sqrt(distance_squared);
+        return pdf;
+    }
+
+    static color reflectance(const path_vertex& v, const vec3& direction) {
+        // Reflectance times cosine of the vertex's material toward direction.
+        ray out(v.rec.p, direction, v.incoming.time());
+        return v.attenuation * v.rec.mat->scattering_pdf(v.incoming, v.rec, out);
+    }
+
+    real pdf(const path_vertex& v, const path_vertex* prev, const path_vertex& next) const {
+        // Area density with which v, reached from prev, chooses the direction toward next.
+        auto direction = next.rec.p - v.rec.p;
+        real solid_angle_pdf;
+        if (v.type == vertex_kind::camera) {
+            solid_angle_pdf = film.direction_density(direction);
+        } else if (v.type == vertex_kind::light || !prev) {
+            solid_angle_pdf = emission_density(v, direction);
+        } else {
+            ray in(prev->rec.p, v.rec.p - prev->rec.p, v.incoming.time());
+            solid_angle_pdf = v.rec.mat->scattering_pdf(in, v.rec, ray(v.rec.p, direction));
+        }
+        return to_area(solid_angle_pdf, v, next);
+    }
+
+    static real emission_density(const path_vertex& v, const vec3& direction) {
+        // Lights emit cosine-weighted from either face.
+        return std::fabs(dot(v.rec.normal, unit_vector(direction))) / (2 * pi);
+    }
+
+    real transmittance(const path_vertex& a, const path_vertex& b, real time) const {
+        // Returns the light let through between two vertices: 0 if a surface is in the way,
+        // otherwise the media's transmittance along the segment.
+        auto from = offset(a, b.rec.p - a.rec.p), to = offset(b, a.rec.p - b.rec.p);
+        ray shadow(from, to - from, time);
+        auto transmitted = world.transmittance(shadow, interval(0, real(0.9999)));
+        hit_record blocker;
+        if (transmitted <= 0 || world.hit_surface(shadow, interval(0, real(0.9999)), blocker))
+            return 0;
+        return transmitted;
+    }
+
+    static point3 offset(const path_vertex& v, const vec3& direction) {
+        if (v.type == vertex_kind::camera)
+            return v.rec.p;
+        return offset_ray_origin(v.rec.p, v.rec.normal, direction, v.rec.p_error);
+    }
+
+    const area_light* sample_emitter(path_vertex& v) const {
+        // Chooses a point on a light, as the start of a light path, with its area density.
+        if (choice.empty())
+            return nullptr;
+        auto light = emitters[choice.sample()];
+        v.type = vertex_kind::light;
+        v.rec.p = light->sample_point(v.rec.normal);
+        v.rec.p_error = 0;
+        v.rec.mat = light->emitter();
+        v.emission = light->emitter()->emitted(real(0.5), real(0.5), v.rec.p);
+        v.pdf_fwd = density_of.at(light->emitter());
+        v.beta = v.emission / v.pdf_fwd;
+        return light;
+    }
+
+    void trace_light_path(std::vector<path_vertex>& path, real time) {
+        path_vertex start;
+        if (!sample_emitter(start) || !(start.pdf_fwd > 0))
+            return;
+        path.push_back(start);
+
+        // Leave on a random face, cosine-weighted around its normal.
+        onb uvw(random_double() < 0.5 ? start.rec.normal : -start.rec.normal);
+        auto direction = uvw.transform(random_cosine_direction());
+        auto pdf_dir = emission_density(start, direction);
+        if (!(pdf_dir > 0))
+            return;
+
+        auto beta = start.beta * std::fabs(dot(start.rec.normal, direction)) / pdf_dir;
+        ray r(offset(start, direction), direction, time);
+        walk(path, r, beta, pdf_dir, max_depth + 1, nullptr);
+    }
+
+    void walk(std::vector<path_vertex>& path, ray r, color beta, real pdf_dir,
+              int max_vertices, color* escaped) const {
+        // Extends path from its last vertex along r, which that vertex chose with density
+        // pdf_dir. Camera paths give escaped the light of rays that leave the scene.
+
+        while (int(path.size()) < max_vertices) {
+            hit_record rec;
+            if (!world.hit(r, interval(0, infinity), rec)) {
+                if (escaped)
+                    *escaped += beta * (environment ? environment->value(r.direction())
+                                                    : background);
+                return;
+            }
+            rec.footprint = rec.uv_footprint = 0;
+
+            path_vertex v;
+            v.type = rec.mat->type() == material_type::isotropic ? vertex_kind::medium
+                                                                  : vertex_kind::surface;
+            v.rec = rec;
+            v.incoming = r;
+            v.beta = beta;
+            v.pdf_fwd = to_area(pdf_dir, path.back(), v);
+            v.emission = rec.mat->emitted(rec.u, rec.v, rec.p);
+
+            ray scattered;
+            real scatter_pdf;
+            v.scatters = rec.mat->scatter(r, rec, v.attenuation, scattered, scatter_pdf);
+            path.push_back(v);
+            if (!v.scatters)
+                return;
+
+            auto direction = scattered.direction();
+            scattered = ray(offset_ray_origin(rec.p, rec.normal, direction, rec.p_error),
+                            direction, r.time());
+            auto scattering_pdf = rec.mat->scattering_pdf(r, rec, scattered);
+
+            auto& current = path.back();
+            auto& previous = path[path.size() - 2];
+            if (scattering_pdf <= 0) {
+                // A single direction: it has no density, and can't be chosen from elsewhere.
+                current.delta = true;
+                beta = beta * current.attenuation;
+                pdf_dir = 0;
+                previous.pdf_rev = 0;
+            } else {
+                if (!(scatter_pdf > 0))
+                    return;
+                beta = beta * current.attenuation * scattering_pdf / scatter_pdf;
+                pdf_dir = scatter_pdf;
+                ray back(rec.p, -r.direction(), r.time());
+                previous.pdf_rev = to_area(rec.mat->scattering_pdf(scattered, rec, back),
+                                           current, previous);
+            }
+            r = scattered;
+        }
+    }
+
+    color connect(std::vector<path_vertex>& camera_path, std::vector<path_vertex>& light_path,
+                  int s, int t, real time) const {
+        // Returns the weighted light of the path of s light vertices and t >= 2 camera ones.
+
+        auto& pt = camera_path[t-1];
+        if (s == 0) {
+            // The camera path found an emitter.
+            if (pt.emission.length_squared() <= 0)
+                return color(0,0,0);
+            return pt.beta * pt.emission * mis_weight(camera_path, light_path, s, t, nullptr);
+        }
+        if (!pt.scatters || pt.delta)
+            return color(0,0,0);
+
+        if (s == 1) {
+            // A new point on a light, rather than the light path's own start.
+            path_vertex light;
+            if (!sample_emitter(light))
+                return color(0,0,0);
+            auto d = light.rec.p - pt.rec.p;
+            auto distance_squared = d.length_squared();
+            auto f = reflectance(pt, d);
+            if (f.length_squared() <= 0)
+                return color(0,0,0);
+            auto transmitted = transmittance(pt, light, time);
+            if (transmitted <= 0)
+                return color(0,0,0);
+            auto cosine = std::fabs(dot(light.rec.normal, d)) / std::sqrt(distance_squared);
+            return pt.beta * f * light.beta * transmitted * cosine / distance_squared
+                 * mis_weight(camera_path, light_path, s, t, &light);
+        }
+
+        auto& qs = light_path[s-1];
+        if (!qs.scatters || qs.delta)
+            return color(0,0,0);
+        auto d = qs.rec.p - pt.rec.p;
+        auto f = reflectance(pt, d) * reflectance(qs, -d);
+        if (f.length_squared() <= 0)
+            return color(0,0,0);
+        auto transmitted = transmittance(pt, qs, time);
+        if (transmitted <= 0)
+            return color(0,0,0);
+        return pt.beta * f * qs.beta * transmitted / d.length_squared()
+             * mis_weight(camera_path, light_path, s, t, nullptr);
+    }
+
+    void trace_to_camera(std::vector<path_vertex>& camera_path,
+                         std::vector<path_vertex>& light_path, int s, real time) {
+        // Adds the light of the light path's s-th vertex seen by the camera to its pixel.
+
+        if (!film.pinhole)
+            return;
+        auto& qs = light_path[s-1];
+        auto& lens = camera_path[0];
+        if (!qs.scatters || qs.delta)
+            return;
+
+        int i, j;
+        if (!film.pixel_at(lens.rec.p, qs.rec.p, i, j))
+            return;
+        auto d = lens.rec.p - qs.rec.p;
+        auto distance_squared = d.length_squared();
+        auto cos_theta = -dot(d, film.forward) / std::sqrt(distance_squared);
+        auto f = reflectance(qs, d);
+        if (f.length_squared() <= 0)
+            return;
+        auto transmitted = transmittance(qs, lens, time);
+        if (transmitted <= 0)
+            return;
+
+        // The camera's importance for the pixel, times the cosine at the lens over the
+        // squared distance: the pixel sees focus_dist^2 / cos^3 of area per solid angle.
+        auto importance = film.focus_dist * film.focus_dist
+                        / (distance_squared * cos_theta * cos_theta * cos_theta
+                           * film.pixel_area());
+        auto light = qs.beta * f * transmitted * importance
+                   * mis_weight(camera_path, light_path, s, 1, nullptr);
+
+        auto k = 3 * (size_t(j) * film.width + i);
+        for (int c = 0; c < 3; c++) {
+            if (!std::isfinite(light[c]))
+                return;
+        }
+        for (int c = 0; c < 3; c++) {
+            #pragma omp atomic
+            splats[k + c] += light[c];
+        }
+    }
+
+    real mis_weight(std::vector<path_vertex>& camera_path, std::vector<path_vertex>& light_path,
+                    int s, int t, const path_vertex* sampled_light) const {
+        // Balance heuristic weight of the strategy (s, t) for its path: one over the sum of
+        // every strategy's density relative to its own. Moving the join one vertex toward
+        // the camera multiplies the density by that vertex's pdf_rev over its pdf_fwd, and
+        // toward the light by the light vertex's, so the ratios are built up outward from
+        // the join. The join's own ends and their neighbors get their densities from the
+        // other side first.
+
+        if (s + t == 2)
+            return 1;
+        auto remap = [](real pdf) { return pdf != 0 ? pdf : real(1); };
+
+        path_vertex* pt = &camera_path[t-1];
+        path_vertex* pt_minus = t > 1 ? &camera_path[t-2] : nullptr;
+        path_vertex* qs = nullptr;
+        path_vertex* qs_minus = s > 1 ? &light_path[s-2] : nullptr;
+        path_vertex light_start;
+        if (s == 1 && sampled_light) {
+            light_start = *sampled_light;
+            qs = &light_start;
+        } else if (s > 0) {
+            qs = &light_path[s-1];
+        }
+
+        if (s == 0) {
+            // Only emitters in the tree start light paths.
+            auto found = density_of.find(pt->rec.mat);
+            if (found == density_of.end() || !(found->second > 0))
+                return 1;
+        }
+
+        // Saved to be put back once the weight is known.
+        auto saved_pt = *pt;
+        real saved_pt_minus = pt_minus ? pt_minus->pdf_rev : 0;
+        real saved_qs_minus = qs_minus ? qs_minus->pdf_rev : 0;
+
+        path_vertex saved_qs = qs ? *qs : path_vertex();
+        if (s > 0) {
+            pt->pdf_rev = pdf(*qs, qs_minus, *pt);
+        } else {
+            pt->pdf_rev = density_of.at(pt->rec.mat);
+        }
+        pt->delta = false;
+
+        if (pt_minus) {
+            if (s > 0) {
+                pt_minus->pdf_rev = pdf(*pt, qs, *pt_minus);
+            } else {
+                auto as_light = *pt;
+                as_light.type = vertex_kind::light;
+                pt_minus->pdf_rev = pdf(as_light, nullptr, *pt_minus);
+            }
+        }
+        if (qs) {
+            qs->pdf_rev = pdf(*pt, pt_minus, *qs);
+            qs->delta = false;
+        }
+        if (qs_minus)
+            qs_minus->pdf_rev = pdf(*qs, pt, *qs_minus);
+
+        real sum = 0, ratio = 1;
+        for (int i = t - 1; i > 0; i--) {
+            ratio *= remap(camera_path[i].pdf_rev) / remap(camera_path[i].pdf_fwd);
+            if (!camera_path[i].delta && !camera_path[i-1].delta && (i > 1 || film.pinhole))
+                sum += ratio;
+        }
+        ratio = 1;
+        for (int i = s - 1; i >= 0; i--) {
+            auto& v = (i == 0 && qs == &light_start) ? light_start : light_path[i];
+            ratio *= remap(v.pdf_rev) / remap(v.pdf_fwd);
+            bool delta_before = i > 0 && light_path[i-1].delta;
+            if (!v.delta && !delta_before)
+                sum += ratio;
+        }
+
+        pt->pdf_rev = saved_pt.pdf_rev;
+        pt->delta = saved_pt.delta;
+        if (pt_minus) pt_minus->pdf_rev = saved_pt_minus;
+        if (qs) {
+            qs->pdf_rev = saved_qs.pdf_rev;
+            qs->delta = saved_qs.delta;
+        }
+        if (qs_minus) qs_minus->pdf_rev = saved_qs_minus;
+
+        return 1 / (1 + sum);
+    }
+};
+
+#endif
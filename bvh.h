@@ -39,13 +39,17 @@ class bvh_node : public hittable {
             left = objects[start];
             right = objects[start+1];
         } else {
-            std::sort(std::begin(objects) + start, std::begin(objects) + end, comparator);
-
+            // Only the halves matter, not the order within them, so partition around the
+            // median instead of sorting the whole span.
             auto mid = start + object_span/2;
+            std::nth_element(std::begin(objects) + start, std::begin(objects) + mid,
+                             std::begin(objects) + end, comparator);
+
             left = make_shared<bvh_node>(objects, start, mid);
             right = make_shared<bvh_node>(objects, mid, end);
         }
 
+        media = left->contains_media() || right->contains_media();
     }
 
     bool hit(const ray& r, interval ray_t, hit_record& rec) const override {
@@ -58,12 +62,43 @@ class bvh_node : public hittable {
         return hit_left || hit_right;
     }
 
+    bool hit_surface(const ray& r, interval ray_t, hit_record& rec) const override {
+        if (!media)
+            return hit(r, ray_t, rec);
+        if (!bbox.hit(r, ray_t))
+            return false;
+
+        bool hit_left = left->hit_surface(r, ray_t, rec);
+        auto right_t = interval(ray_t.min, hit_left ? rec.t : ray_t.max);
+        bool hit_right = right->hit_surface(r, right_t, rec);
+        return hit_left || hit_right;
+    }
+
+    bool contains_media() const override { return media; }
+
+    real transmittance(const ray& r, interval ray_t) const override {
+        if (!media || !bbox.hit(r, ray_t))
+            return 1;
+
+        // A single object is both children.
+        auto result = left->transmittance(r, ray_t);
+        if (right != left && result > 0)
+            result *= right->transmittance(r, ray_t);
+        return result;
+    }
+
     aabb bounding_box() const override { return bbox; }
 
+    aabb bounding_box_at(real time) const override {
+        if (left == right) return left->bounding_box_at(time);
+        return aabb(left->bounding_box_at(time), right->bounding_box_at(time));
+    }
+
   private:
     shared_ptr<hittable> left;
     shared_ptr<hittable> right;
     aabb bbox;
+    bool media;  // Whether either child contains_media()
 
     static bool box_compare(
         const shared_ptr<hittable> a, const shared_ptr<hittable> b, int axis_index
@@ -86,4 +121,19 @@ class bvh_node : public hittable {
     }
 };
 
+inline void collect_top_level_objects(
+    const hittable_list& list, std::vector<shared_ptr<hittable>>& objects
+) {
+    // Gathers the objects a top-level BVH over the list should be built from. Nested lists are
+    // flattened into their contents. Everything else, including BVHs and instance wrappers like
+    // translate and rotate_y, is kept whole and placed by its world-space bounding box.
+
+    for (const auto& object : list.objects) {
+        if (auto nested = std::dynamic_pointer_cast<hittable_list>(object))
+            collect_top_level_objects(*nested, objects);
+        else
+            objects.push_back(object);
+    }
+}
+
 #endif
\ No newline at end of file
@@ -1,10 +1,18 @@
 #ifndef CAMERA_H
 #define CAMERA_H
 
+#include "bidirectional.h"
+#include "bvh.h"
+#include "environment_light.h"
+#include "flat_bvh.h"
+#include "guiding_field.h"
 #include "hittable.h"
+#include "hittable_list.h"
+#include "light_tree.h"
 #include "material.h"
 #include <chrono>
 #include <omp.h>
+#include <stdexcept>
 
 class camera {
   public:
@@ -13,6 +21,8 @@ class camera {
     int    samples_per_pixel = 10;   // Count of random samples for each pixel
     int    max_depth         = 10;   // Maximum number of ray bounces into scene
     color  background;               // Scene background color
+    shared_ptr<const environment_light> environment;  // Lights the scene instead, if set
+    shared_ptr<const light_tree> lights;  // Emitters sampled directly at each bounce, if set
 
     double vfov = 90;  // Vertical view angle (field of view)
     point3 lookfrom = point3(0,0,0);   // Point camera is looking from
@@ -22,18 +32,39 @@ class camera {
     double defocus_angle = 0;  // Variation angle of rays through each pixel
     double focus_dist = 10;    // Distance from camera lookfrom point to plane of perfect focus
 
+    bool auto_accelerate = true;  // Build a top-level BVH when the world is a flat object list
+    bool path_guiding = false;    // Learn where light comes from first (see guiding_field)
+    bool bidirectional = false;   // Trace paths from the lights too (see bidirectional_tracer);
+                                  // not together with path_guiding
+
 #include <random>
 #include <iostream>
 
 /**
- * Render with parallelization (multiple cores)
+ * Render with parallelization (multiple cores), writing the image to out
  */
-void render_parallelized(const hittable& world) {
+void render_parallelized(const hittable& scene_world, std::ostream& out = std::cout) {
+    auto image = render_pixels(scene_world);
+
+    out << "P3\n" << image_width << ' ' << image_height << "\n255\n";
+    for (int j = 0; j < image_height; j++) {
+        for (int i = 0; i < image_width; i++) {
+            write_color(out, image[j][i]);
+        }
+    }
+}
+
+/**
+ * Render with parallelization (multiple cores), returning the pixels' linear colors by row
+ */
+std::vector<std::vector<color>> render_pixels(const hittable& scene_world) {
     initialize();
+    const hittable& world = accelerated(scene_world);
 
     auto start = std::chrono::high_resolution_clock::now(); // Start time of render
 
-    std::cout << "P3\n" << image_width << ' ' << image_height << "\n255\n";
+    train_guide(world);
+    auto tracer = bidirectional ? make_bidirectional_tracer(world) : nullptr;
 
     std::vector<std::vector<color>> image(image_height, std::vector<color>(image_width));
 
@@ -47,7 +78,8 @@ void render_parallelized(const hittable& world) {
             for (int s_j = 0; s_j < sqrt_spp; s_j++) {
                 for (int s_i = 0; s_i < sqrt_spp; s_i++) {
                     ray r = get_ray(i, j, s_i, s_j);
-                    pixel_color += ray_color(r, max_depth, world);  
+                    pixel_color += tracer ? tracer->sample(r)
+                                          : ray_color(r, max_depth, world, get_neighbors(r), 0);
                 }
             }
             image[j][i] = pixel_samples_scale * pixel_color;
@@ -57,10 +89,12 @@ void render_parallelized(const hittable& world) {
         std::clog << "\rScanlines remaining: " << (image_height - j) << ' ' << std::flush;
     }
 
-    // After the parallel computation, output the image
-    for (int j = 0; j < image_height; j++) {
-        for (int i = 0; i < image_width; i++) {
-            write_color(std::cout, image[j][i]);
+    // Light paths traced to the camera, one per sample, estimate every pixel at once.
+    if (tracer) {
+        auto light_scale = 1.0 / (double(image_width) * image_height * sqrt_spp * sqrt_spp);
+        for (int j = 0; j < image_height; j++) {
+            for (int i = 0; i < image_width; i++)
+                image[j][i] += light_scale * tracer->light_image(i, j);
         }
     }
 
@@ -69,15 +103,25 @@ void render_parallelized(const hittable& world) {
 
     std::clog << "\rRender complete.                 \n";
     std::clog << "Render finished in " << duration.count() << " seconds\n";
+    return image;
 }
 
 /**
- * Render default (one core)
+ * Render default (one core), writing the image to out
  */
-void render(const hittable& world) {
+void render(const hittable& scene_world, std::ostream& out = std::cout) {
+        // Light traced to the camera lands in any pixel, so bidirectional images can only be
+        // written once all of them are done.
+        if (bidirectional) {
+            render_parallelized(scene_world, out);
+            return;
+        }
+
         initialize();
-        
-        std::cout << "P3\n" << image_width << ' ' << image_height << "\n255\n";
+        const hittable& world = accelerated(scene_world);
+        train_guide(world);
+
+        out << "P3\n" << image_width << ' ' << image_height << "\n255\n";
 
         for (int j = 0; j < image_height; j++) {
             std::clog << "\rScanlines remaining: " << (image_height - j) << ' ' << std::flush;
@@ -86,10 +130,10 @@ void render(const hittable& world) {
                 for (int s_j = 0; s_j < sqrt_spp; s_j++) {
                     for (int s_i = 0; s_i < sqrt_spp; s_i++) {
                         ray r = get_ray(i, j, s_i, s_j);
-                        pixel_color += ray_color(r, max_depth, world);
+                        pixel_color += ray_color(r, max_depth, world, get_neighbors(r), 0);
                     }
                 }
-                write_color(std::cout, pixel_samples_scale * pixel_color);
+                write_color(out, pixel_samples_scale * pixel_color);
             }
         }
 
@@ -110,7 +154,21 @@ void render(const hittable& world) {
     vec3   defocus_disk_u;       // Defocus disk horizontal radius
     vec3   defocus_disk_v;       // Defocus disk vertical radius
 
+    static const size_t min_top_level_objects = 4;  // Smallest list worth a top-level BVH
+    const hittable*     top_level_source = nullptr; // World the top-level BVH was built for
+    std::vector<shared_ptr<hittable>> top_level_objects;  // Its flattened objects at build time
+    shared_ptr<hittable> top_level_bvh;              // Null if the world wasn't worth a BVH
+
+    static constexpr real bsdf_fraction = 0.5;  // Of guided bounces that sample the material
+    shared_ptr<guiding_field> guide;  // Learned by train_guide(), if path_guiding is set
+    bool recording_guide = false;     // Whether ray_color is training the guide
+
     void initialize() {
+        // Bidirectional paths choose bounces by their materials alone, so a guide would go
+        // unused.
+        if (path_guiding && bidirectional)
+            throw std::runtime_error("Error: path_guiding and bidirectional cannot be combined");
+
         image_height = int(image_width / aspect_ratio);
         image_height = (image_height < 1) ? 1 : image_height;
 
@@ -149,6 +207,104 @@ void render(const hittable& world) {
         defocus_disk_v = v * defocus_radius;
     }
 
+    const hittable& accelerated(const hittable& world) {
+        // Returns the hittable to trace rays against. A world given as a flat hittable_list
+        // would test every top-level object for every ray, so it gets a BVH over its objects
+        // (with nested lists flattened). The BVH is kept between renders and rebuilt only if
+        // the flattened objects have changed, so that changes to nested lists are seen too.
+
+        auto list = dynamic_cast<const hittable_list*>(&world);
+        if (!auto_accelerate || list == nullptr)
+            return world;
+
+        auto start = std::chrono::high_resolution_clock::now();
+        std::vector<shared_ptr<hittable>> objects;
+        collect_top_level_objects(*list, objects);
+
+        if (&world != top_level_source || objects != top_level_objects) {
+            top_level_source = &world;
+            top_level_objects = objects;
+            top_level_bvh = nullptr;
+
+            if (objects.size() >= min_top_level_objects) {
+                top_level_bvh = make_shared<flat_bvh>(objects);
+
+                std::chrono::duration<double> duration =
+                    std::chrono::high_resolution_clock::now() - start;
+                std::clog << "Built top-level BVH over " << objects.size() << " objects in "
+                          << duration.count() << " seconds\n";
+            }
+        }
+
+        return top_level_bvh ? *top_level_bvh : world;
+    }
+
+    void train_guide(const hittable& world) {
+        // Renders passes of 1, 2, 4, ... samples per pixel, until they add up to a quarter of
+        // samples_per_pixel, only to teach the guide where light arrives from. Each pass
+        // samples what the last one learned, and the image is rendered with the last pass's.
+
+        guide = nullptr;
+        if (!path_guiding)
+            return;
+
+        auto start = std::chrono::high_resolution_clock::now();
+        guide = make_shared<guiding_field>(world.bounding_box());
+        recording_guide = true;
+
+        int trained = 0, passes = 0;
+        auto budget = std::max(1, samples_per_pixel / 4);
+        for (int pass_spp = 1; trained + pass_spp <= budget; pass_spp *= 2) {
+            #pragma omp parallel for schedule(dynamic, 1) num_threads(16)
+            for (int j = 0; j < image_height; j++) {
+                for (int i = 0; i < image_width; i++) {
+                    for (int s = 0; s < pass_spp; s++) {
+                        ray r = get_ray(i, j);
+                        ray_color(r, max_depth, world, get_neighbors(r), 0);
+                    }
+                }
+            }
+            guide->refine(pass_spp);
+            trained += pass_spp;
+            passes++;
+        }
+        recording_guide = false;
+
+        std::chrono::duration<double> duration = std::chrono::high_resolution_clock::now() - start;
+        std::clog << "Trained path guide in " << passes << " passes (" << trained
+                  << " samples per pixel) in " << duration.count() << " seconds, "
+                  << guide->region_count() << " regions, "
+                  << guide->memory_bytes() / 1048576.0 << " MiB\n";
+    }
+
+    shared_ptr<bidirectional_tracer> make_bidirectional_tracer(const hittable& world) const {
+        camera_film film;
+        film.center = center;
+        film.forward = -w;
+        film.corner = pixel00_loc - 0.5 * (pixel_delta_u + pixel_delta_v);
+        film.pixel_delta_u = pixel_delta_u;
+        film.pixel_delta_v = pixel_delta_v;
+        film.width = image_width;
+        film.height = image_height;
+        film.focus_dist = focus_dist;
+        film.pinhole = defocus_angle <= 0;
+        return make_shared<bidirectional_tracer>(world, lights, film, max_depth, background,
+                                                 environment);
+    }
+
+    ray get_ray(int i, int j) const {
+        // Construct a camera ray originating from the defocus disk and directed at a randomly
+        // sampled point anywhere in the pixel i, j.
+
+        auto offset = sample_square();
+        auto pixel_sample = pixel00_loc
+                          + ((i + offset.x()) * pixel_delta_u)
+                          + ((j + offset.y()) * pixel_delta_v);
+
+        auto ray_origin = (defocus_angle <= 0) ? center : defocus_disk_sample();
+        return ray(ray_origin, pixel_sample - ray_origin, random_double());
+    }
+
     ray get_ray(int i, int j, int s_i, int s_j) const {
         // Construct a camera ray originating from the defocus disk and directed at a randomly
         // sampled point around the pixel location i, j for stratified sample square s_i, s_j.
@@ -165,6 +321,21 @@ void render(const hittable& world) {
         return ray(ray_origin, ray_direction, ray_time);
     }
 
+    ray_differential get_neighbors(const ray& r) const {
+        // Returns the rays through the same point of the neighboring pixels, from the same
+        // origin, for estimating the pixel's footprint.
+        return {
+            ray(r.origin(), r.direction() + pixel_delta_u, r.time()),
+            ray(r.origin(), r.direction() + pixel_delta_v, r.time())
+        };
+    }
+
+    static ray neighbor_at(const ray& neighbor, const hit_record& rec) {
+        // Moves a neighboring ray to where it meets the plane tangent at the hit point.
+        auto t = dot(rec.normal, rec.p - neighbor.origin()) / dot(rec.normal, neighbor.direction());
+        return ray(neighbor.at(t), neighbor.direction(), neighbor.time());
+    }
+
     vec3 sample_square_stratified(int s_i, int s_j) const {
         // Returns the vector to a random point in the square sub-pixel specified by grid
         // indices s_i and s_j, for an idealized unit square pixel [-.5,-.5] to [+.5,+.5].
@@ -186,32 +357,214 @@ void render(const hittable& world) {
         return center + (p[0] * defocus_disk_u) + (p[1] * defocus_disk_v);
     }
 
-    color ray_color(const ray& r, int depth, const hittable& world) const {
+    static real power_heuristic(real pdf, real other_pdf) {
+        // Weight of a sample drawn with pdf, when other_pdf could also have drawn it.
+        return pdf*pdf / (pdf*pdf + other_pdf*other_pdf);
+    }
+
+    static real bounce_density(const directional_quadtree* bounce_guide, real scattering_pdf,
+                               const vec3& direction) {
+        // Density with which a bounce chooses direction: the material's own, or its mix with
+        // the guide's when the bounce is guided.
+        if (!bounce_guide)
+            return scattering_pdf;
+        return bsdf_fraction * scattering_pdf + (1 - bsdf_fraction) * bounce_guide->pdf(direction);
+    }
+
+    template <typename material_class>
+    color sample_environment(const material_class& mat, const ray& r, const hit_record& rec,
+                             const color& attenuation, const hittable& world,
+                             const directional_quadtree* bounce_guide) const {
+        // Returns the light reflected toward r by the environment along one direction chosen
+        // by the environment's brightness, if no surface blocks it, less what media absorb or
+        // scatter on the way (see hittable::transmittance()). The built-in materials choose
+        // bounce directions with density scattering_pdf, or mixed with the guide's, so that is
+        // what the environment's choice is weighed against.
+
+        real light_pdf;
+        auto direction = environment->sample(light_pdf);
+        if (!(light_pdf > 0))
+            return color(0,0,0);
+
+        ray shadow(offset_ray_origin(rec.p, rec.normal, direction, rec.p_error), direction,
+                   r.time());
+        auto scattering_pdf = mat.scattering_pdf(r, rec, shadow);
+        if (scattering_pdf <= 0)
+            return color(0,0,0);
+
+        // Media are asked first: when they let nothing through, the surface test is skipped.
+        auto transmitted = world.transmittance(shadow, interval(0, infinity));
+        hit_record blocker;
+        if (transmitted <= 0 || world.hit_surface(shadow, interval(0, infinity), blocker))
+            return color(0,0,0);
+
+        auto bounce_pdf = bounce_density(bounce_guide, scattering_pdf, direction);
+        return attenuation * scattering_pdf * transmitted * environment->value(direction)
+             * power_heuristic(light_pdf, bounce_pdf) / light_pdf;
+    }
+
+    template <typename material_class>
+    color sample_light(const material_class& mat, const ray& r, const hit_record& rec,
+                       const color& attenuation, const hittable& world) const {
+        // Returns the light reflected toward r from a point of one area light, chosen by the
+        // light tree, if no surface blocks it, less what media absorb or scatter on the way.
+        // The light's radiance is read where the shadow ray lands on it, which must be within
+        // a small fraction of the sampled distance.
+
+        // Media scatter the same way in every direction, so their normal plays no part.
+        auto normal = mat.type() == material_type::isotropic ? vec3(0,0,0) : rec.normal;
+        real choice_probability;
+        auto light = lights->sample(rec.p, normal, choice_probability);
+        if (!light)
+            return color(0,0,0);
+
+        vec3 direction;
+        real distance, light_pdf;
+        if (!light->sample(rec.p, direction, distance, light_pdf))
+            return color(0,0,0);
+
+        ray shadow(offset_ray_origin(rec.p, rec.normal, direction, rec.p_error), direction,
+                   r.time());
+        auto scattering_pdf = mat.scattering_pdf(r, rec, shadow);
+        if (scattering_pdf <= 0)
+            return color(0,0,0);
+
+        auto transmitted = world.transmittance(shadow, interval(0, distance));
+        if (transmitted <= 0)
+            return color(0,0,0);
+
+        hit_record at_light;
+        if (!world.hit_surface(shadow, interval(0, infinity), at_light)
+            || at_light.mat != light->emitter() || at_light.t < distance * real(0.999))
+            return color(0,0,0);
+
+        auto emitted = at_light.mat->emitted(at_light.u, at_light.v, at_light.p);
+        return attenuation * scattering_pdf * transmitted * emitted
+             / (choice_probability * light_pdf);
+    }
+
+    color ray_color(const ray& r, int depth, const hittable& world,
+                    const ray_differential& neighbors, real bounce_pdf) const {
+        // bounce_pdf is the density with which the last surface chose r's direction when it
+        // also sampled lights directly, or 0 if it didn't.
+
         // If we've exceeded the ray bounce limit, no more light is gathered.
         if (depth <= 0)
             return color(0,0,0);
 
         hit_record rec;
 
-        // If the ray hits nothing, return the background color.
-        if (!world.hit(r, interval(0.001, infinity), rec))
-            return background;
+        // If the ray hits nothing, return the background color or the environment's light,
+        // weighed against the surface's sample of the environment.
+        if (!world.hit(r, interval(0, infinity), rec)) {
+            if (!environment)
+                return background;
+            auto light = environment->value(r.direction());
+            if (bounce_pdf > 0)
+                light *= power_heuristic(bounce_pdf, environment->pdf(r.direction()));
+            return light;
+        }
+
+        // The pixel's footprint, for texture filtering, reaches to where the neighboring
+        // pixels' rays meet the surface. A ray parallel to the surface has no footprint there,
+        // so the hit is point sampled and the footprint starts again from it.
+        ray_differential at_hit = { neighbor_at(neighbors.x, rec), neighbor_at(neighbors.y, rec) };
+        rec.footprint = std::fmax((at_hit.x.origin() - rec.p).length(),
+                                  (at_hit.y.origin() - rec.p).length());
+        if (!std::isfinite(rec.footprint)) {
+            at_hit = { ray(rec.p, neighbors.x.direction(), r.time()),
+                       ray(rec.p, neighbors.y.direction(), r.time()) };
+            rec.footprint = 0;
+        }
+        rec.uv_footprint = rec.uv_scale > 0 ? rec.footprint / rec.uv_scale : 0;
 
         ray scattered;
         color attenuation;
-        double pdf_value;
-        color color_from_emission = rec.mat->emitted(rec.u, rec.v, rec.p);
+        real pdf_value;
+        color color_from_emission;
+        real scattering_pdf;
+        ray_differential scattered_neighbors;
+        color color_from_lights(0,0,0);
+        bool specular = false;
+        bool guided_material = false;  // Whether the guide learns and samples this bounce
+        const directional_quadtree* bounce_guide = nullptr;
+
+        // One switch on the material's type covers all of its calls for this bounce.
+        bool scatters = visit_material(*rec.mat, [&](const auto& mat) {
+            color_from_emission = mat.emitted(rec.u, rec.v, rec.p);
+
+            if (!mat.scatter(r, rec, attenuation, scattered, pdf_value))
+                return false;
+
+            // Start the bounce just off the surface rather than skipping nearby hits.
+            auto direction = scattered.direction();
+            scattered = ray(offset_ray_origin(rec.p, rec.normal, direction, rec.p_error),
+                            direction, scattered.time());
+
+            scattering_pdf = mat.scattering_pdf(r, rec, scattered);
+            specular = scattering_pdf <= 0;
+
+            // Diffuse bounces choose from the guide's learned directions instead, some of the
+            // time. Their materials sample with density scattering_pdf, so the mix's density
+            // is known for either choice.
+            guided_material = guide && (mat.type() == material_type::lambertian
+                                        || mat.type() == material_type::isotropic);
+            if (guided_material && !guide->distribution(rec.p).empty())
+                bounce_guide = &guide->distribution(rec.p);
+            if (bounce_guide && !specular) {
+                if (random_double() >= bsdf_fraction) {
+                    real unused;
+                    direction = bounce_guide->sample(unused);
+                    scattered = ray(offset_ray_origin(rec.p, rec.normal, direction, rec.p_error),
+                                    direction, scattered.time());
+                    scattering_pdf = mat.scattering_pdf(r, rec, scattered);
+                }
+                pdf_value = bounce_density(bounce_guide, scattering_pdf, direction);
+            }
 
-        if (!rec.mat->scatter(r, rec, attenuation, scattered, pdf_value))
-            return color_from_emission;
+            scattered_neighbors = mat.scatter_differential(r, rec, scattered, at_hit);
+
+            if (environment && !specular)
+                color_from_lights += sample_environment(mat, r, rec, attenuation, world,
+                                                        bounce_guide);
+            if (lights && !specular)
+                color_from_lights += sample_light(mat, r, rec, attenuation, world);
+            return true;
+        });
 
-        double scattering_pdf = rec.mat->scattering_pdf(r, rec, scattered);
-        pdf_value = scattering_pdf;
+        // Emitters in the light tree were already sampled from the last bounce, if it sampled
+        // lights, so hitting them again would count their light twice.
+        if (bounce_pdf > 0 && lights && lights->covers(rec.mat))
+            color_from_emission = color(0,0,0);
 
-        color color_from_scatter =
-            (attenuation * scattering_pdf * ray_color(scattered, depth-1, world)) / pdf_value;
+        if (!scatters)
+            return color_from_emission;
+
+        // Materials without a scattering density (metal, dielectric) choose the one direction
+        // light can come from, so its light only passes through their attenuation.
+        if (specular) {
+            return color_from_emission
+                 + attenuation * ray_color(scattered, depth-1, world, scattered_neighbors, 0);
+        }
+        if (!(pdf_value > 0))
+            return color_from_emission;
+        if (scattering_pdf <= 0)  // A guided direction the material doesn't scatter into
+            return color_from_emission + color_from_lights;
+
+        auto next_bounce_pdf = environment || lights ? pdf_value : 0;
+        auto incoming = ray_color(scattered, depth-1, world, scattered_neighbors, next_bounce_pdf);
+        color color_from_scatter = attenuation * scattering_pdf * incoming / pdf_value;
+
+        // The guide learns the light arriving along each direction over the density of
+        // choosing it, so its quadrants add up to how much light they bring.
+        if (recording_guide && guided_material) {
+            auto energy = float((0.2126 * incoming.x() + 0.7152 * incoming.y()
+                                 + 0.0722 * incoming.z()) / pdf_value);
+            if (std::isfinite(energy))
+                guide->record(rec.p, scattered.direction(), energy);
+        }
 
-        return color_from_emission + color_from_scatter;
+        return color_from_emission + color_from_lights + color_from_scatter;
     }
 };
 
@@ -7,12 +7,12 @@
 
 class constant_medium : public hittable {
   public:
-    constant_medium(shared_ptr<hittable> boundary, double density, shared_ptr<texture> tex)
+    constant_medium(shared_ptr<hittable> boundary, real density, shared_ptr<texture> tex)
       : boundary(boundary), neg_inv_density(-1/density),
         phase_function(make_shared<isotropic>(tex))
     {}
 
-    constant_medium(shared_ptr<hittable> boundary, double density, const color& albedo)
+    constant_medium(shared_ptr<hittable> boundary, real density, const color& albedo)
       : boundary(boundary), neg_inv_density(-1/density),
         phase_function(make_shared<isotropic>(albedo))
     {}
@@ -23,6 +23,10 @@ class constant_medium : public hittable {
         if (!boundary->hit(r, interval::universe, rec1))
             return false;
 
+        // The medium starts after anything already hit along the ray.
+        if (rec1.t >= ray_t.max)
+            return false;
+
         if (!boundary->hit(r, interval(rec1.t+0.0001, infinity), rec2))
             return false;
 
@@ -45,18 +49,43 @@ class constant_medium : public hittable {
         rec.t = rec1.t + hit_distance / ray_length;
         rec.p = r.at(rec.t);
 
+        rec.p_error = 0;
+        rec.uv_scale = 0;
         rec.normal = vec3(1,0,0);  // arbitrary
         rec.front_face = true;     // also arbitrary
-        rec.mat = phase_function;
+        rec.mat = phase_function.get();
 
         return true;
     }
 
+    bool hit_surface(const ray&, interval, hit_record&) const override { return false; }
+
+    bool contains_media() const override { return true; }
+
+    real transmittance(const ray& r, interval ray_t) const override {
+        // Exact, from the distance the ray travels inside the boundary.
+        hit_record rec1, rec2;
+        if (!boundary->hit(r, interval::universe, rec1)
+            || !boundary->hit(r, interval(rec1.t+0.0001, infinity), rec2))
+            return 1;
+
+        auto inside = interval(std::fmax(rec1.t, ray_t.min), std::fmin(rec2.t, ray_t.max));
+        if (inside.min < 0)
+            inside.min = 0;
+        if (inside.min >= inside.max)
+            return 1;
+
+        auto distance_inside_boundary = (inside.max - inside.min) * r.direction().length();
+        return std::exp(distance_inside_boundary / neg_inv_density);
+    }
+
     aabb bounding_box() const override { return boundary->bounding_box(); }
 
+    aabb bounding_box_at(real time) const override { return boundary->bounding_box_at(time); }
+
   private:
     shared_ptr<hittable> boundary;
-    double neg_inv_density;
+    real neg_inv_density;
     shared_ptr<material> phase_function;
 };
 
@@ -0,0 +1,116 @@
+#ifndef DENSITY_GRID_H
+#define DENSITY_GRID_H
+
+#include "aabb.h"
+
+#include <algorithm>
+#include <stdexcept>
+#include <vector>
+
+/**
+ * Density of a participating medium, given at the points of a regular grid through a box and
+ * blended trilinearly between them; zero outside the box. A procedural density is sampled
+ * onto a grid once, in parallel, so that media can look up and bound every density the same
+ * way: the density anywhere in a grid cell is at most the largest of its eight corners.
+ */
+class density_grid {
+  public:
+    density_grid(const aabb& bounds, int count_x, int count_y, int count_z,
+                 std::vector<float> values)
+      : box(bounds), counts{ count_x, count_y, count_z }, values(std::move(values))
+    {
+        // Values are given x fastest, then y, then z.
+        if (count_x < 2 || count_y < 2 || count_z < 2
+            || this->values.size() != size_t(count_x) * count_y * count_z)
+            throw std::runtime_error("Error: Density grid values don't match its size");
+        set_spacing();
+    }
+
+    template <typename density_function>
+    density_grid(const aabb& bounds, int resolution, const density_function& density)
+      : box(bounds)
+    {
+        // Samples density(p) on a grid with `resolution` points along the longest side of the
+        // box and proportionally fewer along the others.
+
+        real longest = 0;
+        for (int axis = 0; axis < 3; axis++)
+            longest = std::fmax(longest, box.axis_interval(axis).size());
+        for (int axis = 0; axis < 3; axis++) {
+            auto size = box.axis_interval(axis).size();
+            counts[axis] = std::max(2, int(std::ceil(size / longest * (resolution - 1))) + 1);
+        }
+        set_spacing();
+
+        values.resize(size_t(counts[0]) * counts[1] * counts[2]);
+
+        #pragma omp parallel for schedule(dynamic, 1)
+        for (int k = 0; k < counts[2]; k++)
+            for (int j = 0; j < counts[1]; j++)
+                for (int i = 0; i < counts[0]; i++)
+                    values[index(i, j, k)] = float(std::fmax(0, density(point_at(i, j, k))));
+    }
+
+    const aabb& bounds() const { return box; }
+    int count(int axis) const { return counts[axis]; }        // Grid points along the axis
+    real spacing(int axis) const { return spacings[axis]; }   // Distance between them
+
+    size_t memory_bytes() const { return values.size() * sizeof(float); }
+
+    point3 point_at(int i, int j, int k) const {
+        return point3(box.x.min + i*spacings[0], box.y.min + j*spacings[1],
+                      box.z.min + k*spacings[2]);
+    }
+
+    real value(int i, int j, int k) const { return values[index(i, j, k)]; }
+
+    real at(const point3& p) const {
+        int cell[3];
+        real fraction[3];
+        for (int axis = 0; axis < 3; axis++) {
+            auto x = (p[axis] - box.axis_interval(axis).min) / spacings[axis];
+            if (!(x >= 0 && x <= counts[axis] - 1))
+                return 0;
+            cell[axis] = std::min(int(x), counts[axis] - 2);
+            fraction[axis] = x - cell[axis];
+        }
+
+        real result = 0;
+        for (int corner = 0; corner < 8; corner++) {
+            int di = corner & 1, dj = (corner >> 1) & 1, dk = corner >> 2;
+            auto weight = (di ? fraction[0] : 1 - fraction[0])
+                        * (dj ? fraction[1] : 1 - fraction[1])
+                        * (dk ? fraction[2] : 1 - fraction[2]);
+            result += weight * value(cell[0] + di, cell[1] + dj, cell[2] + dk);
+        }
+        return result;
+    }
+
+    real max_in(const int first[3], const int last[3]) const {
+        // Returns the largest value at the grid points from first to last, inclusive, which
+        // bounds the density over the cells between them.
+        float result = 0;
+        for (int k = first[2]; k <= last[2]; k++)
+            for (int j = first[1]; j <= last[1]; j++)
+                for (int i = first[0]; i <= last[0]; i++)
+                    result = std::max(result, values[index(i, j, k)]);
+        return result;
+    }
+
+  private:
+    aabb  box;
+    int   counts[3];
+    real  spacings[3];
+    std::vector<float> values;  // x fastest, then y, then z
+
+    void set_spacing() {
+        for (int axis = 0; axis < 3; axis++)
+            spacings[axis] = box.axis_interval(axis).size() / (counts[axis] - 1);
+    }
+
+    size_t index(int i, int j, int k) const {
+        return (size_t(k) * counts[1] + j) * counts[0] + i;
+    }
+};
+
+#endif
@@ -0,0 +1,122 @@
+#ifndef ENVIRONMENT_LIGHT_H
+#define ENVIRONMENT_LIGHT_H
+
+#include "alias_table.h"
+#include "rtw_stb_image.h"
+
+#include <algorithm>
+#include <array>
+#include <stdexcept>
+#include <string>
+#include <vector>
+
+/**
+ * Light arriving from infinitely far away in every direction, read from an equirectangular
+ * (latitude-longitude) HDR image that wraps the scene, mapped the way sphere maps (u,v): +y is
+ * the top row and u runs around from -x. Radiance is constant over each pixel.
+ *
+ * An image of a sky is mostly dim, and its sun is a few pixels, so directions chosen by the
+ * surfaces would almost never find the sun. sample() instead picks pixels with probability
+ * proportional to their luminance times their solid angle, from an alias table built at load
+ * time, and pdf() gives the density of that choice over directions, so the renderer can weigh
+ * it against the surfaces' own choices (multiple importance sampling, see camera).
+ */
+class environment_light {
+  public:
+    environment_light(const std::string& filename, real strength = 1) {
+        rtw_image image(filename.c_str(), true);
+        image_width = image.width();
+        image_height = image.height();
+        if (image_width <= 0 || image_height <= 0)
+            throw std::runtime_error("Error: Cannot load environment map " + filename);
+
+        radiance.resize(size_t(image_width) * image_height);
+        std::vector<double> weights(radiance.size());
+        for (int j = 0; j < image_height; j++) {
+            auto sin_theta = std::sin(pi * (j + 0.5) / image_height);
+            for (int i = 0; i < image_width; i++) {
+                auto pixel = image.linear_pixel(i, j);
+                auto& value = radiance[pixel_index(i, j)];
+                for (int c = 0; c < 3; c++)
+                    value[c] = float(strength * std::fmax(0.0f, pixel[c]));
+                weights[pixel_index(i, j)] = luminance(value) * sin_theta;
+            }
+        }
+
+        pixels = alias_table(weights);
+    }
+
+    color value(const vec3& direction) const {
+        int i, j;
+        real sin_theta;
+        pixel_at(direction, i, j, sin_theta);
+        const auto& value = radiance[pixel_index(i, j)];
+        return color(value[0], value[1], value[2]);
+    }
+
+    vec3 sample(real& pdf) const {
+        // Returns a direction toward the environment, chosen by brightness, and its density
+        // over solid angle in pdf.
+
+        if (pixels.empty()) {
+            pdf = 0;
+            return vec3(0,1,0);
+        }
+
+        auto pixel = pixels.sample();
+        auto i = int(pixel % image_width), j = int(pixel / image_width);
+        auto phi = 2 * pi * (i + random_double()) / image_width;
+        auto theta = pi * (1 - (j + random_double()) / image_height);
+
+        auto sin_theta = std::sin(theta);
+        pdf = density(pixel, sin_theta);
+        return vec3(-std::cos(phi) * sin_theta, -std::cos(theta), std::sin(phi) * sin_theta);
+    }
+
+    real pdf(const vec3& direction) const {
+        // Returns the density over solid angle with which sample() returns the direction.
+        if (pixels.empty())
+            return 0;
+
+        int i, j;
+        real sin_theta;
+        pixel_at(direction, i, j, sin_theta);
+        return density(pixel_index(i, j), sin_theta);
+    }
+
+    size_t memory_bytes() const {
+        return radiance.size() * sizeof(radiance[0]) + pixels.memory_bytes();
+    }
+
+  private:
+    int image_width, image_height;
+    std::vector<std::array<float, 3>> radiance;  // Row by row from the top
+    alias_table pixels;                           // Pixels by luminance times solid angle
+
+    static double luminance(const std::array<float, 3>& c) {
+        return 0.2126 * c[0] + 0.7152 * c[1] + 0.0722 * c[2];
+    }
+
+    size_t pixel_index(int i, int j) const { return size_t(j) * image_width + i; }
+
+    real density(size_t pixel, real sin_theta) const {
+        // A pixel spans (2 pi / width) by (pi / height) in longitude and latitude, and its
+        // directions are spread over that range times sin(theta) of solid angle.
+        if (sin_theta <= 0)
+            return 0;
+        auto pixel_count = real(image_width) * image_height;
+        return pixels.probability(pixel) * pixel_count / (2 * pi * pi * sin_theta);
+    }
+
+    void pixel_at(const vec3& direction, int& i, int& j, real& sin_theta) const {
+        auto d = unit_vector(direction);
+        auto theta = std::acos(std::clamp(-d.y(), real(-1), real(1)));
+        auto phi = std::atan2(-d.z(), d.x()) + pi;
+
+        i = std::clamp(int(phi / (2*pi) * image_width), 0, image_width - 1);
+        j = std::clamp(int((1 - theta / pi) * image_height), 0, image_height - 1);
+        sin_theta = std::sin(theta);
+    }
+};
+
+#endif
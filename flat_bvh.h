@@ -0,0 +1,1345 @@
+#ifndef FLAT_BVH_H
+#define FLAT_BVH_H
+
+#include "aabb.h"
+#include "hittable.h"
+#include "hittable_list.h"
+#include "typed_primitives.h"
+
+#include <algorithm>
+#include <array>
+#include <chrono>
+#include <cstdint>
+#include <iterator>
+#include <limits>
+#include <vector>
+
+/**
+ * Ways of building a flat_bvh.
+ */
+enum class bvh_build_method {
+    sah,   // Binned surface area heuristic, optionally with spatial splits
+    lbvh   // Morton-code order (a linear BVH): several times faster to build, slower to trace
+};
+
+/**
+ * Options for building a flat_bvh.
+ */
+struct bvh_build_options {
+    bvh_build_method method = bvh_build_method::sah;
+
+    int time_segments = -1;  // Time segments with their own node bounds. 0 gives static bounds;
+                             // -1 picks 1 if any object moves and 0 otherwise. One segment is
+                             // exact for straight-line motion; rotating objects may want more.
+    int max_leaf_size = 4;   // Most primitives a leaf may hold
+
+    bool spatial_splits = false;        // Let splits cut through objects, as in an SBVH. This
+                                        // helps most with long, thin or unevenly sized
+                                        // triangles. Ignored when objects move.
+    double spatial_split_budget = 0.5;  // Extra references spatial splits may add, as a
+                                        // fraction of the object count
+
+    int quantization_bits = 0;  // 8 or 16 stores each node's box in that many bits per
+                                // coordinate, relative to its parent's box, instead of in
+                                // doubles. Cuts memory at some cost in tightness. Ignored when
+                                // objects move.
+
+    bool typed_leaves = false;  // Keep copies of the built-in primitives in per-type arrays and
+                                // hit them without virtual calls (see typed_primitives), at the
+                                // cost of the copies' memory. refit() updates the copies, so
+                                // objects changed in place need a refit before rendering. The
+                                // SAH then sizes leaves of spheres to fill SIMD lanes. Traces
+                                // lists of built-in primitives about a tenth faster.
+};
+
+/**
+ * Bounding volume hierarchy stored as an array of nodes in depth-first order, built with the
+ * surface area heuristic and traversed without recursion.
+ *
+ * When objects move, each node stores its bounds at the ends of one or more time segments
+ * spanning [0,1], and traversal interpolates them by the ray time. A node then only covers
+ * where its objects are at the ray's moment instead of their whole sweep, so motion-blurred
+ * scenes traverse nearly as fast as static ones.
+ *
+ * The build is parallel under OpenMP: big subtrees are built as separate tasks, and big nodes
+ * bin their references in parallel chunks.
+ *
+ * Static trees can store node boxes quantized to 8 or 16 bits per coordinate. Each box is
+ * rounded outward on the grid spanned by its parent's decoded box, so it still encloses its
+ * contents, and traversal decodes children from the parent on the way down. Node storage
+ * shrinks from 56 bytes to 20 or 14.
+ *
+ * With typed_leaves, leaves hit spheres, quads, triangles and media through typed_primitives,
+ * with each leaf's primitives grouped by type, rather than through virtual calls. A leaf's
+ * spheres are then tested together in SIMD lanes.
+ */
+class flat_bvh : public hittable {
+  public:
+    flat_bvh(const hittable_list& list, const bvh_build_options& options = {})
+      : flat_bvh(list.objects, options) {}
+
+    flat_bvh(const std::vector<shared_ptr<hittable>>& objects,
+             const bvh_build_options& options = {})
+    {
+        build(objects, options);
+    }
+
+    bool hit(const ray& r, interval ray_t, hit_record& rec) const override {
+        bool hit_anything = false;
+        traverse(r, ray_t, [&](const node& n) {
+            if (hit_leaf(n, r, ray_t, rec)) {
+                hit_anything = true;
+                ray_t.max = rec.t;
+            }
+            return true;
+        });
+        return hit_anything;
+    }
+
+    bool hit_surface(const ray& r, interval ray_t, hit_record& rec) const override {
+        // Typed leaves hit their copies with hit(), so trees with media hit each primitive
+        // through its pointer instead.
+        if (!media)
+            return hit(r, ray_t, rec);
+
+        bool hit_anything = false;
+        traverse(r, ray_t, [&](const node& n) {
+            for (int i = 0; i < n.count; i++) {
+                if (primitives[n.offset + i]->hit_surface(r, ray_t, rec)) {
+                    hit_anything = true;
+                    ray_t.max = rec.t;
+                }
+            }
+            return true;
+        });
+        return hit_anything;
+    }
+
+    bool contains_media() const override { return media; }
+
+    real transmittance(const ray& r, interval ray_t) const override {
+        // Multiplies in each medium of the leaves the ray reaches, over the whole ray, so a
+        // medium that spatial splits put in several leaves must only be counted once.
+        if (!media)
+            return 1;
+
+        real result = 1;
+        std::vector<const hittable*> counted;
+        traverse(r, ray_t, [&](const node& n) {
+            for (int i = 0; i < n.count; i++) {
+                const hittable* object = primitives[n.offset + i].get();
+                if (!object->contains_media())
+                    continue;
+                if (split_objects) {
+                    if (std::find(counted.begin(), counted.end(), object) != counted.end())
+                        continue;
+                    counted.push_back(object);
+                }
+                result *= object->transmittance(r, ray_t);
+            }
+            return result > 0;
+        });
+        return result;
+    }
+
+    aabb bounding_box() const override { return bbox; }
+
+    aabb bounding_box_at(real time) const override {
+        if (nodes.empty() || key_count == 1)
+            return bbox;
+
+        auto t = interval(0, 1).clamp(time) * (key_count - 1);
+        auto key = std::min(int(t), key_count - 2);
+        auto blend = t - key;
+        const aabb& a = bounds[key];
+        const aabb& b = bounds[key + 1];
+
+        auto mix = [blend](const interval& i0, const interval& i1) {
+            return interval((1-blend)*i0.min + blend*i1.min, (1-blend)*i0.max + blend*i1.max);
+        };
+        return aabb(mix(a.x, b.x), mix(a.y, b.y), mix(a.z, b.z));
+    }
+
+    void refit() {
+        // Recomputes every node's bounds from its primitives' current bounds, keeping the
+        // tree's shape. This is linear in the tree size, so objects that move or deform
+        // between animation frames can be updated without a rebuild. Leaves of a tree with
+        // spatial splits take their primitives' whole bounds, which is correct but looser.
+
+        if (nodes.empty())
+            return;
+
+        bounds.resize(nodes.size() * key_count);  // Quantized trees keep no full-size bounds
+
+        #pragma omp parallel for schedule(dynamic, 256)
+        for (int index = 0; index < int(nodes.size()); index++) {
+            const node& n = nodes[index];
+            if (n.count == 0)
+                continue;
+
+            aabb* node_bounds = &bounds[size_t(index) * key_count];
+            std::fill(node_bounds, node_bounds + key_count, aabb::empty);
+            for (int i = 0; i < n.count; i++) {
+                const auto& object = primitives[n.offset + i];
+                if (key_count == 1) {
+                    node_bounds[0] = aabb(node_bounds[0], object->bounding_box());
+                    continue;
+                }
+                for (int k = 0; k < key_count; k++)
+                    node_bounds[k] = aabb(node_bounds[k],
+                                          object->bounding_box_at(real(k) / (key_count - 1)));
+            }
+        }
+
+        // Children always follow their parent, so a reverse sweep finishes both children
+        // before the parent.
+        for (int index = int(nodes.size()) - 1; index >= 0; index--) {
+            const node& n = nodes[index];
+            if (n.count > 0)
+                continue;
+
+            for (int k = 0; k < key_count; k++)
+                bounds[size_t(index)*key_count + k] =
+                    aabb(bounds[size_t(index + 1)*key_count + k],
+                         bounds[size_t(n.offset)*key_count + k]);
+        }
+
+        bbox = aabb::empty;
+        for (int k = 0; k < key_count; k++)
+            bbox = aabb(bbox, bounds[k]);
+
+        if (quantization_bits != 0)
+            quantize();
+        if (!typed.empty())
+            typed.assign(primitives);
+    }
+
+    bool update(double rebuild_threshold = 1.5) {
+        // Refits the tree, then rebuilds it if the refit has raised its SAH cost above
+        // rebuild_threshold times the cost it had when built. Returns whether it rebuilt.
+
+        refit();
+        if (sah_cost() <= rebuild_threshold * built_cost)
+            return false;
+
+        rebuild();
+        return true;
+    }
+
+    void rebuild() {
+        // Builds a new tree over the same objects with the original options.
+
+        auto objects = primitives;
+        if (build_options.spatial_splits) {
+            // Objects split by spatial splits appear in several leaves.
+            std::sort(objects.begin(), objects.end());
+            objects.erase(std::unique(objects.begin(), objects.end()), objects.end());
+        }
+        build(objects, build_options);
+    }
+
+    double sah_cost() const {
+        // Expected cost of tracing a ray through the tree by the surface area heuristic, in
+        // units of one primitive intersection, with node areas averaged over the time keys.
+
+        if (nodes.empty())
+            return 0;
+
+        auto boxes = quantization_bits != 0 ? decoded_bounds() : std::vector<aabb>();
+        const aabb* node_bounds = quantization_bits != 0 ? boxes.data() : bounds.data();
+
+        auto root_area = average_area(&node_bounds[0]);
+        if (root_area <= 0)
+            return 0;
+
+        double cost = 0;
+        for (size_t index = 0; index < nodes.size(); index++) {
+            auto area = average_area(&node_bounds[index * key_count]);
+            cost += area * (nodes[index].count > 0 ? nodes[index].count : 1);
+        }
+        return cost / root_area;
+    }
+
+    size_t node_count() const { return nodes.size(); }
+
+    size_t memory_bytes() const {
+        // Bytes held by the tree's nodes, boxes, primitive pointers and typed copies.
+        return nodes.size() * sizeof(node) + bounds.size() * sizeof(aabb)
+             + quantized16.size() * sizeof(uint16_t) + quantized8.size() * sizeof(uint8_t)
+             + primitives.size() * sizeof(shared_ptr<hittable>) + typed.memory_bytes();
+    }
+
+    double build_time() const { return build_seconds; }  // Seconds taken by the last build
+    int time_keys() const { return key_count; }
+
+  private:
+    struct node {
+        int32_t  offset;  // Interior: index of the second child (the first follows the node).
+                          // Leaf: index of the first primitive.
+        uint16_t count;   // Primitives in a leaf, 0 for interior nodes
+        uint8_t  axis;    // Split axis of an interior node
+    };
+
+    static const int max_depth = 128;   // Traversal stack size; the build keeps depth below it
+    static const int bin_count = 16;    // SAH candidate splits per axis, plus one
+
+    int key_count = 1;                             // Bounds stored per node
+    std::vector<node> nodes;
+    std::vector<aabb> bounds;                      // key_count boxes per node
+    std::vector<shared_ptr<hittable>> primitives;  // Leaf primitives, in leaf order
+    typed_primitives typed;                        // Copies of primitives, if typed_leaves
+    aabb bbox;
+    bool media = false;                  // Whether any primitive contains_media()
+    bool split_objects = false;          // Whether spatial splits put an object in several leaves
+    int quantization_bits = 0;           // 0 if the boxes are in bounds, else 8 or 16
+    std::vector<uint16_t> quantized16;   // Six codes per node: low corner, then high corner
+    std::vector<uint8_t>  quantized8;
+    bvh_build_options build_options;  // Kept for rebuilds
+    double built_cost = 0;            // SAH cost right after the last build
+    double build_seconds = 0;
+
+    // A reference to an object during the build. A spatial split can cut an object in two, so
+    // several references may name the same object, each bounded by its own part of it.
+    struct reference {
+        int  object;
+        aabb box;  // Bounds of the referenced part. In motion builds, the object's mid-time box.
+    };
+
+    // Build state shared by every subtree, released once the tree is built.
+    struct build_state {
+        const std::vector<shared_ptr<hittable>>* objects;
+        std::vector<aabb> key_boxes;  // Motion builds: key_count boxes per object
+        std::vector<uint8_t> in_lanes;  // Typed leaves: whether each object is hit in SIMD lanes
+        int    max_leaf_size;
+        bool   spatial_splits;
+        double root_area;             // Surface area of the whole tree's bounds
+        size_t reference_limit;       // Spatial splits stop once this many references exist
+        size_t reference_count;       // Updated atomically, since subtrees build in parallel
+    };
+
+    // Nodes, bounds and primitives of a subtree, laid out like the tree's own arrays. Subtrees
+    // built in parallel fill their own and are then appended to their parent's.
+    struct build_output {
+        std::vector<node> nodes;
+        std::vector<aabb> bounds;
+        std::vector<shared_ptr<hittable>> primitives;
+    };
+
+    // The cheapest split found for a node. Object splits partition the references by centroid
+    // bin; spatial splits cut space at a plane, clipping the references that straddle it.
+    struct split {
+        double cost = infinity;
+        int    axis = -1;
+        int    bin = 0;               // Object splits: last bin on the left
+        real   plane = 0;             // Spatial splits: position of the plane
+        double overlap_area = 0;      // Object splits: surface area of the children's overlap
+    };
+
+    // Subtrees and loops over fewer references than these are built serially.
+    static const size_t parallel_subtree_size = 4096;
+    static const size_t chunk_size = 16384;
+
+    void build(const std::vector<shared_ptr<hittable>>& objects,
+               const bvh_build_options& options) {
+        auto start = std::chrono::high_resolution_clock::now();
+
+        build_options = options;
+        nodes.clear();
+        bounds.clear();
+        primitives.clear();
+        typed.clear();
+        quantization_bits = 0;
+        quantized16.clear();
+        quantized8.clear();
+        bbox = aabb::empty;
+        if (objects.empty())
+            return;
+
+        int segments = options.time_segments;
+        if (segments < 0)
+            segments = any_moving(objects) ? 1 : 0;
+        key_count = segments + 1;
+
+        build_state state;
+        state.objects = &objects;
+        state.max_leaf_size = std::clamp(options.max_leaf_size, 1, 255);
+
+        // Spatial splits need one box per reference, which motion builds don't have.
+        state.spatial_splits = options.spatial_splits && key_count == 1
+                            && options.method == bvh_build_method::sah;
+        state.reference_count = objects.size();
+        state.reference_limit = objects.size()
+            + size_t(std::fmax(0.0, options.spatial_split_budget) * double(objects.size()));
+
+        std::vector<reference> references(objects.size());
+        if (key_count > 1)
+            state.key_boxes.resize(objects.size() * key_count);
+        if (options.typed_leaves)
+            state.in_lanes.resize(objects.size());
+
+        build_output out;
+        out.nodes.reserve(2 * objects.size());
+        out.bounds.reserve(2 * objects.size() * key_count);
+        out.primitives.reserve(objects.size());
+
+        // Everything below runs as tasks of this one parallel region. When the BVH is built
+        // inside another parallel region, the inner one gets a single thread and the tasks
+        // simply run in order.
+        #pragma omp parallel
+        #pragma omp single
+        {
+            for_each_chunk(objects.size(), [&](size_t, size_t begin, size_t end) {
+                for (size_t i = begin; i < end; i++) {
+                    if (options.typed_leaves) {
+                        state.in_lanes[i] = typed_primitives::type_of(*objects[i])
+                                         == typed_primitives::primitive_type::sphere;
+                    }
+                    if (key_count == 1) {
+                        references[i] = reference{ int(i), objects[i]->bounding_box() };
+                        continue;
+                    }
+                    for (int k = 0; k < key_count; k++)
+                        state.key_boxes[i*key_count + k] =
+                            objects[i]->bounding_box_at(real(k) / (key_count - 1));
+                    references[i] = reference{ int(i), objects[i]->bounding_box_at(0.5) };
+                }
+            });
+
+            aabb root_box = aabb::empty;
+            for (const auto& ref : references)
+                root_box = aabb(root_box, ref.box);
+            state.root_area = root_box.surface_area();
+
+            if (options.method == bvh_build_method::lbvh)
+                build_lbvh(state, out, references);
+            else
+                build_node(state, out, references, 0);
+        }
+
+        nodes = std::move(out.nodes);
+        bounds = std::move(out.bounds);
+        primitives = std::move(out.primitives);
+        split_objects = primitives.size() > objects.size();
+        media = std::any_of(objects.begin(), objects.end(),
+                            [](const auto& object) { return object->contains_media(); });
+
+        for (int k = 0; k < key_count; k++)
+            bbox = aabb(bbox, bounds[k]);
+
+        if (options.typed_leaves) {
+            sort_leaves_by_type();
+            typed.assign(primitives);
+        }
+
+        if (key_count == 1 && (options.quantization_bits == 8 || options.quantization_bits == 16)) {
+            quantization_bits = options.quantization_bits;
+            quantize();
+        }
+        built_cost = sah_cost();
+
+        std::chrono::duration<double> duration = std::chrono::high_resolution_clock::now() - start;
+        build_seconds = duration.count();
+    }
+
+    int begin_node(const build_state& state, build_output& out, const reference* first,
+                   const reference* last) const {
+        // Appends a node bounding the given references at each time key, returning its index.
+
+        int index = int(out.nodes.size());
+        out.nodes.push_back(node{0, 0, 0});
+        out.bounds.resize(out.bounds.size() + key_count, aabb::empty);
+
+        aabb* node_bounds = &out.bounds[size_t(index) * key_count];
+        for (auto ref = first; ref != last; ++ref)
+            grow(state, node_bounds, *ref);
+        return index;
+    }
+
+    void make_leaf(const build_state& state, build_output& out, int index,
+                   const reference* first, const reference* last) const {
+        out.nodes[index].offset = int32_t(out.primitives.size());
+        out.nodes[index].count = uint16_t(last - first);
+        for (auto ref = first; ref != last; ++ref)
+            out.primitives.push_back((*state.objects)[ref->object]);
+    }
+
+    template <typename build_left, typename build_right>
+    void build_children(build_output& out, int index, size_t count, build_left&& left,
+                        build_right&& right) const {
+        // Builds the two subtrees of node `index` with the given functions, as parallel tasks
+        // when the node is big enough to be worth it.
+
+        if (count < parallel_subtree_size) {
+            left(out);
+            out.nodes[index].offset = int32_t(out.nodes.size());
+            right(out);
+            return;
+        }
+
+        build_output left_out, right_out;
+        #pragma omp task default(shared)
+        left(left_out);
+        right(right_out);
+        #pragma omp taskwait
+
+        append(out, left_out);
+        out.nodes[index].offset = int32_t(out.nodes.size());
+        append(out, right_out);
+    }
+
+    static void append(build_output& out, build_output& subtree) {
+        // Moves a separately built subtree to the end of out, rebasing its indices.
+
+        auto node_base = int32_t(out.nodes.size());
+        auto primitive_base = int32_t(out.primitives.size());
+        for (auto n : subtree.nodes) {
+            n.offset += n.count > 0 ? primitive_base : node_base;
+            out.nodes.push_back(n);
+        }
+        out.bounds.insert(out.bounds.end(), subtree.bounds.begin(), subtree.bounds.end());
+        out.primitives.insert(out.primitives.end(),
+                              std::make_move_iterator(subtree.primitives.begin()),
+                              std::make_move_iterator(subtree.primitives.end()));
+        subtree = build_output();
+    }
+
+    template <typename function>
+    static void for_each_chunk(size_t count, function&& body) {
+        // Calls body(chunk, begin, end) on consecutive chunks of [0, count), as parallel tasks
+        // when there is more than one.
+
+        size_t chunks = chunk_count(count);
+        if (chunks == 1) {
+            body(size_t(0), size_t(0), count);
+            return;
+        }
+
+        #pragma omp taskloop default(shared) grainsize(1)
+        for (size_t c = 0; c < chunks; c++)
+            body(c, c * chunk_size, std::min(count, (c + 1) * chunk_size));
+    }
+
+    static size_t chunk_count(size_t count) {
+        return std::max<size_t>(1, (count + chunk_size - 1) / chunk_size);
+    }
+
+    // Surface area heuristic builder
+
+    void build_node(build_state& state, build_output& out, std::vector<reference>& refs,
+                    int depth) const {
+        // Builds the subtree over refs, consuming the vector.
+
+        auto count = refs.size();
+        int index = begin_node(state, out, refs.data(), refs.data() + count);
+        int axis = 0;
+        std::vector<reference> right;
+
+        if (count > 1)
+            find_split(state, &out.bounds[size_t(index) * key_count], refs, right, depth, axis);
+
+        if (right.empty()) {
+            make_leaf(state, out, index, refs.data(), refs.data() + count);
+            return;
+        }
+
+        out.nodes[index].axis = uint8_t(axis);
+        build_children(out, index, count,
+            [&](build_output& o) { build_node(state, o, refs, depth + 1); },
+            [&](build_output& o) { build_node(state, o, right, depth + 1); });
+    }
+
+    void find_split(build_state& state, const aabb* node_bounds, std::vector<reference>& refs,
+                    std::vector<reference>& right, int depth, int& axis) const {
+        // Splits the references of a node, keeping the left child's in refs and moving the
+        // right child's to right, or leaves right empty if they should stay together in a
+        // leaf.
+
+        int count = int(refs.size());
+
+        std::vector<std::array<interval, 3>> chunk_bounds(chunk_count(refs.size()));
+        for_each_chunk(refs.size(), [&](size_t chunk, size_t begin, size_t end) {
+            auto& bounds = chunk_bounds[chunk];
+            for (size_t i = begin; i < end; i++) {
+                auto c = box_center(refs[i].box);
+                for (int a = 0; a < 3; a++)
+                    bounds[a] = interval(std::fmin(bounds[a].min, c[a]),
+                                         std::fmax(bounds[a].max, c[a]));
+            }
+        });
+
+        interval centroid_bounds[3];
+        for (const auto& bounds : chunk_bounds)
+            for (int a = 0; a < 3; a++)
+                centroid_bounds[a] = interval(std::fmin(centroid_bounds[a].min, bounds[a].min),
+                                              std::fmax(centroid_bounds[a].max, bounds[a].max));
+
+        double leaf_cost = count;
+        if (!state.in_lanes.empty()) {
+            // Typed leaves hit their spheres a group of lanes at a time.
+            int in_lanes = 0;
+            for (const auto& ref : refs)
+                in_lanes += state.in_lanes[ref.object];
+            leaf_cost = count - in_lanes
+                      + std::ceil(double(in_lanes) / typed_primitives::lane_count);
+        }
+
+        // Past a generous depth, stop trusting the SAH and split evenly so the traversal
+        // stack can't overflow.
+        bool even_split = depth > max_depth - 40;
+
+        split best;
+        if (!even_split) {
+            best = find_object_split(state, node_bounds, refs, centroid_bounds);
+
+            // Only try a spatial split where the object split leaves the children overlapping
+            // by a noticeable fraction of the whole scene; elsewhere it can't gain much.
+            size_t reference_count;
+            #pragma omp atomic read
+            reference_count = state.reference_count;
+
+            if (state.spatial_splits && reference_count < state.reference_limit
+                && best.axis >= 0 && best.overlap_area > 1e-5 * state.root_area)
+            {
+                auto spatial = find_spatial_split(state, node_bounds[0], refs);
+                if (spatial.cost < best.cost && split_spatially(state, refs, right, spatial)) {
+                    axis = spatial.axis;
+                    return;
+                }
+            }
+        }
+
+        if (best.axis >= 0 && (best.cost < leaf_cost || count > state.max_leaf_size)) {
+            const interval& extent = centroid_bounds[best.axis];
+            auto middle = std::partition(refs.begin(), refs.end(), [&](const reference& ref) {
+                return bin_of(box_center(ref.box)[best.axis], extent) <= best.bin;
+            });
+            right.assign(middle, refs.end());
+            refs.erase(middle, refs.end());
+            axis = best.axis;
+            return;
+        }
+
+        if (count <= state.max_leaf_size && !even_split)
+            return;
+
+        // Either the centroids coincide, so no bin boundary separates them, or the tree is
+        // too deep: split the references in half along the widest centroid axis.
+        axis = 0;
+        for (int a = 1; a < 3; a++)
+            if (centroid_bounds[a].size() > centroid_bounds[axis].size())
+                axis = a;
+
+        auto mid = refs.begin() + count/2;
+        std::nth_element(refs.begin(), mid, refs.end(),
+            [axis](const reference& a, const reference& b) {
+                return box_center(a.box)[axis] < box_center(b.box)[axis];
+            });
+        right.assign(mid, refs.end());
+        refs.erase(mid, refs.end());
+    }
+
+    split find_object_split(const build_state& state, const aabb* node_bounds,
+                            const std::vector<reference>& refs,
+                            const interval* centroid_bounds) const {
+        // Candidate splits are the boundaries of equal-width centroid bins on each axis. Large
+        // nodes bin their references in parallel chunks and then merge the bins.
+
+        struct bins {
+            int counts[3][bin_count] = {};
+            std::vector<aabb> boxes;  // key_count boxes per bin per axis
+        };
+
+        std::vector<bins> chunk_bins(chunk_count(refs.size()));
+        for_each_chunk(refs.size(), [&](size_t chunk, size_t begin, size_t end) {
+            auto& local = chunk_bins[chunk];
+            local.boxes.assign(3 * bin_count * key_count, aabb::empty);
+            for (size_t i = begin; i < end; i++) {
+                auto c = box_center(refs[i].box);
+                for (int a = 0; a < 3; a++) {
+                    if (centroid_bounds[a].size() <= 0)
+                        continue;
+                    int b = bin_of(c[a], centroid_bounds[a]);
+                    local.counts[a][b]++;
+                    grow(state, &local.boxes[(a*bin_count + b) * key_count], refs[i]);
+                }
+            }
+        });
+
+        auto& merged = chunk_bins[0];
+        for (size_t chunk = 1; chunk < chunk_bins.size(); chunk++) {
+            for (int a = 0; a < 3; a++)
+                for (int b = 0; b < bin_count; b++)
+                    merged.counts[a][b] += chunk_bins[chunk].counts[a][b];
+            for (size_t i = 0; i < merged.boxes.size(); i++)
+                merged.boxes[i] = aabb(merged.boxes[i], chunk_bins[chunk].boxes[i]);
+        }
+
+        split best;
+        auto node_area = average_area(node_bounds);
+
+        for (int a = 0; a < 3; a++) {
+            if (centroid_bounds[a].size() <= 0)
+                continue;
+
+            const int* bin_counts = merged.counts[a];
+            const aabb* bin_boxes = &merged.boxes[a * bin_count * key_count];
+
+            // Sweep from the right to get the cost of everything right of each boundary,
+            // then from the left to total each candidate.
+            std::vector<aabb> right_boxes(bin_count * key_count, aabb::empty);
+            int right_count[bin_count];
+            std::vector<aabb> sweep(key_count, aabb::empty);
+            int running = 0;
+            for (int b = bin_count - 1; b > 0; b--) {
+                for (int k = 0; k < key_count; k++) {
+                    sweep[k] = aabb(sweep[k], bin_boxes[b*key_count + k]);
+                    right_boxes[b*key_count + k] = sweep[k];
+                }
+                running += bin_counts[b];
+                right_count[b] = running;
+            }
+
+            std::fill(sweep.begin(), sweep.end(), aabb::empty);
+            running = 0;
+            for (int b = 0; b < bin_count - 1; b++) {
+                for (int k = 0; k < key_count; k++)
+                    sweep[k] = aabb(sweep[k], bin_boxes[b*key_count + k]);
+                running += bin_counts[b];
+                if (running == 0 || right_count[b+1] == 0)
+                    continue;
+
+                const aabb* right_box = &right_boxes[(b+1)*key_count];
+                auto cost = 1 + (average_area(sweep.data()) * running
+                                 + average_area(right_box) * right_count[b+1]) / node_area;
+                if (cost < best.cost) {
+                    best.cost = cost;
+                    best.axis = a;
+                    best.bin = b;
+                    best.overlap_area = sweep[0].intersect(right_box[0]).surface_area();
+                }
+            }
+        }
+
+        return best;
+    }
+
+    split find_spatial_split(const build_state& state, const aabb& node_box,
+                             const std::vector<reference>& refs) const {
+        // Candidate planes divide the node's bounds into equal-width bins on each axis. A
+        // reference counts toward every bin it overlaps, clipped to that bin, so the children
+        // of a spatial split can share objects but not space.
+
+        struct bins {
+            aabb boxes[bin_count];
+            int entries[bin_count] = {};  // References starting in each bin
+            int exits[bin_count] = {};    // References ending in each bin
+        };
+
+        split best;
+        auto node_area = node_box.surface_area();
+
+        for (int a = 0; a < 3; a++) {
+            const interval& extent = node_box.axis_interval(a);
+            if (extent.size() <= 0)
+                continue;
+
+            auto bin_width = extent.size() / bin_count;
+            auto plane_at = [&](int b) {
+                return b == bin_count ? extent.max : extent.min + b * bin_width;
+            };
+
+            std::vector<bins> chunk_bins(chunk_count(refs.size()));
+            for_each_chunk(refs.size(), [&](size_t chunk, size_t begin, size_t end) {
+                auto& local = chunk_bins[chunk];
+                for (size_t i = begin; i < end; i++) {
+                    const auto& ref = refs[i];
+                    const interval& span = ref.box.axis_interval(a);
+                    int first = bin_of(span.min, extent);
+                    int last = bin_of(span.max, extent);
+                    local.entries[first]++;
+                    local.exits[last]++;
+
+                    if (first == last) {
+                        local.boxes[first] = aabb(local.boxes[first], ref.box);
+                        continue;
+                    }
+
+                    for (int b = first; b <= last; b++) {
+                        aabb slab = ref.box;
+                        axis_of(slab, a) = interval(std::fmax(span.min, plane_at(b)),
+                                                    std::fmin(span.max, plane_at(b+1)));
+                        auto part = (*state.objects)[ref.object]->bounding_box_in(slab);
+                        if (!part.is_empty())
+                            local.boxes[b] = aabb(local.boxes[b], part);
+                    }
+                }
+            });
+
+            auto& merged = chunk_bins[0];
+            for (size_t chunk = 1; chunk < chunk_bins.size(); chunk++) {
+                for (int b = 0; b < bin_count; b++) {
+                    merged.boxes[b] = aabb(merged.boxes[b], chunk_bins[chunk].boxes[b]);
+                    merged.entries[b] += chunk_bins[chunk].entries[b];
+                    merged.exits[b] += chunk_bins[chunk].exits[b];
+                }
+            }
+
+            double right_area[bin_count];
+            int right_count[bin_count];
+            aabb sweep = aabb::empty;
+            int running = 0;
+            for (int b = bin_count - 1; b > 0; b--) {
+                sweep = aabb(sweep, merged.boxes[b]);
+                running += merged.exits[b];
+                right_area[b] = sweep.surface_area();
+                right_count[b] = running;
+            }
+
+            sweep = aabb::empty;
+            running = 0;
+            for (int b = 0; b < bin_count - 1; b++) {
+                sweep = aabb(sweep, merged.boxes[b]);
+                running += merged.entries[b];
+                if (running == 0 || right_count[b+1] == 0)
+                    continue;
+
+                auto cost = 1 + (sweep.surface_area() * running
+                                 + right_area[b+1] * right_count[b+1]) / node_area;
+                if (cost < best.cost) {
+                    best.cost = cost;
+                    best.axis = a;
+                    best.plane = plane_at(b+1);
+                }
+            }
+        }
+
+        return best;
+    }
+
+    bool split_spatially(build_state& state, std::vector<reference>& refs,
+                         std::vector<reference>& right, const split& s) const {
+        // Divides the references at the split plane, clipping each one that straddles it into
+        // a part on either side. Returns false, leaving refs untouched, if a side comes out
+        // empty.
+
+        std::vector<reference> left;
+        left.reserve(refs.size());
+        right.reserve(refs.size() / 2);
+
+        for (const auto& ref : refs) {
+            const interval& span = ref.box.axis_interval(s.axis);
+
+            if (span.max <= s.plane) {
+                left.push_back(ref);
+            } else if (span.min >= s.plane) {
+                right.push_back(ref);
+            } else {
+                aabb left_slab = ref.box, right_slab = ref.box;
+                axis_of(left_slab, s.axis).max = s.plane;
+                axis_of(right_slab, s.axis).min = s.plane;
+
+                const auto& object = (*state.objects)[ref.object];
+                auto left_part = object->bounding_box_in(left_slab);
+                auto right_part = object->bounding_box_in(right_slab);
+
+                if (right_part.is_empty())
+                    left.push_back(ref);
+                else if (left_part.is_empty())
+                    right.push_back(ref);
+                else {
+                    left.push_back(reference{ ref.object, left_part });
+                    right.push_back(reference{ ref.object, right_part });
+                }
+            }
+        }
+
+        if (left.empty() || right.empty()) {
+            right.clear();
+            return false;
+        }
+
+        auto added = left.size() + right.size() - refs.size();
+        #pragma omp atomic
+        state.reference_count += added;
+
+        refs.swap(left);
+        return true;
+    }
+
+    // Linear BVH builder
+
+    void build_lbvh(build_state& state, build_output& out, std::vector<reference>& refs) const {
+        // Sorts the references along a Morton (Z-order) curve through their centroids, so that
+        // nearby references end up adjacent, then splits each range where the codes of its
+        // first and last references first differ. That costs a sort and a few linear passes,
+        // far less than the SAH, at the price of a somewhat slower tree to trace.
+
+        aabb centroid_box = aabb::empty;
+        for (const auto& ref : refs) {
+            auto c = box_center(ref.box);
+            centroid_box.x = interval(std::fmin(centroid_box.x.min, c.x()),
+                                      std::fmax(centroid_box.x.max, c.x()));
+            centroid_box.y = interval(std::fmin(centroid_box.y.min, c.y()),
+                                      std::fmax(centroid_box.y.max, c.y()));
+            centroid_box.z = interval(std::fmin(centroid_box.z.min, c.z()),
+                                      std::fmax(centroid_box.z.max, c.z()));
+        }
+
+        std::vector<uint32_t> codes(refs.size());
+        for_each_chunk(refs.size(), [&](size_t, size_t begin, size_t end) {
+            for (size_t i = begin; i < end; i++)
+                codes[i] = morton_code(box_center(refs[i].box), centroid_box);
+        });
+
+        radix_sort(codes, refs);
+        build_lbvh_node(state, out, refs, codes, 0, refs.size());
+    }
+
+    void build_lbvh_node(const build_state& state, build_output& out,
+                         const std::vector<reference>& refs, const std::vector<uint32_t>& codes,
+                         size_t begin, size_t end) const {
+        auto count = end - begin;
+        int index = begin_node(state, out, &refs[begin], &refs[begin] + count);
+
+        if (count <= size_t(state.max_leaf_size)) {
+            make_leaf(state, out, index, &refs[begin], &refs[begin] + count);
+            return;
+        }
+
+        // Split at the highest bit where the range's codes differ. The codes are sorted and
+        // agree on every higher bit, so the ones with it clear all come first. References
+        // with identical codes are split in half.
+        size_t mid = begin + count/2;
+        int axis = 0;
+        auto differing = codes[begin] ^ codes[end - 1];
+        if (differing != 0) {
+            int bit = 31;
+            while (!(differing >> bit))
+                bit--;
+            mid = size_t(std::partition_point(
+                codes.begin() + begin, codes.begin() + end,
+                [bit](uint32_t code) { return !((code >> bit) & 1); }) - codes.begin());
+            axis = 2 - bit % 3;
+        }
+
+        out.nodes[index].axis = uint8_t(axis);
+        build_children(out, index, count,
+            [&](build_output& o) { build_lbvh_node(state, o, refs, codes, begin, mid); },
+            [&](build_output& o) { build_lbvh_node(state, o, refs, codes, mid, end); });
+    }
+
+    static uint32_t morton_code(const point3& p, const aabb& box) {
+        // Interleaves 10 bits of each coordinate within the box, x in the highest bit.
+
+        auto spread = [](uint32_t v) {
+            v = (v | (v << 16)) & 0x030000FF;
+            v = (v | (v <<  8)) & 0x0300F00F;
+            v = (v | (v <<  4)) & 0x030C30C3;
+            v = (v | (v <<  2)) & 0x09249249;
+            return v;
+        };
+        auto quantize = [](double v, const interval& extent) {
+            if (extent.size() <= 0)
+                return uint32_t(0);
+            return uint32_t(std::clamp((v - extent.min) / extent.size() * 1024.0, 0.0, 1023.0));
+        };
+
+        return (spread(quantize(p.x(), box.x)) << 2)
+             | (spread(quantize(p.y(), box.y)) << 1)
+             |  spread(quantize(p.z(), box.z));
+    }
+
+    static void radix_sort(std::vector<uint32_t>& codes, std::vector<reference>& refs) {
+        // Sorts the codes, and the references along with them, eight bits at a time. Morton
+        // codes only use 30 bits, so four passes cover them.
+
+        std::vector<uint32_t> codes_out(codes.size());
+        std::vector<reference> refs_out(refs.size());
+
+        for (int shift = 0; shift < 32; shift += 8) {
+            size_t offsets[256] = {};
+            for (auto code : codes)
+                offsets[(code >> shift) & 0xFF]++;
+
+            size_t total = 0;
+            for (auto& offset : offsets) {
+                auto bucket = offset;
+                offset = total;
+                total += bucket;
+            }
+
+            for (size_t i = 0; i < codes.size(); i++) {
+                auto slot = offsets[(codes[i] >> shift) & 0xFF]++;
+                codes_out[slot] = codes[i];
+                refs_out[slot] = refs[i];
+            }
+
+            codes.swap(codes_out);
+            refs.swap(refs_out);
+        }
+    }
+
+    void grow(const build_state& state, aabb* boxes, const reference& ref) const {
+        // Extends key_count boxes by the reference's bounds at each time key.
+        if (key_count == 1) {
+            boxes[0] = aabb(boxes[0], ref.box);
+            return;
+        }
+        const aabb* object_boxes = &state.key_boxes[size_t(ref.object) * key_count];
+        for (int k = 0; k < key_count; k++)
+            boxes[k] = aabb(boxes[k], object_boxes[k]);
+    }
+
+    // Quantized boxes
+
+    struct decoded_box {
+        real lo[3], hi[3];
+    };
+
+    // A code q puts the low side at parent.lo + q*step and the high side at
+    // parent.hi - (scale-q)*step, so code 0 and code scale land exactly on the parent's sides.
+    template <typename code>
+    static decoded_box decode(const code* codes, const decoded_box& parent) {
+        const real scale = std::numeric_limits<code>::max();
+        decoded_box box;
+        for (int a = 0; a < 3; a++) {
+            auto step = (parent.hi[a] - parent.lo[a]) / scale;
+            box.lo[a] = parent.lo[a] + codes[a] * step;
+            box.hi[a] = parent.hi[a] - (scale - codes[3 + a]) * step;
+        }
+        return box;
+    }
+
+    template <typename code>
+    static void encode(const aabb& box, const decoded_box& parent, code* codes) {
+        // Rounds the box outward to the parent's grid, checking each side against the exact
+        // decoding so round-off can't leave it inside the box.
+
+        const int scale = std::numeric_limits<code>::max();
+        for (int a = 0; a < 3; a++) {
+            const interval& extent = box.axis_interval(a);
+            auto step = (parent.hi[a] - parent.lo[a]) / scale;
+            int lo = 0, hi = scale;
+
+            if (step > 0) {
+                lo = std::clamp(int(std::floor((extent.min - parent.lo[a]) / step)), 0, scale);
+                hi = std::clamp(scale - int(std::floor((parent.hi[a] - extent.max) / step)),
+                                0, scale);
+            }
+            while (lo > 0 && parent.lo[a] + lo * step > extent.min)
+                lo--;
+            while (hi < scale && parent.hi[a] - (scale - hi) * step < extent.max)
+                hi++;
+
+            codes[a] = code(lo);
+            codes[3 + a] = code(hi);
+        }
+    }
+
+    static decoded_box to_decoded(const aabb& box) {
+        return decoded_box{ {box.x.min, box.y.min, box.z.min}, {box.x.max, box.y.max, box.z.max} };
+    }
+
+    void quantize() {
+        // Replaces bounds with codes relative to each node's parent. The root box is bbox.
+
+        if (quantization_bits == 16)
+            quantize_to(quantized16);
+        else
+            quantize_to(quantized8);
+
+        bounds.clear();
+        bounds.shrink_to_fit();
+    }
+
+    template <typename code>
+    void quantize_to(std::vector<code>& codes) {
+        // Parents come before their children, so one forward pass can encode every node
+        // against its parent's already decoded box.
+
+        std::vector<decoded_box> decoded(nodes.size());
+        codes.assign(nodes.size() * 6, 0);
+
+        decoded[0] = to_decoded(bbox);
+        for (int index = 0; index < int(nodes.size()); index++) {
+            const node& n = nodes[index];
+            if (n.count > 0)
+                continue;
+
+            for (int child : { index + 1, int(n.offset) }) {
+                encode(bounds[child], decoded[index], &codes[size_t(child) * 6]);
+                decoded[child] = decode(&codes[size_t(child) * 6], decoded[index]);
+            }
+        }
+    }
+
+    std::vector<aabb> decoded_bounds() const {
+        // Decodes every node's box, for cost estimates.
+
+        std::vector<decoded_box> decoded(nodes.size());
+        std::vector<aabb> boxes(nodes.size());
+
+        decoded[0] = to_decoded(bbox);
+        for (int index = 0; index < int(nodes.size()); index++) {
+            const node& n = nodes[index];
+            const auto& box = decoded[index];
+            boxes[index] = aabb(interval(box.lo[0], box.hi[0]), interval(box.lo[1], box.hi[1]),
+                                interval(box.lo[2], box.hi[2]));
+            if (n.count > 0)
+                continue;
+
+            for (int child : { index + 1, int(n.offset) }) {
+                decoded[child] = quantization_bits == 16
+                    ? decode(&quantized16[size_t(child) * 6], box)
+                    : decode(&quantized8[size_t(child) * 6], box);
+            }
+        }
+        return boxes;
+    }
+
+    template <typename leaf_visitor>
+    void traverse(const ray& r, interval& ray_t, leaf_visitor&& visit_leaf) const {
+        // Calls visit_leaf(leaf) for each leaf whose box the ray enters within ray_t, nearer
+        // ones first, until it returns false. The visitor may shorten ray_t, to cull nodes
+        // behind a hit.
+
+        if (nodes.empty())
+            return;
+
+        if (quantization_bits != 0) {
+            if (quantization_bits == 16)
+                traverse_quantized(r, ray_t, quantized16.data(), visit_leaf);
+            else
+                traverse_quantized(r, ray_t, quantized8.data(), visit_leaf);
+            return;
+        }
+
+        // Locate the ray time within the time keys.
+        int key = 0;
+        real blend = 0;
+        if (key_count > 1) {
+            auto t = interval(0, 1).clamp(r.time()) * (key_count - 1);
+            key = std::min(int(t), key_count - 2);
+            blend = t - key;
+        }
+
+        const point3& orig = r.origin();
+        const vec3 inv_dir(1 / r.direction().x(), 1 / r.direction().y(), 1 / r.direction().z());
+        const bool dir_negative[3] = { inv_dir.x() < 0, inv_dir.y() < 0, inv_dir.z() < 0 };
+
+        int stack[max_depth];
+        int stack_size = 0;
+        int index = 0;
+
+        while (true) {
+            const node& n = nodes[index];
+
+            if (hit_node_box(index, key, blend, orig, inv_dir, ray_t)) {
+                if (n.count > 0) {
+                    if (!visit_leaf(n))
+                        return;
+                } else {
+                    // Visit the child nearer the ray origin first, so the farther one is more
+                    // likely to be culled by a closer hit.
+                    if (dir_negative[n.axis]) {
+                        stack[stack_size++] = index + 1;
+                        index = n.offset;
+                    } else {
+                        stack[stack_size++] = n.offset;
+                        index = index + 1;
+                    }
+                    continue;
+                }
+            }
+
+            if (stack_size == 0)
+                break;
+            index = stack[--stack_size];
+        }
+    }
+
+    template <typename code, typename leaf_visitor>
+    void traverse_quantized(const ray& r, interval& ray_t, const code* codes,
+                            leaf_visitor& visit_leaf) const {
+        // Traversal for quantized trees. Boxes can only be decoded from their parent's, so
+        // each interior node decodes and tests both children, then descends into the nearer
+        // one and stacks the other along with its decoded box.
+
+        struct entry {
+            int index;
+            real t_enter;
+            decoded_box box;
+        };
+
+        const point3& orig = r.origin();
+        const vec3 inv_dir(1 / r.direction().x(), 1 / r.direction().y(), 1 / r.direction().z());
+
+        auto slab_test = [&](const decoded_box& box, real& t_enter) {
+            interval t = ray_t;
+            for (int axis = 0; axis < 3; axis++) {
+                auto t0 = (box.lo[axis] - orig[axis]) * inv_dir[axis];
+                auto t1 = (box.hi[axis] - orig[axis]) * inv_dir[axis];
+                if (t0 > t1) std::swap(t0, t1);
+                if (t0 > t.min) t.min = t0;
+                if (t1 < t.max) t.max = t1;
+                if (t.max <= t.min)
+                    return false;
+            }
+            t_enter = t.min;
+            return true;
+        };
+
+        decoded_box current = to_decoded(bbox);
+        real t_enter;
+        if (!slab_test(current, t_enter))
+            return;
+
+        entry stack[max_depth];
+        int stack_size = 0;
+        int index = 0;
+
+        while (true) {
+            const node& n = nodes[index];
+
+            if (n.count > 0) {
+                if (!visit_leaf(n))
+                    return;
+            } else {
+                int first = index + 1, second = n.offset;
+                auto first_box = decode(&codes[size_t(first) * 6], current);
+                auto second_box = decode(&codes[size_t(second) * 6], current);
+                real t_first, t_second;
+                bool hit_first = slab_test(first_box, t_first);
+                bool hit_second = slab_test(second_box, t_second);
+
+                if (hit_first && hit_second) {
+                    if (t_second < t_first) {
+                        std::swap(first, second);
+                        std::swap(first_box, second_box);
+                        std::swap(t_first, t_second);
+                    }
+                    stack[stack_size++] = entry{ second, t_second, second_box };
+                }
+
+                if (hit_first || hit_second) {
+                    index = hit_first ? first : second;
+                    current = hit_first ? first_box : second_box;
+                    continue;
+                }
+            }
+
+            // Pop the next stacked node that's still in front of the closest hit.
+            while (stack_size > 0 && stack[stack_size - 1].t_enter > ray_t.max)
+                stack_size--;
+            if (stack_size == 0)
+                break;
+
+            stack_size--;
+            index = stack[stack_size].index;
+            current = stack[stack_size].box;
+        }
+    }
+
+    double average_area(const aabb* boxes) const {
+        double area = 0;
+        for (int k = 0; k < key_count; k++)
+            area += boxes[k].surface_area();
+        return area / key_count;
+    }
+
+    static int bin_of(double centroid, const interval& extent) {
+        int b = int(bin_count * (centroid - extent.min) / extent.size());
+        return std::clamp(b, 0, bin_count - 1);
+    }
+
+    static point3 box_center(const aabb& box) {
+        return point3(0.5 * (box.x.min + box.x.max),
+                      0.5 * (box.y.min + box.y.max),
+                      0.5 * (box.z.min + box.z.max));
+    }
+
+    static interval& axis_of(aabb& box, int axis) {
+        return axis == 0 ? box.x : axis == 1 ? box.y : box.z;
+    }
+
+    static bool any_moving(const std::vector<shared_ptr<hittable>>& objects) {
+        for (const auto& object : objects) {
+            auto a = object->bounding_box_at(0);
+            auto b = object->bounding_box_at(1);
+            for (int axis = 0; axis < 3; axis++) {
+                if (a.axis_interval(axis).min != b.axis_interval(axis).min ||
+                    a.axis_interval(axis).max != b.axis_interval(axis).max)
+                    return true;
+            }
+        }
+        return false;
+    }
+
+    bool hit_leaf(const node& n, const ray& r, interval ray_t, hit_record& rec) const {
+        // Hits the leaf's primitives, keeping the nearest hit.
+
+        if (!typed.empty())
+            return typed.hit_range(n.offset, n.offset + n.count, r, ray_t, rec);
+
+        bool hit_anything = false;
+        for (int i = 0; i < n.count; i++) {
+            if (primitives[n.offset + i]->hit(r, ray_t, rec)) {
+                hit_anything = true;
+                ray_t.max = rec.t;
+            }
+        }
+        return hit_anything;
+    }
+
+    void sort_leaves_by_type() {
+        // Groups each leaf's primitives by type, so the type switch in traversal takes the
+        // same branch for a run of primitives.
+
+        std::vector<typed_primitives::primitive_type> types(primitives.size());
+        for (size_t i = 0; i < primitives.size(); i++)
+            types[i] = typed_primitives::type_of(*primitives[i]);
+
+        for (const node& n : nodes) {
+            for (int i = n.offset + 1; i < n.offset + n.count; i++) {
+                for (int j = i; j > n.offset && types[j] < types[j-1]; j--) {
+                    std::swap(types[j], types[j-1]);
+                    std::swap(primitives[j], primitives[j-1]);
+                }
+            }
+        }
+    }
+
+    bool hit_node_box(int index, int key, real blend, const point3& orig, const vec3& inv_dir,
+                      interval ray_t) const {
+        // Slab test against the node's bounds at the ray time, with the ray's reciprocal
+        // direction precomputed by the caller.
+
+        const aabb* box = &bounds[size_t(index) * key_count + key];
+
+        for (int axis = 0; axis < 3; axis++) {
+            real lo = box[0].axis_interval(axis).min;
+            real hi = box[0].axis_interval(axis).max;
+            if (key_count > 1) {
+                lo += blend * (box[1].axis_interval(axis).min - lo);
+                hi += blend * (box[1].axis_interval(axis).max - hi);
+            }
+
+            auto t0 = (lo - orig[axis]) * inv_dir[axis];
+            auto t1 = (hi - orig[axis]) * inv_dir[axis];
+
+            if (t0 < t1) {
+                if (t0 > ray_t.min) ray_t.min = t0;
+                if (t1 < ray_t.max) ray_t.max = t1;
+            } else {
+                if (t1 > ray_t.min) ray_t.min = t1;
+                if (t0 < ray_t.max) ray_t.max = t0;
+            }
+
+            if (ray_t.max <= ray_t.min)
+                return false;
+        }
+        return true;
+    }
+};
+
+#endif
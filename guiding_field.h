@@ -0,0 +1,294 @@
+#ifndef GUIDING_FIELD_H
+#define GUIDING_FIELD_H
+
+#include "aabb.h"
+
+#include <algorithm>
+#include <array>
+#include <cstdint>
+#include <vector>
+
+/**
+ * Distribution over the sphere of directions, learned from the light that arrived along them.
+ * Directions map to the unit square by (phi, cos theta), which keeps areas, so a density over
+ * the square is 4 pi times the density over solid angle. Each node of the quadtree splits its
+ * square into four quadrants and holds the energy recorded in each; a quadrant with a child
+ * splits again. Sampling descends by energy and picks a point uniformly in the leaf quadrant,
+ * so bright directions are refined finely and chosen often, and dark ones cost one quadrant.
+ *
+ * record() adds to the energies atomically, so threads can share a tree while rendering.
+ * refined() gives the tree to record the next pass into: quadrants holding more than a fixed
+ * share of the energy are split, those holding less are merged, and the energies start over.
+ */
+class directional_quadtree {
+  public:
+    directional_quadtree() : nodes(1) {}
+
+    bool empty() const { return !(total() > 0); }
+    size_t node_count() const { return nodes.size(); }
+    size_t memory_bytes() const { return nodes.size() * sizeof(node); }
+
+    void record(const vec3& direction, float energy) {
+        auto x = to_square(direction);
+        for (uint32_t n = 0;;) {
+            auto q = quadrant(x);
+            #pragma omp atomic
+            nodes[n].energy[q] += energy;
+            if (nodes[n].child[q] == 0)
+                return;
+            n = nodes[n].child[q];
+        }
+    }
+
+    vec3 sample(real& pdf) const {
+        // Returns a direction chosen by recorded energy, and its density over solid angle in
+        // pdf. The tree must not be empty.
+
+        point2 corner = { 0, 0 };
+        real size = 1, density = 1;
+        for (uint32_t n = 0;;) {
+            const auto& e = nodes[n].energy;
+            real sum = e[0] + e[1] + e[2] + e[3];
+            auto u = random_double() * sum;
+            int q = 0;
+            while (q < 3 && (u >= e[q] || e[q] <= 0)) {
+                u -= e[q];
+                q++;
+            }
+            while (q > 0 && e[q] <= 0) q--;  // Rounding can step past the last one with energy
+
+            density *= 4 * e[q] / sum;
+            size /= 2;
+            corner[0] += (q & 1) * size;
+            corner[1] += (q >> 1) * size;
+            if (nodes[n].child[q] == 0)
+                break;
+            n = nodes[n].child[q];
+        }
+
+        pdf = density / (4 * pi);
+        return from_square({ corner[0] + real(random_double()) * size,
+                             corner[1] + real(random_double()) * size });
+    }
+
+    real pdf(const vec3& direction) const {
+        // Returns the density over solid angle with which sample() returns the direction.
+        auto x = to_square(direction);
+        real density = 1;
+        for (uint32_t n = 0;;) {
+            const auto& e = nodes[n].energy;
+            real sum = e[0] + e[1] + e[2] + e[3];
+            if (!(sum > 0))
+                return 0;
+            auto q = quadrant(x);
+            density *= 4 * e[q] / sum;
+            if (nodes[n].child[q] == 0 || density <= 0)
+                break;
+            n = nodes[n].child[q];
+        }
+        return density / (4 * pi);
+    }
+
+    directional_quadtree refined(float split_fraction) const {
+        // Returns a tree with no energy whose quadrants are split where this tree's quadrants
+        // hold more than split_fraction of the total, down to max_depth.
+        directional_quadtree result;
+        auto threshold = total() * split_fraction;
+        if (threshold > 0)
+            refine_into(result, 0, 0, 0, threshold, 1);
+        return result;
+    }
+
+  private:
+    using point2 = std::array<real, 2>;
+
+    struct node {
+        std::array<float, 4>    energy = {};  // Recorded in each quadrant
+        std::array<uint32_t, 4> child = {};   // Node splitting each quadrant, 0 if none
+    };
+
+    static constexpr int max_depth = 20;
+    std::vector<node> nodes;
+
+    float total() const {
+        const auto& e = nodes[0].energy;
+        return e[0] + e[1] + e[2] + e[3];
+    }
+
+    static point2 to_square(const vec3& direction) {
+        auto d = unit_vector(direction);
+        auto phi = std::atan2(d.y(), d.x());
+        if (phi < 0) phi += 2 * pi;
+        return { std::clamp(phi / (2 * pi), real(0), real(1)),
+                 std::clamp((d.z() + 1) / 2, real(0), real(1)) };
+    }
+
+    static vec3 from_square(const point2& x) {
+        auto cos_theta = 2 * x[1] - 1;
+        auto sin_theta = std::sqrt(std::fmax(real(0), 1 - cos_theta * cos_theta));
+        auto phi = 2 * pi * x[0];
+        return vec3(std::cos(phi) * sin_theta, std::sin(phi) * sin_theta, cos_theta);
+    }
+
+    static int quadrant(point2& x) {
+        // Returns the quadrant x is in, and moves x to that quadrant's own unit square.
+        int q = 0;
+        for (int axis = 0; axis < 2; axis++) {
+            x[axis] *= 2;
+            if (x[axis] >= 1) {
+                q |= 1 << axis;
+                x[axis] = std::fmin(x[axis] - 1, real(1));
+            }
+        }
+        return q;
+    }
+
+    void refine_into(directional_quadtree& result, uint32_t into, int64_t from, int depth,
+                     float threshold, float uniform_energy) const {
+        // Splits result's node into by this tree's node from, or, where this tree has no node
+        // (from < 0), by energy spread evenly from the parent's quadrant.
+        for (int q = 0; q < 4; q++) {
+            auto energy = from >= 0 ? nodes[from].energy[q] : uniform_energy / 4;
+            if (!(energy > threshold) || depth + 1 >= max_depth)
+                continue;
+
+            auto child = uint32_t(result.nodes.size());
+            result.nodes.emplace_back();
+            result.nodes[into].child[q] = child;
+            int64_t from_child = -1;
+            if (from >= 0 && nodes[from].child[q] != 0)
+                from_child = nodes[from].child[q];
+            refine_into(result, child, from_child, depth + 1, threshold, energy);
+        }
+    }
+};
+
+/**
+ * Spatially varying guide for choosing bounce directions (path guiding, after Müller et al.,
+ * "Practical Path Guiding"). A binary tree halves a cube around the scene along x, y and z in
+ * turn, and each of its leaves keeps two directional_quadtrees of the light arriving there:
+ * one learned in the last training pass, which the renderer samples, and one recording the
+ * current pass.
+ *
+ * After each pass, refine() makes the recorded trees the sampled ones, splits leaves that
+ * recorded many samples in two (each half starting with its parent's trees), and refines
+ * the directions of the new recording trees by where the energy was. Regions seen often end
+ * up small, with distributions that fit them closely.
+ */
+class guiding_field {
+  public:
+    guiding_field(const aabb& bounds) : nodes(1), leaves(1) {
+        // The box is made a cube, so that halving it along each axis in turn keeps cells
+        // close to cubes.
+        real size = 0;
+        for (int axis = 0; axis < 3; axis++)
+            size = std::fmax(size, bounds.axis_interval(axis).size());
+        if (!std::isfinite(size) || size <= 0)
+            size = 1;
+        for (int axis = 0; axis < 3; axis++) {
+            const auto& extent = bounds.axis_interval(axis);
+            auto center = std::isfinite(extent.min + extent.max)
+                        ? (extent.min + extent.max) / 2 : real(0);
+            origin[axis] = center - size / 2;
+        }
+        cube_size = size;
+    }
+
+    size_t region_count() const { return leaves.size(); }
+
+    size_t memory_bytes() const {
+        size_t bytes = nodes.size() * sizeof(spatial_node);
+        for (const auto& leaf : leaves)
+            bytes += sizeof(leaf) + leaf.sampling.memory_bytes() + leaf.recording.memory_bytes();
+        return bytes;
+    }
+
+    const directional_quadtree& distribution(const point3& p) const {
+        // Returns the learned distribution of light arriving near p.
+        return leaves[leaf_at(p)].sampling;
+    }
+
+    void record(const point3& p, const vec3& direction, float energy) {
+        // Records that energy arrived at p from direction, divided by the density with which
+        // the direction was chosen.
+        auto& leaf = leaves[leaf_at(p)];
+        #pragma omp atomic
+        leaf.samples++;
+        if (energy > 0)
+            leaf.recording.record(direction, energy);
+    }
+
+    void refine(int pass_samples_per_pixel) {
+        // Ends a training pass of pass_samples_per_pixel. Leaves are split while they hold
+        // more than split_samples times the square root of that, halving their count, so
+        // regions grow finer as passes grow longer.
+
+        auto threshold = split_samples * std::sqrt(real(pass_samples_per_pixel));
+        for (auto& leaf : leaves)
+            leaf.sampling = leaf.recording;
+
+        for (size_t n = 0; n < nodes.size(); n++) {
+            if (nodes[n].first_child != 0 || leaves[nodes[n].leaf].samples <= threshold)
+                continue;
+
+            // Split the leaf; its children are checked in turn as the loop reaches them.
+            auto parent_leaf = nodes[n].leaf;
+            auto first = uint32_t(nodes.size());
+            nodes[n].first_child = first;
+            leaves[parent_leaf].samples /= 2;
+            for (int i = 0; i < 2; i++) {
+                spatial_node child;
+                child.axis = uint8_t((nodes[n].axis + 1) % 3);
+                child.leaf = i == 0 ? parent_leaf : uint32_t(leaves.size());
+                if (i == 1)
+                    leaves.push_back(leaves[parent_leaf]);
+                nodes.push_back(child);
+            }
+        }
+
+        for (auto& leaf : leaves) {
+            leaf.recording = leaf.sampling.refined(split_energy_fraction);
+            leaf.samples = 0;
+        }
+    }
+
+  private:
+    struct spatial_node {
+        uint32_t first_child = 0;  // Second child follows; 0 for a leaf
+        uint32_t leaf = 0;         // Index into leaves, for a leaf
+        uint8_t  axis = 0;         // Axis the node's cell is halved along
+    };
+
+    struct leaf_trees {
+        directional_quadtree sampling;   // Learned in the last pass
+        directional_quadtree recording;  // Being learned in this one
+        uint32_t samples = 0;            // Recorded in this pass
+    };
+
+    static constexpr real  split_samples = 1000;          // Per leaf, for a 1-sample pass
+    static constexpr float split_energy_fraction = 0.01f; // Of a quadtree's energy
+
+    point3 origin;
+    real   cube_size;
+    std::vector<spatial_node> nodes;
+    std::vector<leaf_trees>   leaves;
+
+    uint32_t leaf_at(const point3& p) const {
+        // Coordinates within the cube are doubled at each level, so a level's cell is [0,1).
+        real x[3];
+        for (int axis = 0; axis < 3; axis++)
+            x[axis] = std::clamp((p[axis] - origin[axis]) / cube_size, real(0), real(1));
+
+        uint32_t n = 0;
+        while (nodes[n].first_child != 0) {
+            auto axis = nodes[n].axis;
+            x[axis] *= 2;
+            auto upper = x[axis] >= 1;
+            if (upper) x[axis] -= 1;
+            n = nodes[n].first_child + upper;
+        }
+        return nodes[n].leaf;
+    }
+};
+
+#endif
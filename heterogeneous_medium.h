@@ -0,0 +1,194 @@
+#ifndef HETEROGENEOUS_MEDIUM_H
+#define HETEROGENEOUS_MEDIUM_H
+
+#include "density_grid.h"
+#include "hittable.h"
+#include "material.h"
+#include "texture.h"
+
+#include <vector>
+
+/**
+ * Participating medium whose density varies through space, given by a density_grid. Where a
+ * ray scatters is found by delta tracking: tentative collisions are drawn against a majorant,
+ * a density at least as high as the real one, and each is accepted with the ratio of the real
+ * density to the majorant. Shadow rays take transmittance() instead, which uses ratio tracking:
+ * it multiplies those ratios along the same tentative collisions rather than drawing against
+ * them, so it estimates the light let through by a fraction instead of by 0 or 1.
+ *
+ * The majorant comes from a coarse grid over the medium, each cell bounding a block of 8^3
+ * density cells, and rays walk it cell by cell (Amanatides and Woo's DDA). Empty blocks are
+ * crossed without drawing any collisions, and sparse ones draw few, where a single majorant
+ * for the whole medium would draw collisions everywhere at the density of its densest part.
+ */
+class heterogeneous_medium final : public hittable {
+  public:
+    heterogeneous_medium(shared_ptr<const density_grid> grid, real density,
+                         shared_ptr<material> phase_function)
+      : grid(grid), density_scale(density), phase_function(phase_function)
+    {
+        build_majorants();
+    }
+
+    heterogeneous_medium(shared_ptr<const density_grid> grid, real density,
+                         shared_ptr<texture> tex)
+      : heterogeneous_medium(grid, density, make_shared<isotropic>(tex))
+    {}
+
+    bool hit(const ray& r, interval ray_t, hit_record& rec) const override {
+        auto ray_length = r.direction().length();
+        bool scattered = false;
+
+        walk_majorants(r, ray_t, [&](real t_enter, real t_exit, real majorant) {
+            // Delta tracking: draw collisions at the majorant's rate until one is real.
+            auto t = t_enter;
+            while (true) {
+                t -= std::log(1 - random_double()) / (majorant * ray_length);
+                if (t >= t_exit)
+                    return false;
+                if (random_double() * majorant < density_at(r.at(t))) {
+                    rec.t = t;
+                    scattered = true;
+                    return true;
+                }
+            }
+        });
+
+        if (!scattered)
+            return false;
+
+        rec.p = r.at(rec.t);
+        rec.p_error = 0;
+        rec.uv_scale = 0;
+        rec.normal = vec3(1,0,0);  // arbitrary
+        rec.front_face = true;     // also arbitrary
+        rec.mat = phase_function.get();
+        return true;
+    }
+
+    bool hit_surface(const ray&, interval, hit_record&) const override { return false; }
+
+    bool contains_media() const override { return true; }
+
+    real transmittance(const ray& r, interval ray_t) const override {
+        auto ray_length = r.direction().length();
+        real result = 1;
+
+        walk_majorants(r, ray_t, [&](real t_enter, real t_exit, real majorant) {
+            // Ratio tracking: weight by the chance of passing each tentative collision.
+            auto t = t_enter;
+            while (true) {
+                t -= std::log(1 - random_double()) / (majorant * ray_length);
+                if (t >= t_exit)
+                    return false;
+                result *= 1 - density_at(r.at(t)) / majorant;
+
+                // Russian roulette once little is let through, so dense media aren't walked
+                // to the far side for almost nothing.
+                if (result < real(0.1)) {
+                    if (random_double() < 0.5) {
+                        result = 0;
+                        return true;
+                    }
+                    result *= 2;
+                }
+            }
+        });
+
+        return result;
+    }
+
+    aabb bounding_box() const override { return grid->bounds(); }
+
+  private:
+    static const int block_cells = 8;  // Density cells along each side of a majorant cell
+
+    shared_ptr<const density_grid> grid;
+    real density_scale;
+    shared_ptr<material> phase_function;
+    int  majorant_counts[3];
+    real block_size[3];
+    std::vector<float> majorants;  // x fastest, then y, then z
+
+    real density_at(const point3& p) const { return density_scale * grid->at(p); }
+
+    void build_majorants() {
+        for (int axis = 0; axis < 3; axis++) {
+            auto cells = grid->count(axis) - 1;
+            majorant_counts[axis] = (cells + block_cells - 1) / block_cells;
+            block_size[axis] = block_cells * grid->spacing(axis);
+        }
+
+        majorants.resize(size_t(majorant_counts[0]) * majorant_counts[1] * majorant_counts[2]);
+        for (int k = 0; k < majorant_counts[2]; k++) {
+            for (int j = 0; j < majorant_counts[1]; j++) {
+                for (int i = 0; i < majorant_counts[0]; i++) {
+                    int block[3] = { i, j, k };
+                    int first[3], last[3];
+                    for (int axis = 0; axis < 3; axis++) {
+                        first[axis] = block[axis] * block_cells;
+                        last[axis] = std::min(first[axis] + block_cells, grid->count(axis) - 1);
+                    }
+                    majorants[majorant_index(i, j, k)] =
+                        float(density_scale * grid->max_in(first, last));
+                }
+            }
+        }
+    }
+
+    size_t majorant_index(int i, int j, int k) const {
+        return (size_t(k) * majorant_counts[1] + j) * majorant_counts[0] + i;
+    }
+
+    template <typename segment_visitor>
+    void walk_majorants(const ray& r, interval ray_t, const segment_visitor& visit) const {
+        // Calls visit(t_enter, t_exit, majorant) for each majorant cell the ray crosses inside
+        // ray_t with a nonzero majorant, in order, until visit returns true.
+
+        const auto& bounds = grid->bounds();
+        if (!bounds.clip(r, ray_t))
+            return;
+
+        const auto& orig = r.origin();
+        const auto& dir = r.direction();
+        auto start = r.at(ray_t.min);
+
+        int cell[3], step[3];
+        real t_next[3], t_delta[3];
+        for (int axis = 0; axis < 3; axis++) {
+            auto min = bounds.axis_interval(axis).min;
+            auto offset = int(std::floor((start[axis] - min) / block_size[axis]));
+            cell[axis] = std::clamp(offset, 0, majorant_counts[axis] - 1);
+
+            if (dir[axis] == 0) {
+                step[axis] = 0;
+                t_next[axis] = t_delta[axis] = infinity;
+                continue;
+            }
+
+            step[axis] = dir[axis] > 0 ? 1 : -1;
+            auto boundary = min + (cell[axis] + (step[axis] > 0)) * block_size[axis];
+            t_next[axis] = (boundary - orig[axis]) / dir[axis];
+            t_delta[axis] = block_size[axis] / std::fabs(dir[axis]);
+        }
+
+        auto t = ray_t.min;
+        while (t < ray_t.max) {
+            int axis = t_next[0] < t_next[1]
+                     ? (t_next[0] < t_next[2] ? 0 : 2) : (t_next[1] < t_next[2] ? 1 : 2);
+            auto t_exit = std::fmin(t_next[axis], ray_t.max);
+
+            auto majorant = majorants[majorant_index(cell[0], cell[1], cell[2])];
+            if (majorant > 0 && t_exit > t && visit(t, t_exit, majorant))
+                return;
+
+            cell[axis] += step[axis];
+            if (cell[axis] < 0 || cell[axis] >= majorant_counts[axis])
+                return;
+            t = t_exit;
+            t_next[axis] += t_delta[axis];
+        }
+    }
+};
+
+#endif
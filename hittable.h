@@ -2,6 +2,7 @@
 #define HITTABLE_H
 
 #include "aabb.h"
+#include "affine.h"
 
 class material;
 
@@ -9,11 +10,17 @@ class hit_record {
   public:
     point3 p;
     vec3 normal;
-    shared_ptr<material> mat;
-    double t;
-    double u; // surface coordinates
-    double v;
+    const material* mat;  // Owned by the object that was hit
+    real t;
+    real u; // surface coordinates
+    real v;
     bool front_face;
+    real p_error;  // Bound on the error in each coordinate of p from how it was computed, for
+                   // errors larger than round-off in p's own coordinates (see offset_ray_origin)
+    real uv_scale = 0;      // World-space length of a unit step in (u,v) at p, 0 if unknown
+    real footprint = 0;     // World-space width of what the pixel sees at p; set by the
+                            // camera, 0 for an unfiltered lookup
+    real uv_footprint = 0;  // The same width in (u,v)
 
     void set_face_normal(const ray& r, const vec3& outward_normal) {
         // Sets the hit record normal vector.
@@ -34,119 +41,212 @@ class hittable {
     virtual bool hit(const ray& r, interval ray_t, hit_record& rec) const = 0;
 
     virtual aabb bounding_box() const = 0;
+
+    virtual aabb bounding_box_at(real time) const {
+        // Returns the bounds of the object at the given ray time. Linearly interpolating the
+        // boxes returned for two times must bound the object at every time in between. The
+        // default, the bounds over all times, is right for objects that don't move.
+        return bounding_box();
+    }
+
+    virtual aabb bounding_box_in(const aabb& clip) const {
+        // Returns the bounds of the part of the object inside the clip box, which may be
+        // empty, padded as bounding_box() is. BVH builds use this to split an object's
+        // reference at a plane. The default is the overlap of the box with the object's
+        // bounds; flat primitives clip their own outline for tighter results.
+        auto part = bounding_box().intersect(clip);
+        return part.is_empty() ? part : aabb(part.x, part.y, part.z);
+    }
+
+    virtual bool hit_surface(const ray& r, interval ray_t, hit_record& rec) const {
+        // Like hit(), but passes through participating media. Shadow rays test surfaces with
+        // this and take what the media let through from transmittance().
+        return hit(r, ray_t, rec);
+    }
+
+    virtual bool contains_media() const {
+        // Whether transmittance() can be less than 1, so containers can skip asking.
+        return false;
+    }
+
+    virtual real transmittance(const ray& r, interval ray_t) const {
+        // Returns the fraction of light that crosses the object's participating media along
+        // the ray between the given times, or an unbiased estimate of it. Objects without
+        // media let it all through.
+        return 1;
+    }
 };
 
-class translate : public hittable {
+/**
+ * Instance of an object placed in the world by an affine transform. Given separate start and
+ * end transforms, the instance moves between them over the ray time interval [0,1].
+ *
+ * Wrapping another static transform_instance (including translate and rotate_y) folds both
+ * transforms into one matrix, so chains of wrappers cost a single ray transform.
+ */
+class transform_instance : public hittable {
   public:
-    translate(shared_ptr<hittable> object, const vec3& offset)
-      : object(object), offset(offset)
+    transform_instance(shared_ptr<hittable> object, const affine& object_to_world)
+      : transform_instance(object, object_to_world, object_to_world)
+    {}
+
+    transform_instance(shared_ptr<hittable> object, const affine& start, const affine& end)
+      : object(object)
     {
-        bbox = object->bounding_box() + offset;
+        // A transform that is linear in time composed with a static one is still linear in
+        // time, so nested wrappers collapse unless both of them move.
+        auto inner = std::dynamic_pointer_cast<transform_instance>(object);
+        bool outer_moving = !same_transform(start, end);
+        if (inner && (!inner->moving || !outer_moving)) {
+            this->object = inner->object;
+            inner_start = inner->start_transform;
+            inner_end = inner->end_transform;
+        }
+
+        set_transform(start, end);
     }
 
-    bool hit(const ray& r, interval ray_t, hit_record& rec) const override {
-        // Move the ray backwards by the offset
-        ray offset_r(r.origin() - offset, r.direction(), r.time());
+    void set_transform(const affine& object_to_world) {
+        set_transform(object_to_world, object_to_world);
+    }
 
-        // Determine whether an intersection exists along the offset ray (and if so, where)
-        if (!object->hit(offset_r, ray_t, rec))
-            return false;
+    void set_transform(const affine& start, const affine& end) {
+        // Replaces the transforms, for instances animated from frame to frame. A nested
+        // instance folded into this one at construction stays applied first.
+
+        start_transform = start * inner_start;
+        end_transform = end * inner_end;
+        if (!affine::invertible_between(start_transform, end_transform))
+            throw std::runtime_error("Error: Instance transform is singular at some time");
+        moving = !same_transform(start_transform, end_transform);
+        inverse_start = start_transform.inverse();
+        update_bounds();
+    }
 
-        // Move the intersection point forwards by the offset
-        rec.p += offset;
+    void update_bounds() {
+        // Recomputes the bounds from the object's current ones. Call this after changing the
+        // object itself, such as deforming a mesh.
+
+        // The product of a moving transform and moving bounds is no longer linear in time.
+        auto box0 = object->bounding_box_at(0);
+        auto box1 = object->bounding_box_at(1);
+        bool object_moving = box0.x.min != box1.x.min || box0.x.max != box1.x.max
+                          || box0.y.min != box1.y.min || box0.y.max != box1.y.max
+                          || box0.z.min != box1.z.min || box0.z.max != box1.z.max;
+        linear_bounds = !(moving && object_moving);
+
+        // Every point of the object moves linearly between its start and end positions, so
+        // the two end boxes bound the whole motion.
+        auto object_box = object->bounding_box();
+        bbox = start_transform.apply_box(object_box);
+        if (moving)
+            bbox = aabb(bbox, end_transform.apply_box(object_box));
+    }
 
-        return true;
+    bool hit(const ray& r, interval ray_t, hit_record& rec) const override {
+        return hit_object(r, ray_t, rec, false);
     }
 
-    aabb bounding_box() const override { return bbox; }
+    bool hit_surface(const ray& r, interval ray_t, hit_record& rec) const override {
+        return hit_object(r, ray_t, rec, true);
+    }
 
-  private:
-    shared_ptr<hittable> object;
-    vec3 offset;
-    aabb bbox;
-};
+    bool contains_media() const override { return object->contains_media(); }
 
-class rotate_y : public hittable {
-  public:
-    rotate_y(shared_ptr<hittable> object, double angle) : object(object) {
-        auto radians = degrees_to_radians(angle);
-        sin_theta = std::sin(radians);
-        cos_theta = std::cos(radians);
-        bbox = object->bounding_box();
-
-        point3 min( infinity,  infinity,  infinity);
-        point3 max(-infinity, -infinity, -infinity);
-
-        for (int i = 0; i < 2; i++) {
-            for (int j = 0; j < 2; j++) {
-                for (int k = 0; k < 2; k++) {
-                    auto x = i*bbox.x.max + (1-i)*bbox.x.min;
-                    auto y = j*bbox.y.max + (1-j)*bbox.y.min;
-                    auto z = k*bbox.z.max + (1-k)*bbox.z.min;
-
-                    auto newx =  cos_theta*x + sin_theta*z;
-                    auto newz = -sin_theta*x + cos_theta*z;
-
-                    vec3 tester(newx, y, newz);
-
-                    for (int c = 0; c < 3; c++) {
-                        min[c] = std::fmin(min[c], tester[c]);
-                        max[c] = std::fmax(max[c], tester[c]);
-                    }
-                }
-            }
+    real transmittance(const ray& r, interval ray_t) const override {
+        if (!object->contains_media())
+            return 1;
+
+        affine world_to_object = inverse_start;
+        if (moving) {
+            auto object_to_world = affine::lerp(start_transform, end_transform, r.time());
+            if (!object_to_world.invertible())
+                return 1;
+            world_to_object = object_to_world.inverse();
         }
 
-        bbox = aabb(min, max);
+        ray object_r(world_to_object.apply_point(r.origin()),
+                     world_to_object.apply_vector(r.direction()), r.time());
+        return object->transmittance(object_r, ray_t);
     }
 
-    bool hit(const ray& r, interval ray_t, hit_record& rec) const override {
+    aabb bounding_box() const override { return bbox; }
 
-        // Transform the ray from world space to object space.
+    aabb bounding_box_at(real time) const override {
+        if (!linear_bounds)
+            return bbox;
 
-        auto origin = point3(
-            (cos_theta * r.origin().x()) - (sin_theta * r.origin().z()),
-            r.origin().y(),
-            (sin_theta * r.origin().x()) + (cos_theta * r.origin().z())
-        );
+        auto object_box = object->bounding_box_at(time);
+        if (!moving)
+            return start_transform.apply_box(object_box);
 
-        auto direction = vec3(
-            (cos_theta * r.direction().x()) - (sin_theta * r.direction().z()),
-            r.direction().y(),
-            (sin_theta * r.direction().x()) + (cos_theta * r.direction().z())
-        );
+        return affine::lerp(start_transform, end_transform, time).apply_box(object_box);
+    }
 
-        ray rotated_r(origin, direction, r.time());
+  private:
+    shared_ptr<hittable> object;
+    affine start_transform;   // Object to world at time 0
+    affine end_transform;     // Object to world at time 1
+    affine inverse_start;     // World to object at time 0
+    affine inner_start;       // Transforms of a nested instance folded into this one, applied
+    affine inner_end;         // before the ones given to set_transform()
+    bool moving;
+    bool linear_bounds;       // Whether bounding_box_at() can give bounds at a single time
+    aabb bbox;
 
-        // Determine whether an intersection exists in object space (and if so, where).
+    bool hit_object(const ray& r, interval ray_t, hit_record& rec, bool surfaces_only) const {
+        // Hits the object in its own space, only its surfaces if surfaces_only.
+        affine object_to_world = start_transform;
+        affine world_to_object = inverse_start;
+        if (moving) {
+            // Construction rejects pairs that pass through a singular matrix, but rounding
+            // can still land on one near a root, and there is no object space to hit in.
+            object_to_world = affine::lerp(start_transform, end_transform, r.time());
+            if (!object_to_world.invertible())
+                return false;
+            world_to_object = object_to_world.inverse();
+        }
 
-        if (!object->hit(rotated_r, ray_t, rec))
-            return false;
+        // Transform the ray into object space. The ray parameter t is unchanged by an affine
+        // transform, so hit distances carry over directly.
+        ray object_r(world_to_object.apply_point(r.origin()),
+                     world_to_object.apply_vector(r.direction()), r.time());
 
-        // Transform the intersection from object space back to world space.
+        bool hit_anything = surfaces_only ? object->hit_surface(object_r, ray_t, rec)
+                                          : object->hit(object_r, ray_t, rec);
+        if (!hit_anything)
+            return false;
 
-        rec.p = point3(
-            (cos_theta * rec.p.x()) + (sin_theta * rec.p.z()),
-            rec.p.y(),
-            (-sin_theta * rec.p.x()) + (cos_theta * rec.p.z())
-        );
+        // Transform the intersection back to world space. Normals use the inverse transpose.
+        rec.p = object_to_world.apply_point(rec.p);
+        rec.normal = unit_vector(world_to_object.apply_transposed(rec.normal));
+        rec.p_error *= object_to_world.norm();
+        rec.uv_scale *= object_to_world.norm();
 
-        rec.normal = vec3(
-            (cos_theta * rec.normal.x()) + (sin_theta * rec.normal.z()),
-            rec.normal.y(),
-            (-sin_theta * rec.normal.x()) + (cos_theta * rec.normal.z())
-        );
+        return true;
+    }
 
+    static bool same_transform(const affine& a, const affine& b) {
+        for (int i = 0; i < 3; i++)
+            for (int j = 0; j < 4; j++)
+                if (a.m[i][j] != b.m[i][j])
+                    return false;
         return true;
     }
+};
 
-    aabb bounding_box() const override { return bbox; }
+class translate : public transform_instance {
+  public:
+    translate(shared_ptr<hittable> object, const vec3& offset)
+      : transform_instance(object, affine::translation(offset))
+    {}
+};
 
-  private:
-    shared_ptr<hittable> object;
-    double sin_theta;
-    double cos_theta;
-    aabb bbox;
+class rotate_y : public transform_instance {
+  public:
+    rotate_y(shared_ptr<hittable> object, real angle)
+      : transform_instance(object, affine::rotation(vec3(0,1,0), angle))
+    {}
 };
 
 #endif
\ No newline at end of file
@@ -39,8 +39,48 @@ class hittable_list : public hittable {
         return hit_anything;
     }
 
+    bool hit_surface(const ray& r, interval ray_t, hit_record& rec) const override {
+        hit_record temp_rec;
+        bool hit_anything = false;
+        auto closest_so_far = ray_t.max;
+
+        for (const auto& object : objects) {
+            if (object->hit_surface(r, interval(ray_t.min, closest_so_far), temp_rec)) {
+                hit_anything = true;
+                closest_so_far = temp_rec.t;
+                rec = temp_rec;
+            }
+        }
+
+        return hit_anything;
+    }
+
+    bool contains_media() const override {
+        for (const auto& object : objects)
+            if (object->contains_media())
+                return true;
+        return false;
+    }
+
+    real transmittance(const ray& r, interval ray_t) const override {
+        real result = 1;
+        for (const auto& object : objects) {
+            result *= object->transmittance(r, ray_t);
+            if (result <= 0)
+                break;
+        }
+        return result;
+    }
+
     aabb bounding_box() const override { return bbox; }
 
+    aabb bounding_box_at(real time) const override {
+        aabb box = aabb::empty;
+        for (const auto& object : objects)
+            box = aabb(box, object->bounding_box_at(time));
+        return box;
+    }
+
     private:
         aabb bbox;
 };
@@ -0,0 +1,64 @@
+#ifndef IMAGE_CACHE_H
+#define IMAGE_CACHE_H
+
+#include "mip_image.h"
+
+#include <future>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <unordered_map>
+
+/**
+ * Images decoded once per path and shared by every texture that samples them, across scenes.
+ * Only the MIP-mapped form that textures sample is kept (see mip_image). Decoding and building
+ * the pyramid run on a background thread, so prefetch() the images a scene needs before the
+ * rest of its setup and they decode in parallel with it and with each other; get() waits for
+ * an image only if it isn't ready yet.
+ *
+ * Images stay cached until clear(). Textures hold their own reference, so clearing never
+ * frees an image that is still being sampled.
+ */
+class image_cache {
+  public:
+    static void prefetch(const std::string& filename) {
+        // Starts decoding the image if it isn't cached or already being decoded.
+        entry(filename);
+    }
+
+    static shared_ptr<const mip_image> get(const std::string& filename) {
+        return entry(filename).get();
+    }
+
+    static void clear() {
+        std::lock_guard<std::mutex> lock(mutex());
+        images().clear();
+    }
+
+  private:
+    using pending_image = std::shared_future<shared_ptr<const mip_image>>;
+
+    static pending_image entry(const std::string& filename) {
+        std::lock_guard<std::mutex> lock(mutex());
+        auto& image = images()[filename];
+        if (!image.valid()) {
+            image = std::async(std::launch::async, [filename] {
+                rtw_image decoded(filename.c_str());
+                return shared_ptr<const mip_image>(make_shared<mip_image>(decoded));
+            }).share();
+        }
+        return image;
+    }
+
+    static std::unordered_map<std::string, pending_image>& images() {
+        static std::unordered_map<std::string, pending_image> cached;
+        return cached;
+    }
+
+    static std::mutex& mutex() {
+        static std::mutex cache_mutex;
+        return cache_mutex;
+    }
+};
+
+#endif
@@ -0,0 +1,385 @@
+#ifndef LIGHT_TREE_H
+#define LIGHT_TREE_H
+
+#include "area_light.h"
+
+#include <algorithm>
+#include <unordered_set>
+#include <vector>
+
+/**
+ * Bounding volume hierarchy over a scene's area lights, for choosing one light to sample at a
+ * shading point (after Conty Estevez and Kulla's light BVH, as in PBRT 4). Each node bounds
+ * its lights' positions, total power and emission directions (a cone of normals, plus how far
+ * past them light spreads). A light is chosen by descending from the root, taking each child
+ * with probability proportional to an estimate of what its lights contribute at the point:
+ * their power over the squared distance to their bounds, reduced by how far the point is from
+ * their emission cone and from the shading normal.
+ *
+ * The probabilities follow the light that reaches the point rather than the lights' count or
+ * power alone, so a few close or bright lights are chosen among thousands far away, and the
+ * noise of one sample stays near that of a scene with only the lights that matter.
+ *
+ * Lights are described by area_light. covers() tells whether a material's emission is always
+ * reached through the tree, which the renderer uses to avoid counting it twice. Materials
+ * with a light of no estimated power aren't covered, nor are any of their lights in the tree.
+ */
+class light_tree {
+  public:
+    light_tree(const std::vector<area_light>& scene_lights) {
+        // A light estimated to emit nothing would never be chosen, so the emitters of its
+        // material are all left out, and their light is found by bounces instead.
+        std::unordered_set<const material*> dark;
+        for (const auto& light : scene_lights) {
+            if (!(light.power() > 0))
+                dark.insert(light.emitter());
+        }
+        for (const auto& light : scene_lights) {
+            if (dark.count(light.emitter()) == 0) {
+                lights.push_back(light);
+                covered.insert(light.emitter());
+            }
+        }
+        if (lights.empty())
+            return;
+
+        std::vector<light_bounds> bounds(lights.size());
+        std::vector<size_t> order(lights.size());
+        for (size_t i = 0; i < lights.size(); i++) {
+            bounds[i] = bounds_of(lights[i]);
+            order[i] = i;
+        }
+
+        nodes.reserve(2 * lights.size());
+        build(bounds, order, 0, order.size());
+    }
+
+    bool empty() const { return lights.empty(); }
+    size_t size() const { return lights.size(); }
+    const std::vector<area_light>& all_lights() const { return lights; }
+
+    bool covers(const material* mat) const { return covered.count(mat) != 0; }
+
+    const area_light* sample(const point3& p, const vec3& n, real& probability) const {
+        // Chooses a light to sample for shading point p with normal n (zero in media), and
+        // returns the probability it was chosen with, or null if no light can reach p.
+
+        if (nodes.empty())
+            return nullptr;
+
+        // One random number steers the whole descent, rescaled to [0,1) after each choice.
+        auto u = random_double();
+        probability = 1;
+        size_t index = 0;
+        while (!nodes[index].is_leaf) {
+            auto first = index + 1, second = size_t(nodes[index].child_or_light);
+            auto first_importance = nodes[first].bounds.importance(p, n);
+            auto second_importance = nodes[second].bounds.importance(p, n);
+            auto total = first_importance + second_importance;
+            if (!(total > 0))
+                return nullptr;
+
+            auto chance = first_importance / total;
+            if (u < chance) {
+                probability *= chance;
+                u = std::fmin(u / chance, real(0.99999994));
+                index = first;
+            } else {
+                probability *= 1 - chance;
+                u = std::fmin((u - chance) / (1 - chance), real(0.99999994));
+                index = second;
+            }
+        }
+
+        if (!(nodes[index].bounds.importance(p, n) > 0))
+            return nullptr;
+        return &lights[nodes[index].child_or_light];
+    }
+
+    size_t memory_bytes() const {
+        return lights.size() * sizeof(area_light) + nodes.size() * sizeof(node);
+    }
+
+  private:
+    struct light_bounds {
+        aabb  box;
+        float power = 0;
+        vec3  axis = vec3(0,0,1);  // Center of the cone of normals
+        float cos_normals = 1;     // Cosine of the cone's half angle
+        float cos_emission = 0;    // Cosine of the angle light spreads beyond the normals
+        bool  two_sided = false;   // Normals also point the opposite way
+    };
+
+    // The same bounds in single precision, so that a node fits in a cache line: descending
+    // the tree touches two nodes per level, which are rarely cached in a large tree.
+    struct packed_bounds {
+        float center[3], radius;  // Sphere around the box
+        float axis[3];
+        float power, cos_normals, sin_normals, cos_emission;
+        bool  two_sided;
+
+        real importance(const point3& p, const vec3& n) const;
+    };
+
+    struct alignas(64) node {
+        packed_bounds bounds;
+        int32_t child_or_light;  // Second child of interior nodes (the first follows them),
+                                 // or the light of leaves
+        bool    is_leaf;
+    };
+
+    std::vector<area_light> lights;
+    std::vector<node>       nodes;
+    std::unordered_set<const material*> covered;
+
+    static light_bounds bounds_of(const area_light& light) {
+        light_bounds b;
+        b.box = light.bounding_box();
+        b.power = float(light.power());
+        if (light.kind() == area_light::shape::sphere || light.kind() == area_light::shape::mesh) {
+            b.cos_normals = -1;  // Normals in every direction
+        } else {
+            b.axis = light.normal();
+            b.two_sided = true;
+        }
+        return b;
+    }
+
+    static packed_bounds pack(const light_bounds& b) {
+        packed_bounds packed;
+        real radius_squared = 0;
+        for (int axis = 0; axis < 3; axis++) {
+            const auto& extent = b.box.axis_interval(axis);
+            packed.center[axis] = float((extent.min + extent.max) / 2);
+            radius_squared += extent.size() * extent.size() / 4;
+            packed.axis[axis] = float(b.axis[axis]);
+        }
+        packed.radius = float(std::sqrt(radius_squared));
+        packed.power = b.power;
+        packed.cos_normals = b.cos_normals;
+        packed.sin_normals = std::sqrt(std::fmax(0.0f, 1 - b.cos_normals * b.cos_normals));
+        packed.cos_emission = b.cos_emission;
+        packed.two_sided = b.two_sided;
+        return packed;
+    }
+
+    static light_bounds merge(const light_bounds& a, const light_bounds& b);
+    static real orientation_measure(const light_bounds& b);
+
+    int32_t build(const std::vector<light_bounds>& bounds, std::vector<size_t>& order,
+                  size_t begin, size_t end);
+};
+
+
+// Cones of directions
+
+inline real cos_difference(real sin_a, real cos_a, real sin_b, real cos_b) {
+    // Returns cos(max(0, a - b)) for angles a and b in [0, pi] given by sines and cosines.
+    if (cos_a > cos_b)
+        return 1;
+    return cos_a * cos_b + sin_a * sin_b;
+}
+
+inline vec3 rotate_toward(const vec3& from, const vec3& axis, real angle) {
+    // Rotates the vector about the unit axis by the angle (Rodrigues' formula).
+    auto c = std::cos(angle), s = std::sin(angle);
+    return from * c + cross(axis, from) * s + axis * dot(axis, from) * (1 - c);
+}
+
+inline real light_tree::packed_bounds::importance(const point3& p, const vec3& n) const {
+    // Estimates how much light from these bounds could reach p, as the power over the squared
+    // distance, times the cosine of the smallest angle between the direction to p and any
+    // emitting direction, and times the smallest angle to the normal n, if given.
+
+    if (power <= 0)
+        return 0;
+
+    real to_point[3], length_squared = 0;
+    for (int i = 0; i < 3; i++) {
+        to_point[i] = p[i] - center[i];
+        length_squared += to_point[i] * to_point[i];
+    }
+    auto radius_squared = real(radius) * radius;
+    auto distance_squared = std::fmax(length_squared, radius_squared);
+
+    // Half angle of the cone from p that holds the bounds: all directions if p is inside.
+    real cos_bounds = -1, sin_bounds = 0;
+    if (length_squared > radius_squared) {
+        auto sin_squared = radius_squared / length_squared;
+        sin_bounds = std::sqrt(sin_squared);
+        cos_bounds = std::sqrt(1 - sin_squared);
+    }
+
+    real direction[3] = { axis[0], axis[1], axis[2] };
+    if (length_squared > 0) {
+        auto inverse_length = 1 / std::sqrt(length_squared);
+        for (int i = 0; i < 3; i++)
+            direction[i] = to_point[i] * inverse_length;
+    }
+
+    auto cos_axis = axis[0] * direction[0] + axis[1] * direction[1] + axis[2] * direction[2];
+    if (two_sided)
+        cos_axis = std::fabs(cos_axis);
+    auto sin_axis = std::sqrt(std::fmax(real(0), 1 - cos_axis * cos_axis));
+
+    // Angle from the cone of normals to p, less the angle the bounds subtend.
+    auto cos_outside = cos_difference(sin_axis, cos_axis, sin_normals, cos_normals);
+    auto sin_outside = std::sqrt(std::fmax(real(0), 1 - cos_outside * cos_outside));
+    auto cos_nearest = cos_difference(sin_outside, cos_outside, sin_bounds, cos_bounds);
+    if (cos_nearest <= cos_emission)
+        return 0;
+
+    auto result = power * cos_nearest / distance_squared;
+
+    if (!n.near_zero()) {
+        auto cos_incident = std::fabs(n[0] * direction[0] + n[1] * direction[1]
+                                      + n[2] * direction[2]);
+        auto sin_incident = std::sqrt(std::fmax(real(0), 1 - cos_incident * cos_incident));
+        result *= cos_difference(sin_incident, cos_incident, sin_bounds, cos_bounds);
+    }
+
+    return std::fmax(result, real(0));
+}
+
+inline light_tree::light_bounds light_tree::merge(const light_bounds& a, const light_bounds& b) {
+    if (a.power <= 0) return b;
+    if (b.power <= 0) return a;
+
+    light_bounds result;
+    result.box = aabb(a.box, b.box);
+    result.power = a.power + b.power;
+    result.cos_emission = std::fmin(a.cos_emission, b.cos_emission);
+    result.two_sided = a.two_sided || b.two_sided;
+
+    // The smallest cone holding both cones of normals.
+    auto angle_a = std::acos(std::clamp(real(a.cos_normals), real(-1), real(1)));
+    auto angle_b = std::acos(std::clamp(real(b.cos_normals), real(-1), real(1)));
+    auto between = std::acos(std::clamp(dot(a.axis, b.axis), real(-1), real(1)));
+
+    if (std::fmin(between + angle_b, pi) <= angle_a) {
+        result.axis = a.axis;
+        result.cos_normals = a.cos_normals;
+    } else if (std::fmin(between + angle_a, pi) <= angle_b) {
+        result.axis = b.axis;
+        result.cos_normals = b.cos_normals;
+    } else {
+        auto angle = (angle_a + between + angle_b) / 2;
+        auto rotation_axis = cross(a.axis, b.axis);
+        if (angle >= pi || rotation_axis.near_zero()) {
+            result.cos_normals = -1;
+        } else {
+            result.axis = unit_vector(
+                rotate_toward(a.axis, unit_vector(rotation_axis), angle - angle_a));
+            result.cos_normals = float(std::cos(angle));
+        }
+    }
+
+    return result;
+}
+
+inline real light_tree::orientation_measure(const light_bounds& b) {
+    // Solid angle measure of the directions the bounds emit in, weighted by the cosine
+    // falloff past the cone of normals; smaller is better when choosing a split.
+    auto normals = std::acos(std::clamp(real(b.cos_normals), real(-1), real(1)));
+    auto emission = std::acos(std::clamp(real(b.cos_emission), real(-1), real(1)));
+    auto spread = std::fmin(normals + emission, pi);
+    auto sin_normals = std::sin(normals);
+    return 2 * pi * (1 - std::cos(normals))
+         + pi / 2 * (2 * spread * sin_normals - std::cos(normals - 2 * spread)
+                     - 2 * normals * sin_normals + std::cos(normals));
+}
+
+inline int32_t light_tree::build(const std::vector<light_bounds>& bounds,
+                                 std::vector<size_t>& order, size_t begin, size_t end) {
+    // Adds the subtree over lights order[begin,end) and returns its root. The split is chosen
+    // among 12 buckets along each axis by the surface area orientation heuristic: each side's
+    // power times its bounds' surface area times its orientation_measure.
+
+    auto index = int32_t(nodes.size());
+    nodes.push_back({});
+
+    light_bounds all;
+    aabb centroids;
+    for (auto i = begin; i < end; i++) {
+        all = merge(all, bounds[order[i]]);
+        const auto& box = bounds[order[i]].box;
+        auto c = point3(box.x.min + box.x.max, box.y.min + box.y.max, box.z.min + box.z.max) / 2;
+        centroids = aabb(centroids, aabb(c, c));
+    }
+    nodes[index].bounds = pack(all);
+
+    if (end - begin == 1) {
+        nodes[index].is_leaf = true;
+        nodes[index].child_or_light = int32_t(order[begin]);
+        return index;
+    }
+
+    static const int bucket_count = 12;
+    real best_cost = infinity;
+    int  best_axis = -1, best_bucket = 0;
+
+    auto extent = std::fmax(centroids.x.size(), std::fmax(centroids.y.size(),
+                                                          centroids.z.size()));
+    auto bucket_of = [&](size_t light, int axis) {
+        const auto& range = centroids.axis_interval(axis);
+        const auto& box = bounds[light].box.axis_interval(axis);
+        auto c = (box.min + box.max) / 2;
+        auto b = int(bucket_count * (c - range.min) / range.size());
+        return std::clamp(b, 0, bucket_count - 1);
+    };
+
+    for (int axis = 0; axis < 3; axis++) {
+        const auto& range = centroids.axis_interval(axis);
+        if (!(range.size() > 0))
+            continue;
+
+        light_bounds buckets[bucket_count];
+        for (auto i = begin; i < end; i++) {
+            auto& bucket = buckets[bucket_of(order[i], axis)];
+            bucket = merge(bucket, bounds[order[i]]);
+        }
+
+        auto cost = [](const light_bounds& side) {
+            if (side.power <= 0) return real(0);
+            return side.power * orientation_measure(side) * side.box.surface_area();
+        };
+
+        // Costs of the buckets above each split, then of those below, in one sweep each.
+        real above_cost[bucket_count];
+        light_bounds side;
+        for (int split = bucket_count - 1; split > 0; split--) {
+            side = merge(side, buckets[split]);
+            above_cost[split] = cost(side);
+        }
+
+        // Splits across thin axes are worth less; the ratio keeps them from being favored.
+        auto regularization = extent / range.size();
+        side = light_bounds();
+        for (int split = 1; split < bucket_count; split++) {
+            side = merge(side, buckets[split - 1]);
+            auto total = regularization * (cost(side) + above_cost[split]);
+            if (total < best_cost) {
+                best_cost = total;
+                best_axis = axis;
+                best_bucket = split;
+            }
+        }
+    }
+
+    // Split by bucket, or in half if the lights can't be told apart.
+    auto middle = begin + (end - begin) / 2;
+    if (best_axis >= 0) {
+        auto split_at = std::partition(order.begin() + begin, order.begin() + end,
+            [&](size_t light) { return bucket_of(light, best_axis) < best_bucket; });
+        auto count = size_t(split_at - order.begin());
+        if (count > begin && count < end)
+            middle = count;
+    }
+
+    build(bounds, order, begin, middle);
+    nodes[index].child_or_light = build(bounds, order, middle, end);
+    nodes[index].is_leaf = false;
+    return index;
+}
+
+#endif
@@ -1,12 +1,15 @@
 #include "rtweekend.h"
 
+#include "animation.h"
 #include "bvh.h"
 #include "camera.h"
 #include "constant_medium.h"
+#include "flat_bvh.h"
 #include "hittable.h"
 #include "hittable_list.h"
 #include "material.h"
 #include "quad.h"
+#include "scene_loader.h"
 #include "sphere.h"
 #include "texture.h"
 #include "triangle.h"
@@ -21,6 +24,17 @@
     "mingw32-make" to run makefile
     IMPORTANT: This makefile will open the image in GIMP (v 2.10). Makefile will need to
     be changed if you don't have GIMP installed or in the correct path.
+
+    "mingw32-make float" builds frt_float, which does all geometry in single precision.
+
+    To render a scene file instead of one of the built-in scenes below:
+    "example scenes/cornell_box.scene > image.ppm"
+    Text scenes can be converted to the binary format, which loads much faster:
+    "example --convert scenes/cornell_box.scene cornell_box.frtb"
+    "example --bouncing-spheres 1000000 bouncing_1m.frtb" writes a binary variant of
+    bouncing_spheres() with about a million small spheres.
+    "example --smoke-voxels 256 smoke.vox" writes a sparse voxel grid of a smoke plume, which
+    scenes can render with `voxels`.
 */
 
 void bouncing_spheres() {
@@ -68,7 +82,10 @@ void bouncing_spheres() {
     auto material3 = make_shared<metal>(color(0.7, 0.6, 0.5), 0.0);
     world.add(make_shared<sphere>(point3(4, 1, 0), 1.0, material3));
 
-    world = hittable_list(make_shared<bvh_node>(world));
+    // Most small spheres move, so the BVH keeps per-time bounds for them.
+    bvh_build_options options;
+    options.typed_leaves = true;
+    world = hittable_list(make_shared<flat_bvh>(world, options));
 
     // Camera
     camera cam;
@@ -574,7 +591,261 @@ void final_render() {
     cam.render_parallelized(world);
 }
 
-int main() {
+void animated_spheres() {
+    // A ring of spheres orbiting a swaying human mesh, rendered to frame_0000.ppm and onward.
+    // Only the orbiting spheres and the mesh change between frames, so the ground and the
+    // static spheres keep their BVH and the rest is refit.
+
+    animation anim;
+
+    auto checker = make_shared<checker_texture>(0.32, color(.2, .3, .1), color(.9, .9, .9));
+    anim.add_static(make_shared<sphere>(point3(0,-1000,0), 1000, make_shared<lambertian>(checker)));
+
+    for (int a = -6; a <= 6; a++) {
+        for (int b = -6; b <= 6; b++) {
+            point3 center(a + 0.9*random_double(), 0.2, b + 0.9*random_double());
+            if ((center - point3(0, 0.2, 0)).length() > 5.5)
+                anim.add_static(make_shared<sphere>(center, 0.2,
+                    make_shared<lambertian>(color::random() * color::random())));
+        }
+    }
+
+    const int orbit_count = 12;
+    std::vector<shared_ptr<transform_instance>> orbiters;
+    for (int i = 0; i < orbit_count; i++) {
+        auto mat = make_shared<lambertian>(color::random(0.3, 1));
+        auto ball = make_shared<sphere>(point3(0,0,0), 0.4, mat);
+        orbiters.push_back(make_shared<transform_instance>(ball, affine()));
+        anim.add_dynamic(orbiters.back());
+    }
+
+    auto human = mesh_data::load_obj("objects/human_small.obj");
+    auto mesh = make_shared<triangle_mesh>(human, make_shared<lambertian>(color(1.0, 0.471, 0.0)),
+                                           point3(0, 1, 0));
+    anim.add_dynamic(mesh);
+
+    auto orbit = [&](int i, double frame) {
+        auto angle = 360.0 * i / orbit_count + 6.0 * frame;
+        auto height = 0.6 + 0.4 * std::sin(0.5 * frame + i);
+        return affine::rotation(vec3(0,1,0), angle) * affine::translation(vec3(4, height, 0));
+    };
+
+    anim.cam.aspect_ratio      = 16.0 / 9.0;
+    anim.cam.image_width       = 400;
+    anim.cam.samples_per_pixel = 50;
+    anim.cam.max_depth         = 20;
+    anim.cam.background        = color(0.70, 0.80, 1.00);
+
+    anim.cam.vfov     = 30;
+    anim.cam.lookfrom = point3(0,5,14);
+    anim.cam.lookat   = point3(0,1,0);
+    anim.cam.vup      = vec3(0,1,0);
+
+    std::vector<point3> vertices(human->vertices.size());
+    anim.render_frames(24, [&](int frame) {
+        // The shutter stays open for half a frame, so the orbiters blur along their paths.
+        for (int i = 0; i < orbit_count; i++)
+            orbiters[i]->set_transform(orbit(i, frame), orbit(i, frame + 0.5));
+
+        for (size_t v = 0; v < vertices.size(); v++) {
+            const auto& p = human->vertices[v];
+            vertices[v] = p + vec3(0.15 * p.y() * std::sin(0.4 * frame + p.y()), 0, 0);
+        }
+        mesh->set_vertices(vertices);
+    }, "frame_");
+}
+
+scene_description bouncing_spheres_description(int sphere_count) {
+    // Procedurally generates a larger version of bouncing_spheres(), with sphere_count small
+    // spheres laid out on a square grid. The small spheres share a palette of materials so the
+    // description stays compact.
+
+    scene_description desc;
+    using texture_desc = scene_description::texture_desc;
+    using material_desc = scene_description::material_desc;
+    using shape_desc = scene_description::shape_desc;
+    using kind = scene_description::shape_kind;
+
+    texture_desc even{scene_description::texture_kind::solid};
+    even.albedo = color(.2, .3, .1);
+    texture_desc odd{scene_description::texture_kind::solid};
+    odd.albedo = color(.9, .9, .9);
+    texture_desc checker{scene_description::texture_kind::checker};
+    checker.scale = 0.32;
+    checker.even = 0;
+    checker.odd = 1;
+    desc.textures = { even, odd, checker };
+
+    const int diffuse_count = 64;
+    const int metal_count = 16;
+    for (int i = 0; i < diffuse_count; i++) {
+        texture_desc albedo{scene_description::texture_kind::solid};
+        albedo.albedo = color::random() * color::random();
+        desc.textures.push_back(albedo);
+
+        material_desc mat{scene_description::material_kind::lambertian};
+        mat.texture = int32_t(desc.textures.size() - 1);
+        desc.materials.push_back(mat);
+    }
+    for (int i = 0; i < metal_count; i++) {
+        material_desc mat{scene_description::material_kind::metal};
+        mat.albedo = color::random(0.5, 1);
+        mat.param = random_double(0, 0.5);
+        desc.materials.push_back(mat);
+    }
+    material_desc glass{scene_description::material_kind::dielectric};
+    glass.param = 1.5;
+    desc.materials.push_back(glass);
+    int32_t glass_index = int32_t(desc.materials.size() - 1);
+
+    material_desc ground{scene_description::material_kind::lambertian};
+    ground.texture = 2;
+    desc.materials.push_back(ground);
+
+    auto add_sphere = [&](int32_t mat, const point3& center, double radius) {
+        shape_desc shape;
+        shape.kind = kind::sphere;
+        shape.material = mat;
+        shape.param[0] = center.x();
+        shape.param[1] = center.y();
+        shape.param[2] = center.z();
+        shape.param[3] = radius;
+        desc.shapes.push_back(shape);
+    };
+
+    int side = std::max(1, int(std::sqrt(double(sphere_count))));
+    double ground_radius = std::max(1000.0, 10.0 * side);
+    add_sphere(int32_t(desc.materials.size() - 1), point3(0, -ground_radius, 0), ground_radius);
+
+    desc.shapes.reserve(desc.shapes.size() + size_t(side) * side + 3);
+    for (int a = -side/2; a < side - side/2; a++) {
+        for (int b = -side/2; b < side - side/2; b++) {
+            auto choose_mat = random_double();
+            point3 center(a + 0.9*random_double(), 0.2, b + 0.9*random_double());
+
+            if ((center - point3(4, 0.2, 0)).length() <= 0.9)
+                continue;
+
+            if (choose_mat < 0.8) {
+                shape_desc shape;
+                shape.kind = kind::moving_sphere;
+                shape.material = random_int(0, diffuse_count - 1);
+                auto center2 = center + vec3(0, random_double(0,.5), 0);
+                for (int i = 0; i < 3; i++) {
+                    shape.param[i] = center[i];
+                    shape.param[3+i] = center2[i];
+                }
+                shape.param[6] = 0.2;
+                desc.shapes.push_back(shape);
+            } else if (choose_mat < 0.95) {
+                add_sphere(diffuse_count + random_int(0, metal_count - 1), center, 0.2);
+            } else {
+                add_sphere(glass_index, center, 0.2);
+            }
+        }
+    }
+
+    add_sphere(glass_index, point3(0, 1, 0), 1.0);
+    add_sphere(0, point3(-4, 1, 0), 1.0);
+    add_sphere(diffuse_count, point3(4, 1, 0), 1.0);
+    desc.groups[0].bvh = true;
+
+    auto& cam = desc.cam;
+    cam.aspect_ratio      = 16.0 / 9.0;
+    cam.image_width       = 400;
+    cam.samples_per_pixel = 100;
+    cam.max_depth         = 50;
+    cam.background        = color(0.70, 0.80, 1.00);
+    cam.vfov     = 20;
+    cam.lookfrom = point3(13,2,3);
+    cam.lookat   = point3(0,0,0);
+    cam.vup      = vec3(0,1,0);
+    cam.defocus_angle = 0.6;
+    cam.focus_dist    = 10.0;
+
+    return desc;
+}
+
+sparse_voxel_grid smoke_plume_grid(int resolution) {
+    // Generates a turbulent plume of smoke rising from the origin, in a 2x2x2 box above it
+    // sampled by `resolution` voxels along each side. Only the cone of the plume is occupied,
+    // about a tenth of the box.
+
+    perlin noise;
+    auto voxel_size = 2.0 / resolution;
+    sparse_voxel_grid grid(voxel_size, point3(-1, 0, -1));
+
+    for (int k = 0; k < resolution; k++) {
+        for (int j = 0; j < resolution; j++) {
+            for (int i = 0; i < resolution; i++) {
+                auto p = point3(-1, 0, -1) + voxel_size * vec3(i + 0.5, j + 0.5, k + 0.5);
+                auto radius = 0.1 + 0.25 * p.y();
+                auto distance = std::sqrt(p.x()*p.x() + p.z()*p.z()) / radius;
+                if (distance >= 1)
+                    continue;
+                auto density = (1 - distance) * noise.turb(3 * p, 5);
+                if (density > 0.01)
+                    grid.set(i, j, k, float(density));
+            }
+        }
+    }
+
+    return grid;
+}
+
+int run_scene_tool(int argc, char* argv[]) {
+    // Handles the command line when arguments are given: renders a scene file, or converts
+    // or generates binary scene files.
+
+    std::string command = argv[1];
+
+    if (command == "--convert" && argc == 4) {
+        write_scene_binary(load_scene_description(argv[2]), argv[3]);
+        return 0;
+    }
+
+    // Counts and resolutions below 1 (or not numbers) fall through to the usage message.
+    if (command == "--bouncing-spheres" && argc == 4 && std::atoi(argv[2]) >= 1) {
+        write_scene_binary(bouncing_spheres_description(std::atoi(argv[2])), argv[3]);
+        return 0;
+    }
+
+    if (command == "--smoke-voxels" && argc == 4 && std::atoi(argv[2]) >= 1) {
+        smoke_plume_grid(std::atoi(argv[2])).save(argv[3]);
+        return 0;
+    }
+
+    if (command == "--bdpt" && argc == 3) {
+        auto loaded = load_scene(argv[2]);
+        loaded.cam.bidirectional = true;
+        loaded.cam.render_parallelized(loaded.world);
+        return 0;
+    }
+
+    if (argc == 2 && command.rfind("--", 0) != 0) {
+        auto loaded = load_scene(command);
+        loaded.cam.render_parallelized(loaded.world);
+        return 0;
+    }
+
+    std::cerr << "Usage: " << argv[0] << " [scene file]\n"
+              << "       " << argv[0] << " --bdpt <scene file>\n"
+              << "       " << argv[0] << " --convert <text scene> <binary scene>\n"
+              << "       " << argv[0] << " --bouncing-spheres <count of 1 or more> <binary scene>\n"
+              << "       " << argv[0] << " --smoke-voxels <resolution of 1 or more> <voxel grid>\n";
+    return 1;
+}
+
+int main(int argc, char* argv[]) {
+    if (argc > 1) {
+        try {
+            return run_scene_tool(argc, argv);
+        } catch (const std::exception& e) {
+            std::cerr << e.what() << '\n';
+            return 1;
+        }
+    }
+
     switch (13) {
         case 1: bouncing_spheres();  break;
         case 2: checkered_spheres(); break;
@@ -589,6 +860,7 @@ int main() {
         case 11: cornell_box_monte_carlo(); break;
         case 12: demo_triangle_mesh(); break;
         case 13: final_render(); break;
+        case 14: animated_spheres(); break;
     }
 }
 
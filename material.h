@@ -5,58 +5,100 @@
 #include "onb.h"
 #include "texture.h"
 
+#include <cstdint>
+
+/**
+ * Types of the built-in materials, so that the renderer can dispatch on them with a switch
+ * (see visit_material) instead of through virtual calls. Other materials are `other`.
+ */
+enum class material_type : uint8_t {
+    other, lambertian, metal, dielectric, diffuse_light, isotropic
+};
+
 class material {
   public:
+    material() = default;
     virtual ~material() = default;
 
-    virtual color emitted(double u, double v, const point3& p) const {
+    material_type type() const { return type_tag; }
+
+    virtual color emitted(real u, real v, const point3& p) const {
         return color(0,0,0);
     }
 
     virtual bool scatter(
-        const ray& r_in, const hit_record& rec, color& attenuation, ray& scattered, double& pdf
+        const ray& r_in, const hit_record& rec, color& attenuation, ray& scattered, real& pdf
     ) const {
         return false;
     }
 
-    virtual double scattering_pdf(const ray& r_in, const hit_record& rec, const ray& scattered)
+    virtual real scattering_pdf(const ray& r_in, const hit_record& rec, const ray& scattered)
     const {
         return 0;
     }
+
+    virtual ray_differential scatter_differential(
+        const ray& r_in, const hit_record& rec, const ray& scattered,
+        const ray_differential& neighbors
+    ) const {
+        // Returns the neighbors of the scattered ray, given those of the incoming ray moved to
+        // the tangent plane at the hit. Rough surfaces scatter far wider than a pixel, and
+        // following that would blur every texture seen after a bounce, so by default the
+        // neighbors keep the angle they had to the incoming ray around the new direction.
+
+        auto in = unit_vector(r_in.direction());
+        auto out = unit_vector(scattered.direction());
+        onb uvw(out);
+        auto x_angle = (unit_vector(neighbors.x.direction()) - in).length();
+        auto y_angle = (unit_vector(neighbors.y.direction()) - in).length();
+        return {
+            ray(neighbors.x.origin(), out + x_angle * uvw.u(), scattered.time()),
+            ray(neighbors.y.origin(), out + y_angle * uvw.v(), scattered.time())
+        };
+    }
+
+  protected:
+    explicit material(material_type type) : type_tag(type) {}
+
+  private:
+    material_type type_tag = material_type::other;
 };
 
-class lambertian : public material {
+class lambertian final : public material {
   public:
-    lambertian(const color& albedo) : tex(make_shared<solid_color>(albedo)) {}
-    lambertian(shared_ptr<texture> tex) : tex(tex) {}
+    lambertian(const color& albedo)
+      : material(material_type::lambertian), tex(make_shared<solid_color>(albedo)) {}
+    lambertian(shared_ptr<texture> tex) : material(material_type::lambertian), tex(tex) {}
 
     bool scatter(
-        const ray& r_in, const hit_record& rec, color& attenuation, ray& scattered, double& pdf
+        const ray& r_in, const hit_record& rec, color& attenuation, ray& scattered, real& pdf
     ) const override {
         onb uvw(rec.normal);
         auto scatter_direction = uvw.transform(random_cosine_direction());
 
         scattered = ray(rec.p, unit_vector(scatter_direction), r_in.time());
-        attenuation = tex->value(rec.u, rec.v, rec.p);
+        attenuation = tex->filtered_value(rec.u, rec.v, rec.p, rec.uv_footprint, rec.footprint);
         pdf = dot(uvw.w(), scattered.direction()) / pi;
         return true;
     }
 
-    double scattering_pdf(const ray& r_in, const hit_record& rec, const ray& scattered)
+    real scattering_pdf(const ray& r_in, const hit_record& rec, const ray& scattered)
     const override {
-        return 1 / (2*pi);
+        auto cos_theta = dot(rec.normal, unit_vector(scattered.direction()));
+        return cos_theta < 0 ? 0 : cos_theta/pi;
     }
 
   private:
     shared_ptr<texture> tex;
 };
 
-class metal : public material {
+class metal final : public material {
   public:
-    metal(const color& albedo, double fuzz) : albedo(albedo), fuzz(fuzz < 1 ? fuzz : 1) {}
+    metal(const color& albedo, real fuzz)
+      : material(material_type::metal), albedo(albedo), fuzz(fuzz < 1 ? fuzz : 1) {}
 
     bool scatter(
-        const ray& r_in, const hit_record& rec, color& attenuation, ray& scattered, double& pdf
+        const ray& r_in, const hit_record& rec, color& attenuation, ray& scattered, real& pdf
     ) const override {
         vec3 reflected = reflect(r_in.direction(), rec.normal);
         reflected = unit_vector(reflected) + (fuzz * random_unit_vector());
@@ -65,24 +107,39 @@ class metal : public material {
         return (dot(scattered.direction(), rec.normal) > 0);
     }
 
+    ray_differential scatter_differential(
+        const ray& r_in, const hit_record& rec, const ray& scattered,
+        const ray_differential& neighbors
+    ) const override {
+        // Mirror the neighbors as if the surface were flat, with the same fuzz as this ray.
+        auto fuzz_offset =
+            scattered.direction() - unit_vector(reflect(r_in.direction(), rec.normal));
+        auto mirrored = [&](const ray& neighbor) {
+            auto direction = unit_vector(reflect(neighbor.direction(), rec.normal));
+            return ray(neighbor.origin(), direction + fuzz_offset, scattered.time());
+        };
+        return { mirrored(neighbors.x), mirrored(neighbors.y) };
+    }
+
   private:
     color albedo;
-    double fuzz;
+    real fuzz;
 };
 
-class dielectric : public material {
+class dielectric final : public material {
   public:
-    dielectric(double refraction_index) : refraction_index(refraction_index) {}
+    dielectric(real refraction_index)
+      : material(material_type::dielectric), refraction_index(refraction_index) {}
 
     bool scatter(
-        const ray& r_in, const hit_record& rec, color& attenuation, ray& scattered, double& pdf
+        const ray& r_in, const hit_record& rec, color& attenuation, ray& scattered, real& pdf
     ) const override {
         attenuation = color(1.0, 1.0, 1.0);
-        double ri = rec.front_face ? (1.0/refraction_index) : refraction_index;
+        real ri = rec.front_face ? (1.0/refraction_index) : refraction_index;
 
         vec3 unit_direction = unit_vector(r_in.direction());
-        double cos_theta = std::fmin(dot(-unit_direction, rec.normal), 1.0);
-        double sin_theta = std::sqrt(1.0 - cos_theta*cos_theta);
+        real cos_theta = std::fmin(dot(-unit_direction, rec.normal), 1.0);
+        real sin_theta = std::sqrt(1.0 - cos_theta*cos_theta);
 
         bool cannot_refract = ri * sin_theta > 1.0;
         vec3 direction;
@@ -96,12 +153,28 @@ class dielectric : public material {
         return true;
     }
 
+    ray_differential scatter_differential(
+        const ray& r_in, const hit_record& rec, const ray& scattered,
+        const ray_differential& neighbors
+    ) const override {
+        // Reflect or refract the neighbors the way this ray went, as if the surface were flat.
+        bool refracted = dot(scattered.direction(), rec.normal) < 0;
+        real ri = rec.front_face ? (1.0/refraction_index) : refraction_index;
+        auto bent = [&](const ray& neighbor) {
+            auto unit_direction = unit_vector(neighbor.direction());
+            auto direction = refracted ? refract(unit_direction, rec.normal, ri)
+                                       : reflect(unit_direction, rec.normal);
+            return ray(neighbor.origin(), direction, scattered.time());
+        };
+        return { bent(neighbors.x), bent(neighbors.y) };
+    }
+
   private:
     // Refractive index in vacuum or air, or the ratio of the material's refractive index over
     // the refractive index of the enclosing media
-    double refraction_index;
+    real refraction_index;
 
-    static double reflectance(double cosine, double refraction_index) {
+    static real reflectance(real cosine, real refraction_index) {
         // Use Schlick's approximation for reflectance.
         auto r0 = (1 - refraction_index) / (1 + refraction_index);
         r0 = r0*r0;
@@ -109,12 +182,13 @@ class dielectric : public material {
     }
 };
 
-class diffuse_light : public material {
+class diffuse_light final : public material {
   public:
-    diffuse_light(shared_ptr<texture> tex) : tex(tex) {}
-    diffuse_light(const color& emit) : tex(make_shared<solid_color>(emit)) {}
+    diffuse_light(shared_ptr<texture> tex) : material(material_type::diffuse_light), tex(tex) {}
+    diffuse_light(const color& emit)
+      : material(material_type::diffuse_light), tex(make_shared<solid_color>(emit)) {}
 
-    color emitted(double u, double v, const point3& p) const override {
+    color emitted(real u, real v, const point3& p) const override {
         return tex->value(u, v, p);
     }
 
@@ -122,13 +196,14 @@ class diffuse_light : public material {
     shared_ptr<texture> tex;
 };
 
-class isotropic : public material {
+class isotropic final : public material {
   public:
-    isotropic(const color& albedo) : tex(make_shared<solid_color>(albedo)) {}
-    isotropic(shared_ptr<texture> tex) : tex(tex) {}
+    isotropic(const color& albedo)
+      : material(material_type::isotropic), tex(make_shared<solid_color>(albedo)) {}
+    isotropic(shared_ptr<texture> tex) : material(material_type::isotropic), tex(tex) {}
 
     bool scatter(
-        const ray& r_in, const hit_record& rec, color& attenuation, ray& scattered, double& pdf
+        const ray& r_in, const hit_record& rec, color& attenuation, ray& scattered, real& pdf
     ) const override {
         scattered = ray(rec.p, random_unit_vector(), r_in.time());
         attenuation = tex->value(rec.u, rec.v, rec.p);
@@ -136,7 +211,7 @@ class isotropic : public material {
         return true;
     }
 
-    double scattering_pdf(const ray& r_in, const hit_record& rec, const ray& scattered)
+    real scattering_pdf(const ray& r_in, const hit_record& rec, const ray& scattered)
     const override {
         return 1 / (4 * pi);
     }
@@ -145,4 +220,20 @@ class isotropic : public material {
     shared_ptr<texture> tex;
 };
 
+template <typename visitor>
+inline auto visit_material(const material& mat, visitor&& visit) {
+    // Calls visit with mat as its own type if it is a built-in material. Those are final, so
+    // their member functions are called directly and can be inlined. Other materials are
+    // passed as plain materials and called virtually.
+    switch (mat.type()) {
+      case material_type::lambertian:    return visit(static_cast<const lambertian&>(mat));
+      case material_type::metal:         return visit(static_cast<const metal&>(mat));
+      case material_type::dielectric:    return visit(static_cast<const dielectric&>(mat));
+      case material_type::diffuse_light: return visit(static_cast<const diffuse_light&>(mat));
+      case material_type::isotropic:     return visit(static_cast<const isotropic&>(mat));
+      default:                           return visit(mat);
+    }
+}
+
+
 #endif
\ No newline at end of file
@@ -0,0 +1,137 @@
+#ifndef MIP_IMAGE_H
+#define MIP_IMAGE_H
+
+#include "rtw_stb_image.h"
+
+#include <algorithm>
+#include <cmath>
+#include <vector>
+
+/**
+ * Image prepared for texture lookups: a MIP pyramid of the image and its halvings down to a
+ * single texel, each level stored in 8x8 texel tiles. A lookup covering a footprint in (u,v)
+ * reads the two levels whose texels are closest to its size and blends bilinear samples of
+ * them (trilinear filtering), so distant surfaces read a few texels of a small level instead
+ * of scattered texels of the full image.
+ *
+ * A tile is 192 bytes, so the texels of a small neighborhood share a few cache lines however
+ * wide the image is, where rows of an 8K image are 24KB apart. The pyramid adds a third to
+ * the image's size.
+ */
+class mip_image {
+  public:
+    mip_image(const rtw_image& image) {
+        if (image.width() <= 0 || image.height() <= 0)
+            return;
+
+        add_level(image.width(), image.height());
+        for (int j = 0; j < image.height(); j++)
+            for (int i = 0; i < image.width(); i++)
+                std::copy_n(image.pixel_data(i, j), bytes_per_pixel, texel(0, i, j));
+
+        // Each level averages 2x2 texels of the one before; odd edges repeat their last texel.
+        while (levels.back().width > 1 || levels.back().height > 1) {
+            auto above = int(levels.size()) - 1;
+            add_level(std::max(1, levels[above].width / 2), std::max(1, levels[above].height / 2));
+            auto& level = levels.back();
+
+            for (int j = 0; j < level.height; j++) {
+                for (int i = 0; i < level.width; i++) {
+                    auto i1 = std::min(2*i + 1, levels[above].width - 1);
+                    auto j1 = std::min(2*j + 1, levels[above].height - 1);
+                    const unsigned char* corners[4] = {
+                        texel(above, 2*i, 2*j), texel(above, i1, 2*j),
+                        texel(above, 2*i, j1),  texel(above, i1, j1)
+                    };
+                    auto result = texel(above + 1, i, j);
+                    for (int c = 0; c < bytes_per_pixel; c++)
+                        result[c] = (corners[0][c] + corners[1][c] + corners[2][c]
+                                     + corners[3][c] + 2) / 4;
+                }
+            }
+        }
+    }
+
+    int width()  const { return levels.empty() ? 0 : levels[0].width; }
+    int height() const { return levels.empty() ? 0 : levels[0].height; }
+    int level_count() const { return int(levels.size()); }
+
+    size_t memory_bytes() const { return texels.size(); }
+
+    color sample(real u, real v, real footprint) const {
+        // Returns the image filtered over a footprint of the given width around (u,v), with
+        // (0,0) the bottom left corner and (1,1) the top right. Coordinates are clamped.
+
+        auto texels_across = footprint * std::max(width(), height());
+        auto level = texels_across > 1 ? real(std::log2(texels_across)) : real(0);
+        level = std::min(level, real(level_count() - 1));
+
+        auto coarse = int(level);
+        auto fine_color = bilinear(coarse, u, v);
+        auto blend = level - coarse;
+        if (blend <= 0)
+            return fine_color;
+        return (1 - blend) * fine_color + blend * bilinear(coarse + 1, u, v);
+    }
+
+  private:
+    static const int bytes_per_pixel = 3;
+    static const int tile_size = 8;
+
+    struct level_layout {
+        int    width, height;
+        int    tiles_across;
+        size_t offset;  // Start of the level's tiles in `texels`
+    };
+
+    std::vector<level_layout>  levels;
+    std::vector<unsigned char> texels;  // Linear 8-bit pixel data, tile by tile, level by level
+
+    void add_level(int width, int height) {
+        auto tiles_across = (width + tile_size - 1) / tile_size;
+        auto tiles_down = (height + tile_size - 1) / tile_size;
+        levels.push_back({ width, height, tiles_across, texels.size() });
+        texels.resize(texels.size() + size_t(tiles_across) * tiles_down
+                                      * tile_size * tile_size * bytes_per_pixel);
+    }
+
+    size_t texel_offset(int level, int i, int j) const {
+        const auto& layout = levels[level];
+        auto tile = size_t(j / tile_size) * layout.tiles_across + i / tile_size;
+        auto in_tile = (j % tile_size) * tile_size + i % tile_size;
+        return layout.offset + (tile * tile_size * tile_size + in_tile) * bytes_per_pixel;
+    }
+
+    unsigned char* texel(int level, int i, int j) { return &texels[texel_offset(level, i, j)]; }
+
+    const unsigned char* texel(int level, int i, int j) const {
+        return &texels[texel_offset(level, i, j)];
+    }
+
+    color bilinear(int level, real u, real v) const {
+        const auto& layout = levels[level];
+
+        // Texel centers sit at half-integer coordinates; flip v to image rows.
+        auto x = interval(0,1).clamp(u) * layout.width - real(0.5);
+        auto y = (1 - interval(0,1).clamp(v)) * layout.height - real(0.5);
+        x = interval(0, real(layout.width - 1)).clamp(x);
+        y = interval(0, real(layout.height - 1)).clamp(y);
+
+        auto i0 = int(x), j0 = int(y);
+        auto i1 = std::min(i0 + 1, layout.width - 1);
+        auto j1 = std::min(j0 + 1, layout.height - 1);
+        auto fx = x - i0, fy = y - j0;
+
+        auto top    = (1 - fx) * texel_color(level, i0, j0) + fx * texel_color(level, i1, j0);
+        auto bottom = (1 - fx) * texel_color(level, i0, j1) + fx * texel_color(level, i1, j1);
+        return (1 - fy) * top + fy * bottom;
+    }
+
+    color texel_color(int level, int i, int j) const {
+        auto pixel = texel(level, i, j);
+        auto color_scale = real(1) / 255;
+        return color(color_scale*pixel[0], color_scale*pixel[1], color_scale*pixel[2]);
+    }
+};
+
+#endif
@@ -1,11 +1,24 @@
 #ifndef PERLIN_H
 #define PERLIN_H
 
+/**
+ * Perlin gradient noise. turb() sums octaves of it, a SIMD register's width of octaves at a
+ * time: each lane evaluates one octave, so 7 octaves take two passes with four lanes, or one
+ * with eight. The gradient lookups stay scalar; the interpolation is done in the lanes.
+ */
 class perlin {
   public:
+#if defined(__AVX__)
+    static const int lane_count = 32 / sizeof(real);  // Octaves evaluated together
+#else
+    static const int lane_count = 16 / sizeof(real);
+#endif
+
     perlin() {
         for (int i = 0; i < point_count; i++) {
             randvec[i] = unit_vector(vec3::random(-1,1));
+            for (int axis = 0; axis < 3; axis++)
+                gradients[axis][i] = randvec[i][axis];
         }
 
         perlin_generate_perm(perm_x);
@@ -13,7 +26,7 @@ class perlin {
         perlin_generate_perm(perm_z);
     }
 
-    double noise(const point3& p) const {
+    real noise(const point3& p) const {
         auto u = p.x() - std::floor(p.x());
         auto v = p.y() - std::floor(p.y());
         auto w = p.z() - std::floor(p.z());
@@ -35,27 +48,97 @@ class perlin {
         return perlin_interp(c, u, v, w);
     }
 
-    double turb(const point3& p, int depth) const {
-        auto accum = 0.0;
-        auto temp_p = p;
-        auto weight = 1.0;
+    real turb(const point3& p, int depth) const {
+        // Sums depth octaves of noise, each at twice the frequency and half the weight of the
+        // one before.
 
-        for (int i = 0; i < depth; i++) {
-            accum += weight * noise(temp_p);
-            weight *= 0.5;
-            temp_p *= 2;
+        lanes octave, scale;  // Of each lane in the first pass
+        for (int lane = 0; lane < lane_count; lane++) {
+            octave[lane] = lane;
+            scale[lane] = real(1 << lane);
         }
 
-        return std::fabs(accum);
+        lanes accum = {};
+        for (int first = 0; first < depth; first += lane_count) {
+            lanes weight = octave < real(depth) ? real(1) / scale : lanes{};
+            accum += weight * noise(p.x() * scale, p.y() * scale, p.z() * scale);
+            octave += real(lane_count);
+            scale *= real(1 << lane_count);
+        }
+
+        real sum = 0;
+        for (int lane = 0; lane < lane_count; lane++)
+            sum += accum[lane];
+        return std::fabs(sum);
+    }
+
+    real turb(const point3& p, int depth, real footprint) const {
+        // Turbulence as seen over a footprint of the given width: octaves whose lattice is
+        // finer than twice the footprint would only add aliasing, and are left out.
+        if (footprint > 0) {
+            auto visible = std::floor(std::log2(0.5 / footprint)) + 1;
+            depth = int(std::fmax(1, std::fmin(visible, depth)));
+        }
+        return turb(p, depth);
     }
 
   private:
+    typedef real lanes __attribute__((vector_size(lane_count * sizeof(real))));
+    typedef decltype(lanes{} < lanes{}) lane_ints;  // Integers the size of real
+
     static const int point_count = 256;
     vec3 randvec[point_count];
+    real gradients[3][point_count];  // randvec by axis, for gathering into lanes
     int perm_x[point_count];
     int perm_y[point_count];
     int perm_z[point_count];
 
+    static lane_ints lane_floor(lanes x) {
+        // Rounds down by truncating, then stepping back the lanes that truncation rounded up.
+        auto truncated = __builtin_convertvector(x, lane_ints);
+        return truncated + (__builtin_convertvector(truncated, lanes) > x);
+    }
+
+    lanes noise(lanes x, lanes y, lanes z) const {
+        // The noise at a point per lane, with the arithmetic of noise(const point3&).
+
+        auto i = lane_floor(x), j = lane_floor(y), k = lane_floor(z);
+        lanes u = x - __builtin_convertvector(i, lanes);
+        lanes v = y - __builtin_convertvector(j, lanes);
+        lanes w = z - __builtin_convertvector(k, lanes);
+        lanes uu = u*u*(real(3)-real(2)*u);
+        lanes vv = v*v*(real(3)-real(2)*v);
+        lanes ww = w*w*(real(3)-real(2)*w);
+
+        lane_ints hash_x[2], hash_y[2], hash_z[2];  // Permutations of each corner's coordinates
+        for (int lane = 0; lane < lane_count; lane++) {
+            for (int d = 0; d < 2; d++) {
+                hash_x[d][lane] = perm_x[(i[lane]+d) & 255];
+                hash_y[d][lane] = perm_y[(j[lane]+d) & 255];
+                hash_z[d][lane] = perm_z[(k[lane]+d) & 255];
+            }
+        }
+
+        lanes accum = {};
+        for (int di=0; di < 2; di++)
+            for (int dj=0; dj < 2; dj++)
+                for (int dk=0; dk < 2; dk++) {
+                    lane_ints index = hash_x[di] ^ hash_y[dj] ^ hash_z[dk];
+                    lanes cx, cy, cz;
+                    for (int lane = 0; lane < lane_count; lane++) {
+                        cx[lane] = gradients[0][index[lane]];
+                        cy[lane] = gradients[1][index[lane]];
+                        cz[lane] = gradients[2][index[lane]];
+                    }
+
+                    lanes weight = (di ? uu : real(1)-uu) * (dj ? vv : real(1)-vv)
+                                 * (dk ? ww : real(1)-ww);
+                    accum += weight * (cx*(u-real(di)) + cy*(v-real(dj)) + cz*(w-real(dk)));
+                }
+
+        return accum;
+    }
+
     static void perlin_generate_perm(int* p) {
         for (int i = 0; i < point_count; i++)
             p[i] = i;
@@ -72,7 +155,7 @@ class perlin {
         }
     }
 
-    static double perlin_interp(const vec3 c[2][2][2], double u, double v, double w) {
+    static real perlin_interp(const vec3 c[2][2][2], real u, real v, real w) {
         auto uu = u*u*(3-2*u);
         auto vv = v*v*(3-2*v);
         auto ww = w*w*(3-2*w);
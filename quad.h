@@ -1,6 +1,7 @@
 #ifndef QUAD_H
 #define QUAD_H
 
+#include "arena.h"
 #include "hittable.h"
 #include "hittable_list.h"
 
@@ -13,6 +14,7 @@ class quad : public hittable {
         normal = unit_vector(n);
         D = dot(normal, Q);
         w = n / dot(n,n);
+        uv_scale = std::sqrt(n.length());
 
         set_bounding_box();
     }
@@ -26,6 +28,11 @@ class quad : public hittable {
 
     aabb bounding_box() const override { return bbox; }
 
+    aabb bounding_box_in(const aabb& clip) const override {
+        point3 corners[4] = { Q, Q + u, Q + u + v, Q + v };
+        return clipped_polygon_bounds(corners, 4, clip);
+    }
+
     bool hit(const ray& r, interval ray_t, hit_record& rec) const override {
         auto denom = dot(normal, r.direction());
 
@@ -39,7 +46,10 @@ class quad : public hittable {
             return false;
 
         // Determine if the hit point lies within the planar shape using its plane coordinates.
+        // Project the point back onto the plane, so its error is on the scale of its own
+        // coordinates rather than the ray origin's (see offset_ray_origin).
         auto intersection = r.at(t);
+        intersection = intersection - (dot(normal, intersection) - D) * normal;
         vec3 planar_hitpt_vector = intersection - Q;
         auto alpha = dot(w, cross(planar_hitpt_vector, v));
         auto beta = dot(w, cross(u, planar_hitpt_vector));
@@ -50,13 +60,15 @@ class quad : public hittable {
         // Ray hits the 2D shape; set the rest of the hit record and return true.
         rec.t = t;
         rec.p = intersection;
-        rec.mat = mat;
+        rec.p_error = 0;
+        rec.uv_scale = uv_scale;
+        rec.mat = mat.get();
         rec.set_face_normal(r, normal);
 
         return true;
     }
 
-    virtual bool is_interior(double a, double b, hit_record& rec) const {
+    virtual bool is_interior(real a, real b, hit_record& rec) const {
         interval unit_interval = interval(0, 1);
         // Given the hit point in plane coordinates, return false if it is outside the
         // primitive, otherwise set the hit record UV coordinates and return true.
@@ -76,14 +88,17 @@ class quad : public hittable {
     shared_ptr<material> mat;
     aabb bbox;
     vec3 normal;
-    double D;
+    real D;
+    real uv_scale;  // Square root of the quad's area, which (u,v) spans once
 };
 
-inline shared_ptr<hittable_list> box(const point3& a, const point3& b, shared_ptr<material> mat)
+inline shared_ptr<hittable_list> box(const point3& a, const point3& b, shared_ptr<material> mat,
+                                     const shared_ptr<arena>& memory = nullptr)
 {
-    // Returns the 3D box (six sides) that contains the two opposite vertices a & b.
+    // Returns the 3D box (six sides) that contains the two opposite vertices a & b, allocated
+    // in the given arena if there is one.
 
-    auto sides = make_shared<hittable_list>();
+    auto sides = arena_make<hittable_list>(memory);
 
     // Construct the two opposite vertices with the minimum and maximum coordinates.
     auto min = point3(std::fmin(a.x(),b.x()), std::fmin(a.y(),b.y()), std::fmin(a.z(),b.z()));
@@ -93,12 +108,15 @@ inline shared_ptr<hittable_list> box(const point3& a, const point3& b, shared_pt
     auto dy = vec3(0, max.y() - min.y(), 0);
     auto dz = vec3(0, 0, max.z() - min.z());
 
-    sides->add(make_shared<quad>(point3(min.x(), min.y(), max.z()),  dx,  dy, mat)); // front
-    sides->add(make_shared<quad>(point3(max.x(), min.y(), max.z()), -dz,  dy, mat)); // right
-    sides->add(make_shared<quad>(point3(max.x(), min.y(), min.z()), -dx,  dy, mat)); // back
-    sides->add(make_shared<quad>(point3(min.x(), min.y(), min.z()),  dz,  dy, mat)); // left
-    sides->add(make_shared<quad>(point3(min.x(), max.y(), max.z()),  dx, -dz, mat)); // top
-    sides->add(make_shared<quad>(point3(min.x(), min.y(), min.z()),  dx,  dz, mat)); // bottom
+    auto side = [&](const point3& Q, const vec3& u, const vec3& v) {
+        sides->add(arena_make<quad>(memory, Q, u, v, mat));
+    };
+    side(point3(min.x(), min.y(), max.z()),  dx,  dy); // front
+    side(point3(max.x(), min.y(), max.z()), -dz,  dy); // right
+    side(point3(max.x(), min.y(), min.z()), -dx,  dy); // back
+    side(point3(min.x(), min.y(), min.z()),  dz,  dy); // left
+    side(point3(min.x(), max.y(), max.z()),  dx, -dz); // top
+    side(point3(min.x(), min.y(), min.z()),  dx,  dz); // bottom
 
     return sides;
 }
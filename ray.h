@@ -3,11 +3,15 @@
 
 #include "vec3.h"
 
+#include <cstdint>
+#include <cstring>
+#include <type_traits>
+
 class ray {
   public:
     ray() {}
 
-    ray(const point3& origin, const vec3& direction, double time)
+    ray(const point3& origin, const vec3& direction, real time)
       : orig(origin), dir(direction), tm(time) {}
 
     ray(const point3& origin, const vec3& direction)
@@ -16,16 +20,65 @@ class ray {
     const point3& origin() const  { return orig; }
     const vec3& direction() const { return dir; }
 
-    double time() const { return tm; }
+    real time() const { return tm; }
 
-    point3 at(double t) const {
+    point3 at(real t) const {
         return orig + t*dir;
     }
 
   private:
     point3 orig;
     vec3 dir;
-    double tm;
+    real tm;
+};
+
+/**
+ * Rays through the neighboring pixels to the right of and below a camera ray's pixel, followed
+ * through the camera ray's bounces to estimate how much of the scene the pixel covers at each
+ * hit (Igehy, "Tracing Ray Differentials"). At a hit they are moved to where they meet the
+ * plane tangent to the surface, so the distance from the hit point to them is the width of the
+ * pixel's footprint there.
+ */
+class ray_differential {
+  public:
+    ray x;  // Through the pixel to the right
+    ray y;  // Through the pixel below
 };
 
+inline point3 offset_ray_origin(const point3& p, const vec3& n, const vec3& direction,
+                                real p_error = 0) {
+    // Moves a surface point off the surface along the normal n, to the side the direction
+    // leaves toward, so a ray starting there can't hit the surface it starts on. This replaces
+    // a fixed minimum hit distance, which is too small for large coordinates in single
+    // precision and needlessly large near the origin. Away from the origin each coordinate
+    // moves by a fixed count of its own ulps, matching the round-off in computing it; near the
+    // origin, where ulps vanish, it moves by a small fixed distance instead (Waechter and
+    // Binder, "A Fast and Robust Method for Avoiding Self-Intersection", Ray Tracing Gems).
+    // p_error first moves the point past any larger error bound the intersection reported.
+
+    using bits = std::conditional_t<sizeof(real) == 4, int32_t, int64_t>;
+    const real near_origin = real(1) / 32;
+    const real fixed_scale = real(1) / 65536;
+    const real ulp_scale   = 256;
+
+    auto normal = dot(n, direction) < 0 ? -n : n;
+    auto start = p + p_error * normal;
+    point3 result;
+
+    for (int i = 0; i < 3; i++) {
+        if (std::fabs(start[i]) < near_origin) {
+            result[i] = start[i] + fixed_scale * normal[i];
+            continue;
+        }
+
+        auto ulps = bits(ulp_scale * normal[i]);
+        bits value;
+        std::memcpy(&value, &start.e[i], sizeof(value));
+        value += start[i] < 0 ? -ulps : ulps;
+        std::memcpy(&result.e[i], &value, sizeof(value));
+    }
+
+    return result;
+}
+
 #endif
\ No newline at end of file
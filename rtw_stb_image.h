@@ -17,13 +17,14 @@ class rtw_image {
   public:
     rtw_image() {}
 
-    rtw_image(const char* image_filename) {
+    rtw_image(const char* image_filename, bool keep_linear = false) : keep_linear(keep_linear) {
         // Loads image data from the specified file. If the RTW_IMAGES environment variable is
         // defined, looks only in that directory for the image file. If the image was not found,
         // searches for the specified image file first from the current directory, then in the
         // images/ subdirectory, then the _parent's_ images/ subdirectory, and then _that_
         // parent, on so on, for six levels up. If the image was not loaded successfully,
-        // width() and height() will return 0.
+        // width() and height() will return 0. With keep_linear, the floating point pixels are
+        // kept as well as the bytes, for HDR images whose values go past 1 (see linear_pixel).
 
         auto filename = std::string(image_filename);
         auto imagedir = getenv("RTW_IMAGES");
@@ -42,6 +43,10 @@ class rtw_image {
         std::cerr << "ERROR: Could not load image file '" << image_filename << "'.\n";
     }
 
+    // The pixel buffer is owned, so images are shared (see image_cache) rather than copied.
+    rtw_image(const rtw_image&) = delete;
+    rtw_image& operator=(const rtw_image&) = delete;
+
     ~rtw_image() {
         delete[] bdata;
         STBI_FREE(fdata);
@@ -49,22 +54,29 @@ class rtw_image {
 
     bool load(const std::string& filename) {
         // Loads the linear (gamma=1) image data from the given file name. Returns true if the
-        // load succeeded. The resulting data buffer contains the three [0.0, 1.0]
-        // floating-point values for the first pixel (red, then green, then blue). Pixels are
-        // contiguous, going left to right for the width of the image, followed by the next row
-        // below, for the full height of the image.
+        // load succeeded. The resulting data buffer contains the three [0, 255] byte values
+        // for the first pixel (red, then green, then blue). Pixels are contiguous, going left
+        // to right for the width of the image, followed by the next row below, for the full
+        // height of the image.
 
         auto n = bytes_per_pixel; // Dummy out parameter: original components per pixel
-        fdata = stbi_loadf(filename.c_str(), &image_width, &image_height, &n, bytes_per_pixel);
+        auto fdata = stbi_loadf(filename.c_str(), &image_width, &image_height, &n,
+                                  bytes_per_pixel);
         if (fdata == nullptr) return false;
 
+        // Textures only sample the bytes, so unless asked to keep them the floats are dropped
+        // once converted.
         bytes_per_scanline = image_width * bytes_per_pixel;
-        convert_to_bytes();
+        convert_to_bytes(fdata);
+        if (keep_linear)
+            this->fdata = fdata;
+        else
+            STBI_FREE(fdata);
         return true;
     }
 
-    int width()  const { return (fdata == nullptr) ? 0 : image_width; }
-    int height() const { return (fdata == nullptr) ? 0 : image_height; }
+    int width()  const { return (bdata == nullptr) ? 0 : image_width; }
+    int height() const { return (bdata == nullptr) ? 0 : image_height; }
 
     const unsigned char* pixel_data(int x, int y) const {
         // Return the address of the three RGB bytes of the pixel at x,y. If there is no image
@@ -78,10 +90,23 @@ class rtw_image {
         return bdata + y*bytes_per_scanline + x*bytes_per_pixel;
     }
 
+    const float* linear_pixel(int x, int y) const {
+        // Return the address of the three linear RGB floats of the pixel at x,y, unclamped. If
+        // the image wasn't loaded with keep_linear, returns magenta.
+        static float magenta[] = { 1, 0, 1 };
+        if (fdata == nullptr) return magenta;
+
+        x = clamp(x, 0, image_width);
+        y = clamp(y, 0, image_height);
+
+        return fdata + (size_t(y)*image_width + x)*bytes_per_pixel;
+    }
+
   private:
     const int      bytes_per_pixel = 3;
-    float         *fdata = nullptr;         // Linear floating point pixel data
     unsigned char *bdata = nullptr;         // Linear 8-bit pixel data
+    float         *fdata = nullptr;         // Linear floating point pixel data, if kept
+    bool           keep_linear = false;
     int            image_width = 0;         // Loaded image width
     int            image_height = 0;        // Loaded image height
     int            bytes_per_scanline = 0;
@@ -101,7 +126,7 @@ class rtw_image {
         return static_cast<unsigned char>(256.0 * value);
     }
 
-    void convert_to_bytes() {
+    void convert_to_bytes(const float* fdata) {
         // Convert the linear floating point pixel data to bytes, storing the resulting byte
         // data in the `bdata` member.
 
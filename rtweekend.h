@@ -14,15 +14,24 @@
 using std::make_shared;
 using std::shared_ptr;
 
+// Scalar type of the math core and everything built on it. Build with -DFRT_USE_FLOAT for a
+// single-precision renderer; the default double build serves as the reference.
+
+#ifdef FRT_USE_FLOAT
+using real = float;
+#else
+using real = double;
+#endif
+
 // Constants
 
-const double infinity = std::numeric_limits<double>::infinity();
-const double pi = 3.1415926535897932385;
+const real infinity = std::numeric_limits<real>::infinity();
+const real pi = real(3.1415926535897932385);
 
 // Utility Functions
 
-inline double degrees_to_radians(double degrees) {
-    return degrees * pi / 180.0;
+inline real degrees_to_radians(real degrees) {
+    return degrees * pi / 180;
 }
 
 inline double random_double() {
@@ -0,0 +1,1317 @@
+#ifndef SCENE_LOADER_H
+#define SCENE_LOADER_H
+
+#include "arena.h"
+#include "bvh.h"
+#include "camera.h"
+#include "constant_medium.h"
+#include "flat_bvh.h"
+#include "heterogeneous_medium.h"
+#include "hittable.h"
+#include "hittable_list.h"
+#include "image_cache.h"
+#include "light_tree.h"
+#include "material.h"
+#include "quad.h"
+#include "sphere.h"
+#include "texture.h"
+#include "triangle.h"
+#include "triangle_mesh.h"
+#include "voxel_medium.h"
+
+#include <cctype>
+#include <chrono>
+#include <cstdint>
+#include <cstring>
+#include <fstream>
+#include <map>
+#include <omp.h>
+#include <sstream>
+#include <stdexcept>
+#include <string>
+#include <tuple>
+#include <unordered_map>
+#include <vector>
+
+/*
+    Scene files
+
+    A text scene is a list of statements, one per line. Blank lines and everything after a '#'
+    are ignored. Wherever a texture is expected, either a texture name or three numbers (an
+    inline solid color) may be given.
+
+        camera <key> <value> [<key> <value>]...    keys are the public camera settings
+        environment <image path> [<strength>]
+        texture <name> solid <r g b>
+        texture <name> checker <scale> <texture> <texture>
+        texture <name> image <path>
+        texture <name> noise <scale>
+        texture <name> bake <texture> <resolution> <a> <b>
+        material <name> lambertian <texture>
+        material <name> metal <r g b> <fuzz>
+        material <name> dielectric <refraction index>
+        material <name> diffuse_light <texture>
+        material <name> isotropic <texture>
+        sphere <material> <center> <radius>
+        moving_sphere <material> <center1> <center2> <radius>
+        quad <material> <Q> <u> <v>
+        triangle <material> <Q> <u> <v>
+        box <material> <a> <b>
+        mesh <material> <obj path> [<offset>]
+        group <name> [bvh|sbvh]     starts a named group; shapes until `end` are added to it
+        end
+        world bvh|sbvh              wraps the top-level objects in a BVH
+        instance <group> [<transform>]...
+        medium <group> <density> <texture> [<transform>]...
+        volume <material> <texture> <density> <resolution> <a> <b>
+        voxels <material> <grid path> <density>
+
+    A transform is `translate <x y z>`, `scale <x y z>`, `rotate_y <degrees>` or
+    `rotate <axis x y z> <degrees>`, applied in the order given. Transforms after the word
+    `motion` are applied on top of the ones before it to give the placement at time 1, and the
+    instance moves linearly between the two placements over the shutter interval.
+    Groups are not rendered on their own; they are placed with `instance` or used as the
+    boundary of a `medium`, and must be defined before they are referenced. `sbvh` builds the
+    BVH with spatial splits, which suits groups of large or long, thin quads and triangles.
+
+    `bake` samples a procedural texture ahead of time on a grid through the box with corners a
+    and b, `resolution` points along its longest side (see baked_texture). Hits inside the box
+    then look the grid up instead of evaluating the texture.
+
+    A `volume` is a medium filling the box with corners a and b, whose density at each point is
+    `density` times the mean of the texture's color there, sampled on a grid with `resolution`
+    points along the box's longest side (see heterogeneous_medium). Its material scatters
+    light inside it, as an isotropic material does for `medium`.
+
+    `voxels` is a medium whose density is `density` times the values of a sparse voxel grid
+    file (see sparse_voxel_grid), such as smoke exported from a simulation. Its material
+    scatters light as for `volume`.
+
+    Spheres, quads, triangles and meshes placed in the world (not in groups) with a
+    `diffuse_light` material are sampled as lights at every bounce, through a light_tree,
+    unless the material is also used by other shapes. A mesh is one light, whose triangles are
+    chosen by area.
+
+    `environment` lights the scene with an equirectangular HDR image around it, scaled by
+    `strength`, in place of the background color (see environment_light).
+
+    The binary format (see write_scene_binary) stores the same tables as the text format and is
+    meant for large generated scenes that would be slow to parse as text.
+*/
+
+/**
+ * In-memory form of a scene file. The text and binary formats both parse into this, and
+ * build_scene() turns it into a renderable world. Shapes refer to textures, materials and
+ * groups by their index in the corresponding table.
+ */
+struct scene_description {
+    enum class texture_kind : uint8_t { solid, checker, image, noise, bake };
+    enum class material_kind : uint8_t { lambertian, metal, dielectric, diffuse_light, isotropic };
+    enum class shape_kind : uint8_t {
+        sphere, moving_sphere, quad, triangle, box, mesh, instance, medium, volume, voxels
+    };
+    enum class transform_kind : uint8_t { translate, rotate_y, scale, rotate, motion };
+
+    struct texture_desc {
+        texture_kind kind;
+        color   albedo;           // solid
+        double  scale = 1;        // checker, noise, bake resolution
+        int32_t even = -1;        // checker, bake source texture
+        int32_t odd = -1;         // checker
+        std::string path;         // image
+        point3  bounds_min;       // bake
+        point3  bounds_max;       // bake
+    };
+
+    struct material_desc {
+        material_kind kind;
+        int32_t texture = -1;     // lambertian, diffuse_light, isotropic
+        color   albedo;           // metal
+        double  param = 0;        // metal fuzz, dielectric refraction index
+    };
+
+    struct transform_desc {
+        transform_kind kind;
+        vec3 value;               // translate offset, scale factors, rotate_y angle in
+                                  // value[0], or rotate axis scaled by the angle in degrees
+    };
+
+    struct shape_desc {
+        shape_kind kind;
+        int32_t group = 0;        // Group the shape is added to
+        int32_t material = -1;    // Surface shapes
+        int32_t target = -1;      // Instanced or bounding group (instance, medium)
+        int32_t texture = -1;     // Medium albedo, volume density
+        int32_t first_transform = 0;
+        int32_t transform_count = 0;
+        double  param[9] = {};    // Geometry, see param_count()
+        std::string path;         // Mesh or voxel grid file
+    };
+
+    struct group_desc {
+        std::string name;
+        bool bvh = false;
+        bool sbvh = false;        // Build the BVH with spatial splits
+    };
+
+    camera cam;
+    std::string environment;              // Environment map image, if any
+    double environment_strength = 1;
+    std::vector<texture_desc>   textures;
+    std::vector<material_desc>  materials;
+    std::vector<transform_desc> transforms;
+    std::vector<shape_desc>     shapes;
+    std::vector<group_desc>     groups = { group_desc{"world", false} };  // Group 0 is the world
+
+    static int param_count(shape_kind kind) {
+        switch (kind) {
+            case shape_kind::sphere:        return 4;
+            case shape_kind::moving_sphere: return 7;
+            case shape_kind::quad:          return 9;
+            case shape_kind::triangle:      return 9;
+            case shape_kind::box:           return 6;
+            case shape_kind::mesh:          return 3;
+            case shape_kind::instance:      return 0;
+            case shape_kind::medium:        return 1;
+            case shape_kind::volume:        return 8;
+            case shape_kind::voxels:        return 1;
+        }
+        return 0;
+    }
+};
+
+/**
+ * A loaded scene: the world to render and the camera to render it with.
+ */
+struct scene {
+    camera cam;
+    hittable_list world;
+};
+
+
+// Text format
+
+class scene_text_parser {
+  public:
+    scene_text_parser(scene_description& desc, const std::string& source_name)
+      : desc(desc), source_name(source_name) {}
+
+    void parse(std::istream& in) {
+        std::string line;
+        while (std::getline(in, line)) {
+            line_number++;
+
+            auto comment = line.find('#');
+            if (comment != std::string::npos)
+                line.erase(comment);
+
+            std::istringstream tokens(line);
+            std::string keyword;
+            if (!(tokens >> keyword))
+                continue;
+
+            parse_statement(keyword, tokens);
+
+            std::string extra;
+            if (tokens >> extra)
+                fail("unexpected '" + extra + "'");
+        }
+
+        if (current_group != 0)
+            fail("group '" + desc.groups[current_group].name + "' is missing its 'end'");
+    }
+
+  private:
+    scene_description& desc;
+    std::string source_name;
+    int line_number = 0;
+    int32_t current_group = 0;
+
+    std::unordered_map<std::string, int32_t> texture_names;
+    std::unordered_map<std::string, int32_t> material_names;
+    std::unordered_map<std::string, int32_t> group_names;
+    std::map<std::tuple<double,double,double>, int32_t> solid_textures;  // Inline color dedup
+    std::unordered_map<std::string, int32_t> image_textures;             // Image path dedup
+
+    using shape_kind = scene_description::shape_kind;
+    using texture_kind = scene_description::texture_kind;
+    using material_kind = scene_description::material_kind;
+    using transform_kind = scene_description::transform_kind;
+
+    [[noreturn]] void fail(const std::string& message) const {
+        throw std::runtime_error(source_name + ":" + std::to_string(line_number) + ": " + message);
+    }
+
+    std::string read_word(std::istream& tokens, const char* what) const {
+        std::string word;
+        if (!(tokens >> word))
+            fail(std::string("expected ") + what);
+        return word;
+    }
+
+    double read_number(std::istream& tokens) const {
+        double value;
+        if (!(tokens >> value))
+            fail("expected a number");
+        return value;
+    }
+
+    int read_int(std::istream& tokens) const {
+        auto value = read_number(tokens);
+        if (value != std::floor(value))
+            fail("expected an integer");
+        return int(value);
+    }
+
+    vec3 read_vec3(std::istream& tokens) const {
+        auto x = read_number(tokens);
+        auto y = read_number(tokens);
+        auto z = read_number(tokens);
+        return vec3(x, y, z);
+    }
+
+    static bool next_is_number(std::istream& tokens) {
+        tokens >> std::ws;
+        auto c = tokens.peek();
+        return std::isdigit(c) || c == '-' || c == '+' || c == '.';
+    }
+
+    static int32_t lookup(const std::unordered_map<std::string, int32_t>& names,
+                          const std::string& name) {
+        auto it = names.find(name);
+        return it == names.end() ? -1 : it->second;
+    }
+
+    int32_t add_texture(const scene_description::texture_desc& tex) {
+        // Identical inline colors and repeated image paths share one texture.
+        if (tex.kind == texture_kind::solid) {
+            auto key = std::make_tuple(tex.albedo.x(), tex.albedo.y(), tex.albedo.z());
+            auto it = solid_textures.find(key);
+            if (it != solid_textures.end()) return it->second;
+            solid_textures[key] = int32_t(desc.textures.size());
+        } else if (tex.kind == texture_kind::image) {
+            auto it = image_textures.find(tex.path);
+            if (it != image_textures.end()) return it->second;
+            image_textures[tex.path] = int32_t(desc.textures.size());
+        }
+
+        desc.textures.push_back(tex);
+        return int32_t(desc.textures.size() - 1);
+    }
+
+    int32_t read_texture_ref(std::istream& tokens) {
+        if (next_is_number(tokens)) {
+            scene_description::texture_desc tex{texture_kind::solid};
+            tex.albedo = read_vec3(tokens);
+            return add_texture(tex);
+        }
+
+        auto name = read_word(tokens, "a texture name or color");
+        auto index = lookup(texture_names, name);
+        if (index < 0) fail("unknown texture '" + name + "'");
+        return index;
+    }
+
+    int32_t read_material_ref(std::istream& tokens) const {
+        auto name = read_word(tokens, "a material name");
+        auto index = lookup(material_names, name);
+        if (index < 0) fail("unknown material '" + name + "'");
+        return index;
+    }
+
+    int32_t read_group_ref(std::istream& tokens) const {
+        auto name = read_word(tokens, "a group name");
+        auto index = lookup(group_names, name);
+        if (index < 0) fail("unknown group '" + name + "'");
+        if (index == current_group) fail("group '" + name + "' cannot contain itself");
+        return index;
+    }
+
+    void read_transforms(std::istream& tokens, scene_description::shape_desc& shape) {
+        shape.first_transform = int32_t(desc.transforms.size());
+
+        std::string op;
+        bool motion = false;
+        while (tokens >> op) {
+            scene_description::transform_desc xform;
+            if (op == "translate") {
+                xform.kind = transform_kind::translate;
+                xform.value = read_vec3(tokens);
+            } else if (op == "scale") {
+                xform.kind = transform_kind::scale;
+                xform.value = read_vec3(tokens);
+            } else if (op == "rotate_y") {
+                xform.kind = transform_kind::rotate_y;
+                xform.value = vec3(read_number(tokens), 0, 0);
+            } else if (op == "rotate") {
+                xform.kind = transform_kind::rotate;
+                auto axis = read_vec3(tokens);
+                if (axis.near_zero()) fail("rotation axis has zero length");
+                xform.value = unit_vector(axis) * read_number(tokens);
+            } else if (op == "motion") {
+                if (motion) fail("'motion' given twice");
+                motion = true;
+                xform.kind = transform_kind::motion;
+            } else {
+                fail("unknown transform '" + op + "'");
+            }
+            desc.transforms.push_back(xform);
+        }
+
+        shape.transform_count = int32_t(desc.transforms.size()) - shape.first_transform;
+    }
+
+    void parse_statement(const std::string& keyword, std::istream& tokens) {
+        if (keyword == "camera")
+            parse_camera(tokens);
+        else if (keyword == "environment") {
+            desc.environment = read_word(tokens, "an image path");
+            if (next_is_number(tokens))
+                desc.environment_strength = read_number(tokens);
+        }
+        else if (keyword == "texture")
+            parse_texture(tokens);
+        else if (keyword == "material")
+            parse_material(tokens);
+        else if (keyword == "group")
+            parse_group(tokens);
+        else if (keyword == "end") {
+            if (current_group == 0) fail("'end' without 'group'");
+            current_group = 0;
+        } else if (keyword == "world") {
+            parse_bvh_flag(read_word(tokens, "'bvh' or 'sbvh'"), desc.groups[0]);
+        } else
+            parse_shape(keyword, tokens);
+    }
+
+    void parse_camera(std::istream& tokens) {
+        auto& cam = desc.cam;
+        std::string key;
+        bool any = false;
+
+        while (tokens >> key) {
+            any = true;
+            if      (key == "aspect_ratio")      cam.aspect_ratio = read_number(tokens);
+            else if (key == "image_width")       cam.image_width = read_int(tokens);
+            else if (key == "samples_per_pixel") cam.samples_per_pixel = read_int(tokens);
+            else if (key == "max_depth")         cam.max_depth = read_int(tokens);
+            else if (key == "background")        cam.background = read_vec3(tokens);
+            else if (key == "vfov")              cam.vfov = read_number(tokens);
+            else if (key == "lookfrom")          cam.lookfrom = read_vec3(tokens);
+            else if (key == "lookat")            cam.lookat = read_vec3(tokens);
+            else if (key == "vup")               cam.vup = read_vec3(tokens);
+            else if (key == "defocus_angle")     cam.defocus_angle = read_number(tokens);
+            else if (key == "focus_dist")        cam.focus_dist = read_number(tokens);
+            else if (key == "path_guiding")      cam.path_guiding = read_int(tokens) != 0;
+            else if (key == "bidirectional")     cam.bidirectional = read_int(tokens) != 0;
+            else fail("unknown camera setting '" + key + "'");
+        }
+
+        if (!any) fail("expected a camera setting");
+    }
+
+    void parse_texture(std::istream& tokens) {
+        auto name = read_word(tokens, "a texture name");
+        auto kind = read_word(tokens, "a texture kind");
+
+        scene_description::texture_desc tex{texture_kind::solid};
+        if (kind == "solid") {
+            tex.albedo = read_vec3(tokens);
+        } else if (kind == "checker") {
+            tex.kind = texture_kind::checker;
+            tex.scale = read_number(tokens);
+            tex.even = read_texture_ref(tokens);
+            tex.odd = read_texture_ref(tokens);
+        } else if (kind == "image") {
+            tex.kind = texture_kind::image;
+            tex.path = read_word(tokens, "an image path");
+        } else if (kind == "noise") {
+            tex.kind = texture_kind::noise;
+            tex.scale = read_number(tokens);
+        } else if (kind == "bake") {
+            tex.kind = texture_kind::bake;
+            tex.even = read_texture_ref(tokens);
+            tex.scale = read_int(tokens);
+            if (tex.scale < 2) fail("bake resolution must be at least 2");
+            tex.bounds_min = read_vec3(tokens);
+            tex.bounds_max = read_vec3(tokens);
+        } else {
+            fail("unknown texture kind '" + kind + "'");
+        }
+
+        texture_names[name] = add_texture(tex);
+    }
+
+    void parse_material(std::istream& tokens) {
+        auto name = read_word(tokens, "a material name");
+        auto kind = read_word(tokens, "a material kind");
+
+        scene_description::material_desc mat{material_kind::lambertian};
+        if (kind == "lambertian") {
+            mat.texture = read_texture_ref(tokens);
+        } else if (kind == "metal") {
+            mat.kind = material_kind::metal;
+            mat.albedo = read_vec3(tokens);
+            mat.param = read_number(tokens);
+        } else if (kind == "dielectric") {
+            mat.kind = material_kind::dielectric;
+            mat.param = read_number(tokens);
+        } else if (kind == "diffuse_light") {
+            mat.kind = material_kind::diffuse_light;
+            mat.texture = read_texture_ref(tokens);
+        } else if (kind == "isotropic") {
+            mat.kind = material_kind::isotropic;
+            mat.texture = read_texture_ref(tokens);
+        } else {
+            fail("unknown material kind '" + kind + "'");
+        }
+
+        material_names[name] = int32_t(desc.materials.size());
+        desc.materials.push_back(mat);
+    }
+
+    void parse_bvh_flag(const std::string& flag, scene_description::group_desc& group) {
+        if (flag != "bvh" && flag != "sbvh") fail("unexpected '" + flag + "'");
+        group.bvh = true;
+        group.sbvh = flag == "sbvh";
+    }
+
+    void parse_group(std::istream& tokens) {
+        if (current_group != 0) fail("groups cannot be nested");
+
+        scene_description::group_desc group;
+        group.name = read_word(tokens, "a group name");
+        if (group_names.count(group.name)) fail("group '" + group.name + "' is already defined");
+
+        std::string flag;
+        if (tokens >> flag)
+            parse_bvh_flag(flag, group);
+
+        current_group = int32_t(desc.groups.size());
+        group_names[group.name] = current_group;
+        desc.groups.push_back(group);
+    }
+
+    void parse_shape(const std::string& keyword, std::istream& tokens) {
+        scene_description::shape_desc shape;
+        shape.group = current_group;
+
+        if      (keyword == "sphere")        shape.kind = shape_kind::sphere;
+        else if (keyword == "moving_sphere") shape.kind = shape_kind::moving_sphere;
+        else if (keyword == "quad")          shape.kind = shape_kind::quad;
+        else if (keyword == "triangle")      shape.kind = shape_kind::triangle;
+        else if (keyword == "box")           shape.kind = shape_kind::box;
+        else if (keyword == "mesh")          shape.kind = shape_kind::mesh;
+        else if (keyword == "instance")      shape.kind = shape_kind::instance;
+        else if (keyword == "medium")        shape.kind = shape_kind::medium;
+        else if (keyword == "volume")        shape.kind = shape_kind::volume;
+        else if (keyword == "voxels")        shape.kind = shape_kind::voxels;
+        else fail("unknown statement '" + keyword + "'");
+
+        switch (shape.kind) {
+            case shape_kind::instance:
+                shape.target = read_group_ref(tokens);
+                read_transforms(tokens, shape);
+                break;
+
+            case shape_kind::medium:
+                shape.target = read_group_ref(tokens);
+                shape.param[0] = read_number(tokens);
+                shape.texture = read_texture_ref(tokens);
+                read_transforms(tokens, shape);
+                break;
+
+            case shape_kind::volume:
+                shape.material = read_material_ref(tokens);
+                shape.texture = read_texture_ref(tokens);
+                for (int i = 0; i < scene_description::param_count(shape.kind); i++)
+                    shape.param[i] = read_number(tokens);
+                if (shape.param[1] < 2) fail("volume resolution must be at least 2");
+                break;
+
+            case shape_kind::voxels:
+                shape.material = read_material_ref(tokens);
+                shape.path = read_word(tokens, "a voxel grid path");
+                shape.param[0] = read_number(tokens);
+                break;
+
+            case shape_kind::mesh:
+                shape.material = read_material_ref(tokens);
+                shape.path = read_word(tokens, "a mesh path");
+                if (next_is_number(tokens)) {
+                    auto offset = read_vec3(tokens);
+                    for (int i = 0; i < 3; i++) shape.param[i] = offset[i];
+                }
+                break;
+
+            default:
+                shape.material = read_material_ref(tokens);
+                for (int i = 0; i < scene_description::param_count(shape.kind); i++)
+                    shape.param[i] = read_number(tokens);
+                break;
+        }
+
+        desc.shapes.push_back(std::move(shape));
+    }
+};
+
+inline scene_description parse_scene_text(std::istream& in, const std::string& source_name) {
+    scene_description desc;
+    scene_text_parser(desc, source_name).parse(in);
+    return desc;
+}
+
+
+// Binary format
+
+/*
+    All values are little-endian; doubles are IEEE-754 binary64. Layout:
+
+        char[4] magic "FRTB", uint32 version
+        camera settings, then the environment map's path and strength, then uint8 path
+        guiding and uint8 bidirectional
+        uint32 count, then that many textures, materials, transforms, groups and shapes, in
+        that order, each record starting with its uint8 kind
+        strings are a uint32 length followed by the bytes
+
+    Shapes only store the parameters their kind uses, so a sphere is 42 bytes.
+*/
+
+class scene_binary_io {
+  public:
+    static constexpr char     magic[4] = { 'F', 'R', 'T', 'B' };
+    static constexpr uint32_t version  = 6;  // 2 added baked textures and volumes, 3 voxel
+                                             // grids, 4 environment maps, 5 path guiding,
+                                             // 6 bidirectional; older versions are still read
+
+    static bool is_binary(const std::string& filename) {
+        std::ifstream in(filename, std::ios::binary);
+        char header[4] = {};
+        in.read(header, 4);
+        return in && std::memcmp(header, magic, 4) == 0;
+    }
+
+    static void write(const scene_description& desc, std::ostream& out) {
+        out.write(magic, 4);
+        put<uint32_t>(out, version);
+
+        const auto& cam = desc.cam;
+        put<double>(out, cam.aspect_ratio);
+        put<int32_t>(out, cam.image_width);
+        put<int32_t>(out, cam.samples_per_pixel);
+        put<int32_t>(out, cam.max_depth);
+        put_vec3(out, cam.background);
+        put<double>(out, cam.vfov);
+        put_vec3(out, cam.lookfrom);
+        put_vec3(out, cam.lookat);
+        put_vec3(out, cam.vup);
+        put<double>(out, cam.defocus_angle);
+        put<double>(out, cam.focus_dist);
+        put_string(out, desc.environment);
+        put<double>(out, desc.environment_strength);
+        put<uint8_t>(out, cam.path_guiding);
+        put<uint8_t>(out, cam.bidirectional);
+
+        put<uint32_t>(out, uint32_t(desc.textures.size()));
+        for (const auto& tex : desc.textures) {
+            put<uint8_t>(out, uint8_t(tex.kind));
+            put_vec3(out, tex.albedo);
+            put<double>(out, tex.scale);
+            put<int32_t>(out, tex.even);
+            put<int32_t>(out, tex.odd);
+            put_string(out, tex.path);
+            put_vec3(out, tex.bounds_min);
+            put_vec3(out, tex.bounds_max);
+        }
+
+        put<uint32_t>(out, uint32_t(desc.materials.size()));
+        for (const auto& mat : desc.materials) {
+            put<uint8_t>(out, uint8_t(mat.kind));
+            put<int32_t>(out, mat.texture);
+            put_vec3(out, mat.albedo);
+            put<double>(out, mat.param);
+        }
+
+        put<uint32_t>(out, uint32_t(desc.transforms.size()));
+        for (const auto& xform : desc.transforms) {
+            put<uint8_t>(out, uint8_t(xform.kind));
+            put_vec3(out, xform.value);
+        }
+
+        put<uint32_t>(out, uint32_t(desc.groups.size()));
+        for (const auto& group : desc.groups) {
+            put<uint8_t>(out, group.sbvh ? 2 : group.bvh ? 1 : 0);
+            put_string(out, group.name);
+        }
+
+        put<uint32_t>(out, uint32_t(desc.shapes.size()));
+        for (const auto& shape : desc.shapes) {
+            put<uint8_t>(out, uint8_t(shape.kind));
+            put<int32_t>(out, shape.group);
+
+            switch (shape.kind) {
+                case scene_description::shape_kind::instance:
+                case scene_description::shape_kind::medium:
+                    put<int32_t>(out, shape.target);
+                    put<int32_t>(out, shape.texture);
+                    put<int32_t>(out, shape.first_transform);
+                    put<int32_t>(out, shape.transform_count);
+                    break;
+                case scene_description::shape_kind::mesh:
+                case scene_description::shape_kind::voxels:
+                    put<int32_t>(out, shape.material);
+                    put_string(out, shape.path);
+                    break;
+                case scene_description::shape_kind::volume:
+                    put<int32_t>(out, shape.material);
+                    put<int32_t>(out, shape.texture);
+                    break;
+                default:
+                    put<int32_t>(out, shape.material);
+                    break;
+            }
+
+            auto count = scene_description::param_count(shape.kind);
+            out.write(reinterpret_cast<const char*>(shape.param), count * sizeof(double));
+        }
+    }
+
+    static scene_description read(std::istream& in, const std::string& source_name) {
+        scene_description desc;
+        reader r{in, source_name};
+        auto start = in.tellg();
+        if (start >= 0 && in.seekg(0, std::ios::end)) {
+            r.end = in.tellg();
+            in.seekg(start);
+        }
+        in.clear();
+
+        char header[4];
+        r.bytes(header, 4);
+        if (std::memcmp(header, magic, 4) != 0)
+            r.fail("not a binary scene file");
+        auto file_version = r.get<uint32_t>();
+        if (file_version < 1 || file_version > version)
+            r.fail("unsupported binary scene version");
+
+        auto& cam = desc.cam;
+        cam.aspect_ratio      = r.get<double>();
+        cam.image_width       = r.get<int32_t>();
+        cam.samples_per_pixel = r.get<int32_t>();
+        cam.max_depth         = r.get<int32_t>();
+        cam.background        = r.get_vec3();
+        cam.vfov              = r.get<double>();
+        cam.lookfrom          = r.get_vec3();
+        cam.lookat            = r.get_vec3();
+        cam.vup               = r.get_vec3();
+        cam.defocus_angle     = r.get<double>();
+        cam.focus_dist        = r.get<double>();
+        if (file_version >= 4) {
+            desc.environment          = r.get_string();
+            desc.environment_strength = r.get<double>();
+        }
+        if (file_version >= 5)
+            cam.path_guiding = r.get<uint8_t>() != 0;
+        if (file_version >= 6)
+            cam.bidirectional = r.get<uint8_t>() != 0;
+
+        desc.textures.resize(r.get_count(45));  // Smallest record of each table, in bytes
+        for (size_t i = 0; i < desc.textures.size(); i++) {
+            auto& tex = desc.textures[i];
+            tex.kind   = r.get_kind(scene_description::texture_kind::bake, "texture");
+            tex.albedo = r.get_vec3();
+            tex.scale  = r.get<double>();
+            tex.even   = r.get<int32_t>();
+            tex.odd    = r.get<int32_t>();
+            tex.path   = r.get_string();
+            if (file_version >= 2) {
+                tex.bounds_min = r.get_vec3();
+                tex.bounds_max = r.get_vec3();
+            }
+            if (tex.kind == scene_description::texture_kind::checker) {
+                // Checkers may only refer to earlier textures.
+                r.check_index(tex.even, i, "texture");
+                r.check_index(tex.odd, i, "texture");
+            } else if (tex.kind == scene_description::texture_kind::bake) {
+                r.check_index(tex.even, i, "texture");
+                if (tex.scale < 2)
+                    r.fail("bake resolution must be at least 2");
+            }
+        }
+
+        desc.materials.resize(r.get_count(37));
+        for (auto& mat : desc.materials) {
+            mat.kind    = r.get_kind(scene_description::material_kind::isotropic, "material");
+            mat.texture = r.get<int32_t>();
+            mat.albedo  = r.get_vec3();
+            mat.param   = r.get<double>();
+            // Metals and dielectrics have no texture; every other material needs one.
+            auto textured = mat.kind == scene_description::material_kind::lambertian
+                         || mat.kind == scene_description::material_kind::diffuse_light
+                         || mat.kind == scene_description::material_kind::isotropic;
+            if (textured && mat.texture < 0)
+                r.fail("material requires a texture");
+            if (mat.texture >= 0)
+                r.check_index(mat.texture, desc.textures.size(), "texture");
+        }
+
+        desc.transforms.resize(r.get_count(25));
+        for (auto& xform : desc.transforms) {
+            xform.kind  = r.get_kind(scene_description::transform_kind::motion, "transform");
+            xform.value = r.get_vec3();
+        }
+
+        desc.groups.resize(r.get_count(5));
+        if (desc.groups.empty())
+            r.fail("missing world group");
+        for (auto& group : desc.groups) {
+            auto flag  = r.get<uint8_t>();
+            if (flag > 2)
+                r.fail("unknown group flag");
+            group.bvh  = flag != 0;
+            group.sbvh = flag == 2;
+            group.name = r.get_string();
+        }
+
+        desc.shapes.resize(r.get_count(9));
+        for (auto& shape : desc.shapes) {
+            shape.kind  = r.get_kind(scene_description::shape_kind::voxels, "shape");
+            shape.group = r.get<int32_t>();
+            r.check_index(shape.group, desc.groups.size(), "group");
+
+            switch (shape.kind) {
+                case scene_description::shape_kind::instance:
+                case scene_description::shape_kind::medium:
+                    shape.target          = r.get<int32_t>();
+                    shape.texture         = r.get<int32_t>();
+                    shape.first_transform = r.get<int32_t>();
+                    shape.transform_count = r.get<int32_t>();
+                    // Groups may only reference earlier groups, which rules out cycles. The world
+                    // may reference any group.
+                    r.check_index(shape.target,
+                                  shape.group == 0 ? desc.groups.size() : size_t(shape.group),
+                                  "group");
+                    if (shape.target == 0)
+                        r.fail("the world cannot be instanced");
+                    if (shape.kind == scene_description::shape_kind::medium)
+                        r.check_index(shape.texture, desc.textures.size(), "texture");
+                    if (shape.first_transform < 0 || shape.transform_count < 0 ||
+                        size_t(shape.first_transform) + shape.transform_count
+                            > desc.transforms.size())
+                        r.fail("transform range out of bounds");
+                    break;
+                case scene_description::shape_kind::mesh:
+                case scene_description::shape_kind::voxels:
+                    shape.material = r.get<int32_t>();
+                    shape.path     = r.get_string();
+                    r.check_index(shape.material, desc.materials.size(), "material");
+                    break;
+                case scene_description::shape_kind::volume:
+                    shape.material = r.get<int32_t>();
+                    shape.texture  = r.get<int32_t>();
+                    r.check_index(shape.material, desc.materials.size(), "material");
+                    r.check_index(shape.texture, desc.textures.size(), "texture");
+                    break;
+                default:
+                    shape.material = r.get<int32_t>();
+                    r.check_index(shape.material, desc.materials.size(), "material");
+                    break;
+            }
+
+            auto count = scene_description::param_count(shape.kind);
+            r.bytes(reinterpret_cast<char*>(shape.param), count * sizeof(double));
+            if (shape.kind == scene_description::shape_kind::volume && shape.param[1] < 2)
+                r.fail("volume resolution must be at least 2");
+        }
+
+        return desc;
+    }
+
+  private:
+    template <typename T>
+    static void put(std::ostream& out, T value) {
+        out.write(reinterpret_cast<const char*>(&value), sizeof(T));
+    }
+
+    static void put_vec3(std::ostream& out, const vec3& v) {
+        put<double>(out, v.x());
+        put<double>(out, v.y());
+        put<double>(out, v.z());
+    }
+
+    static void put_string(std::ostream& out, const std::string& s) {
+        put<uint32_t>(out, uint32_t(s.size()));
+        out.write(s.data(), s.size());
+    }
+
+    struct reader {
+        std::istream& in;
+        const std::string& source_name;
+        std::streamoff end = -1;  // Size of the stream, if it can be found
+
+        [[noreturn]] void fail(const std::string& message) const {
+            throw std::runtime_error(source_name + ": " + message);
+        }
+
+        void bytes(char* dest, size_t count) {
+            if (!in.read(dest, count))
+                fail("unexpected end of file");
+        }
+
+        template <typename T>
+        T get() {
+            T value;
+            bytes(reinterpret_cast<char*>(&value), sizeof(T));
+            return value;
+        }
+
+        vec3 get_vec3() {
+            auto x = get<double>();
+            auto y = get<double>();
+            auto z = get<double>();
+            return vec3(x, y, z);
+        }
+
+        std::string get_string() {
+            std::string s(get_count(1), '\0');
+            bytes(s.data(), s.size());
+            return s;
+        }
+
+        size_t get_count(size_t record_bytes) {
+            // Reads a table or string length, which cannot exceed what the rest of the file
+            // holds given that each entry takes at least record_bytes.
+            auto count = get<uint32_t>();
+            auto at = in.tellg();
+            if (at >= 0 && end >= 0 && count > uint64_t(end - at) / record_bytes)
+                fail("count exceeds the file's size");
+            return count;
+        }
+
+        template <typename Kind>
+        Kind get_kind(Kind last, const char* what) {
+            auto kind = get<uint8_t>();
+            if (kind > uint8_t(last))
+                fail(std::string("unknown ") + what + " kind");
+            return Kind(kind);
+        }
+
+        void check_index(int32_t index, size_t count, const char* what) const {
+            if (index < 0 || size_t(index) >= count)
+                fail(std::string(what) + " index out of range");
+        }
+    };
+};
+
+inline void write_scene_binary(const scene_description& desc, const std::string& filename) {
+    std::ofstream out(filename, std::ios::binary);
+    if (!out)
+        throw std::runtime_error("Error: Cannot write file " + filename);
+    scene_binary_io::write(desc, out);
+
+    // A full disk or a write error leaves a short file, which would only fail when read.
+    out.close();
+    if (!out)
+        throw std::runtime_error("Error: Failed writing file " + filename);
+}
+
+inline scene_description load_scene_description(const std::string& filename) {
+    // Loads a text or binary scene file, telling the two apart by the binary magic number.
+
+    if (scene_binary_io::is_binary(filename)) {
+        std::ifstream in(filename, std::ios::binary);
+        return scene_binary_io::read(in, filename);
+    }
+
+    std::ifstream in(filename);
+    if (!in)
+        throw std::runtime_error("Error: Cannot open file " + filename);
+    return parse_scene_text(in, filename);
+}
+
+
+// Scene construction
+
+class scene_builder {
+  public:
+    scene_builder(const scene_description& desc) : desc(desc) {}
+
+    scene build() {
+        // Images decode in the background while meshes are parsed.
+        prefetch_images();
+        load_meshes();
+        load_voxel_grids();
+        build_textures();
+        build_materials();
+        build_primitives();
+        build_groups();
+
+        scene result;
+        result.cam = desc.cam;
+        result.cam.lights = collect_lights();
+        if (!desc.environment.empty()) {
+            result.cam.environment =
+                make_shared<environment_light>(desc.environment, desc.environment_strength);
+        }
+        result.world = hittable_list(group_objects[0]);
+        return result;
+    }
+
+  private:
+    using shape_kind = scene_description::shape_kind;
+    using texture_kind = scene_description::texture_kind;
+    using material_kind = scene_description::material_kind;
+
+    const scene_description& desc;
+    shared_ptr<arena> memory = make_shared<arena>();  // Holds every object of the scene
+    std::vector<shared_ptr<texture>>   textures;
+    std::vector<shared_ptr<material>>  materials;
+    std::unordered_map<std::string, shared_ptr<const mesh_data>> meshes;
+    std::unordered_map<std::string, shared_ptr<const sparse_voxel_grid>> voxel_grids;
+    std::vector<shared_ptr<hittable>>  primitives;     // One per shape, null for instances/media
+    std::vector<shared_ptr<hittable>>  group_objects;  // Finished group hittables
+
+    void prefetch_images() {
+        for (const auto& tex : desc.textures) {
+            if (tex.kind == texture_kind::image)
+                image_cache::prefetch(tex.path);
+        }
+    }
+
+    void build_textures() {
+        // Textures refer only to earlier textures, so build them in order. Image textures with
+        // the same path are shared, as are their decoded images across scenes.
+
+        std::unordered_map<std::string, shared_ptr<texture>> images;
+        textures.reserve(desc.textures.size());
+
+        for (const auto& tex : desc.textures) {
+            switch (tex.kind) {
+                case texture_kind::solid:
+                    textures.push_back(arena_make<solid_color>(memory, tex.albedo));
+                    break;
+                case texture_kind::checker:
+                    textures.push_back(arena_make<checker_texture>(
+                        memory, tex.scale, textures.at(tex.even), textures.at(tex.odd)));
+                    break;
+                case texture_kind::image: {
+                    auto& image = images[tex.path];
+                    if (!image) image = arena_make<image_texture>(memory, tex.path.c_str());
+                    textures.push_back(image);
+                    break;
+                }
+                case texture_kind::noise:
+                    textures.push_back(arena_make<noise_texture>(memory, tex.scale));
+                    break;
+                case texture_kind::bake:
+                    textures.push_back(arena_make<baked_texture>(
+                        memory, textures.at(tex.even), aabb(tex.bounds_min, tex.bounds_max),
+                        int(tex.scale)));
+                    break;
+            }
+        }
+    }
+
+    void build_materials() {
+        materials.reserve(desc.materials.size());
+
+        for (const auto& mat : desc.materials) {
+            switch (mat.kind) {
+                case material_kind::lambertian:
+                    materials.push_back(
+                        arena_make<lambertian>(memory, textures.at(mat.texture)));
+                    break;
+                case material_kind::metal:
+                    materials.push_back(arena_make<metal>(memory, mat.albedo, mat.param));
+                    break;
+                case material_kind::dielectric:
+                    materials.push_back(arena_make<dielectric>(memory, mat.param));
+                    break;
+                case material_kind::diffuse_light:
+                    materials.push_back(
+                        arena_make<diffuse_light>(memory, textures.at(mat.texture)));
+                    break;
+                case material_kind::isotropic:
+                    materials.push_back(
+                        arena_make<isotropic>(memory, textures.at(mat.texture)));
+                    break;
+            }
+        }
+    }
+
+    void load_meshes() {
+        // Each OBJ file is parsed once, however many meshes use it.
+
+        std::vector<std::string> paths;
+        for (const auto& shape : desc.shapes) {
+            if (shape.kind == shape_kind::mesh && !meshes.count(shape.path)) {
+                meshes[shape.path] = nullptr;
+                paths.push_back(shape.path);
+            }
+        }
+
+        std::vector<shared_ptr<const mesh_data>> loaded(paths.size());
+
+        #pragma omp parallel for schedule(dynamic, 1)
+        for (size_t i = 0; i < paths.size(); i++)
+            loaded[i] = mesh_data::load_obj(paths[i]);
+
+        for (size_t i = 0; i < paths.size(); i++)
+            meshes[paths[i]] = loaded[i];
+    }
+
+    void load_voxel_grids() {
+        // Each grid file is read once, however many shapes use it.
+        for (const auto& shape : desc.shapes) {
+            if (shape.kind == shape_kind::voxels && !voxel_grids.count(shape.path)) {
+                voxel_grids[shape.path] = make_shared<sparse_voxel_grid>(
+                    sparse_voxel_grid::load(shape.path));
+            }
+        }
+    }
+
+    void build_primitives() {
+        // Primitives don't depend on each other, so they (and the per-mesh BVHs) are built in
+        // parallel.
+
+        primitives.resize(desc.shapes.size());
+
+        #pragma omp parallel for schedule(dynamic, 64)
+        for (size_t i = 0; i < desc.shapes.size(); i++)
+            primitives[i] = make_primitive(desc.shapes[i]);
+    }
+
+    shared_ptr<hittable> make_primitive(const scene_description::shape_desc& shape) const {
+        const double* p = shape.param;
+
+        switch (shape.kind) {
+            case shape_kind::sphere:
+                return arena_make<sphere>(memory, point3(p[0], p[1], p[2]), p[3],
+                                          materials.at(shape.material));
+            case shape_kind::moving_sphere:
+                return arena_make<sphere>(memory, point3(p[0], p[1], p[2]),
+                                          point3(p[3], p[4], p[5]), p[6],
+                                          materials.at(shape.material));
+            case shape_kind::quad:
+                return arena_make<quad>(memory, point3(p[0], p[1], p[2]), vec3(p[3], p[4], p[5]),
+                                        vec3(p[6], p[7], p[8]), materials.at(shape.material));
+            case shape_kind::triangle:
+                return arena_make<triangle>(memory, point3(p[0], p[1], p[2]),
+                                            vec3(p[3], p[4], p[5]), vec3(p[6], p[7], p[8]),
+                                            materials.at(shape.material));
+            case shape_kind::box:
+                return box(point3(p[0], p[1], p[2]), point3(p[3], p[4], p[5]),
+                           materials.at(shape.material), memory);
+            case shape_kind::mesh:
+                return arena_make<triangle_mesh>(memory, meshes.at(shape.path),
+                                                 materials.at(shape.material),
+                                                 point3(p[0], p[1], p[2]), memory);
+            case shape_kind::volume: {
+                // The density is the density texture's mean component, sampled onto a grid.
+                auto density = textures.at(shape.texture);
+                auto grid = make_shared<density_grid>(
+                    aabb(point3(p[2], p[3], p[4]), point3(p[5], p[6], p[7])), int(p[1]),
+                    [&](const point3& q) {
+                        auto c = density->value(0, 0, q);
+                        return (c.x() + c.y() + c.z()) / 3;
+                    });
+                return arena_make<heterogeneous_medium>(memory, grid, p[0],
+                                                        materials.at(shape.material));
+            }
+            case shape_kind::voxels:
+                return arena_make<voxel_medium>(memory, voxel_grids.at(shape.path), p[0],
+                                                materials.at(shape.material));
+            default:
+                return nullptr;  // Instances and media wrap groups, built in build_groups()
+        }
+    }
+
+    shared_ptr<light_tree> collect_lights() const {
+        // Returns a light tree over the emitting spheres, quads, triangles and meshes of the
+        // world, or null if there are none. A material's emitters are only sampled if all of
+        // them can be, since the renderer leaves sampled emitters to the tree (see
+        // light_tree::covers); emitters in groups, boxes or moving spheres aren't.
+
+        std::vector<bool> sampleable(materials.size(), true);
+        for (const auto& shape : desc.shapes) {
+            if (shape.material < 0 || desc.materials[shape.material].kind
+                                          != material_kind::diffuse_light)
+                continue;
+            auto simple = shape.kind == shape_kind::sphere || shape.kind == shape_kind::quad
+                       || shape.kind == shape_kind::triangle || shape.kind == shape_kind::mesh;
+            if (!simple || shape.group != 0)
+                sampleable[shape.material] = false;
+        }
+
+        std::vector<area_light> found;
+        for (const auto& shape : desc.shapes) {
+            if (shape.material < 0 || desc.materials[shape.material].kind
+                                          != material_kind::diffuse_light
+                || !sampleable[shape.material])
+                continue;
+
+            const double* p = shape.param;
+            auto mat = materials[shape.material].get();
+            if (shape.kind == shape_kind::sphere) {
+                found.push_back(area_light::sphere(point3(p[0], p[1], p[2]), p[3], mat));
+            } else if (shape.kind == shape_kind::quad) {
+                found.push_back(area_light::quad(point3(p[0], p[1], p[2]),
+                                                 vec3(p[3], p[4], p[5]), vec3(p[6], p[7], p[8]),
+                                                 mat));
+            } else if (shape.kind == shape_kind::mesh) {
+                found.push_back(area_light::mesh(meshes.at(shape.path),
+                                                 point3(p[0], p[1], p[2]), mat));
+            } else {
+                found.push_back(area_light::triangle(point3(p[0], p[1], p[2]),
+                                                     vec3(p[3], p[4], p[5]),
+                                                     vec3(p[6], p[7], p[8]), mat));
+            }
+        }
+
+        if (found.empty())
+            return nullptr;
+        return make_shared<light_tree>(found);
+    }
+
+    shared_ptr<hittable> apply_transforms(shared_ptr<hittable> object,
+                                          const scene_description::shape_desc& shape) const {
+        // Folds the shape's transform list into a single instance. Without a `motion` marker
+        // the end transform is the start transform.
+
+        if (shape.transform_count == 0)
+            return object;
+
+        affine start, end;
+        bool motion = false;
+
+        for (int i = 0; i < shape.transform_count; i++) {
+            const auto& xform = desc.transforms.at(shape.first_transform + i);
+            affine step;
+            switch (xform.kind) {
+                case scene_description::transform_kind::translate:
+                    step = affine::translation(xform.value);
+                    break;
+                case scene_description::transform_kind::scale:
+                    step = affine::scaling(xform.value);
+                    break;
+                case scene_description::transform_kind::rotate_y:
+                    step = affine::rotation(vec3(0,1,0), xform.value[0]);
+                    break;
+                case scene_description::transform_kind::rotate:
+                    if (!xform.value.near_zero())
+                        step = affine::rotation(xform.value, xform.value.length());
+                    break;
+                case scene_description::transform_kind::motion:
+                    motion = true;
+                    end = start;
+                    continue;
+            }
+
+            if (motion)
+                end = step * end;
+            else
+                start = step * start;
+        }
+
+        return arena_make<transform_instance>(memory, object, start, motion ? end : start);
+    }
+
+    void build_groups() {
+        // A group can only be finished once every group it instances is finished, so groups
+        // are built in dependency levels. Groups within a level are independent, and their
+        // BVHs are built in parallel.
+
+        auto group_count = desc.groups.size();
+        std::vector<std::vector<size_t>> members(group_count);
+        std::vector<int> level(group_count, 0);
+
+        for (size_t i = 0; i < desc.shapes.size(); i++)
+            members.at(desc.shapes[i].group).push_back(i);
+
+        // Groups only reference groups defined before them, so a single pass in definition
+        // order settles every level. The world is last since it can reference any group.
+        auto group_level = [&](size_t g) {
+            for (auto i : members[g]) {
+                const auto& shape = desc.shapes[i];
+                if (shape.kind == shape_kind::instance || shape.kind == shape_kind::medium)
+                    level[g] = std::max(level[g], level.at(shape.target) + 1);
+            }
+        };
+        for (size_t g = 1; g < group_count; g++) group_level(g);
+        group_level(0);
+
+        int max_level = *std::max_element(level.begin(), level.end());
+        group_objects.assign(group_count, nullptr);
+
+        for (int current = 0; current <= max_level; current++) {
+            std::vector<size_t> batch;
+            for (size_t g = 0; g < group_count; g++)
+                if (level[g] == current) batch.push_back(g);
+
+            // A lone group (typically the world) gets every thread for its own BVH build
+            // instead of one thread of an outer loop.
+            #pragma omp parallel for schedule(dynamic, 1) if(batch.size() > 1)
+            for (size_t b = 0; b < batch.size(); b++)
+                group_objects[batch[b]] = build_group(batch[b], members[batch[b]]);
+        }
+    }
+
+    shared_ptr<hittable> build_group(size_t g, const std::vector<size_t>& shape_indices) const {
+        hittable_list list;
+
+        for (auto i : shape_indices) {
+            const auto& shape = desc.shapes[i];
+
+            if (shape.kind == shape_kind::instance) {
+                list.add(apply_transforms(group_objects.at(shape.target), shape));
+            } else if (shape.kind == shape_kind::medium) {
+                auto boundary = apply_transforms(group_objects.at(shape.target), shape);
+                list.add(arena_make<constant_medium>(
+                    memory, boundary, shape.param[0], textures.at(shape.texture)));
+            } else {
+                list.add(primitives[i]);
+            }
+        }
+
+        if (desc.groups[g].bvh && !list.objects.empty()) {
+            // Groups hold loaded primitives that are never changed in place, so their copies
+            // can't go stale.
+            bvh_build_options options;
+            options.spatial_splits = desc.groups[g].sbvh;
+            options.typed_leaves = true;
+            return arena_make<flat_bvh>(memory, list, options);
+        }
+
+        // Unwrap single-object groups to save a level of indirection.
+        if (list.objects.size() == 1)
+            return list.objects[0];
+
+        return arena_make<hittable_list>(memory, list);
+    }
+};
+
+inline scene build_scene(const scene_description& desc) {
+    return scene_builder(desc).build();
+}
+
+inline scene load_scene(const std::string& filename) {
+    // Loads a text or binary scene file and builds its world, reporting the time taken.
+
+    auto start = std::chrono::high_resolution_clock::now();
+
+    auto desc = load_scene_description(filename);
+    auto parsed = std::chrono::high_resolution_clock::now();
+
+    auto result = build_scene(desc);
+    auto built = std::chrono::high_resolution_clock::now();
+
+    std::chrono::duration<double> parse_time = parsed - start;
+    std::chrono::duration<double> build_time = built - parsed;
+    std::clog << "Loaded " << filename << " (" << desc.shapes.size() << " shapes): parsed in "
+              << parse_time.count() << " s, built in " << build_time.count() << " s on "
+              << omp_get_max_threads() << " threads\n";
+
+    return result;
+}
+
+#endif
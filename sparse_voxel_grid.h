@@ -0,0 +1,338 @@
+#ifndef SPARSE_VOXEL_GRID_H
+#define SPARSE_VOXEL_GRID_H
+
+#include "aabb.h"
+
+#include <algorithm>
+#include <array>
+#include <cstdint>
+#include <cstring>
+#include <fstream>
+#include <stdexcept>
+#include <string>
+#include <unordered_map>
+#include <vector>
+
+/**
+ * Sparse grid of voxel densities for volumes such as simulated smoke, laid out like NanoVDB
+ * in three levels: a hash table of nodes, each covering 128^3 voxels as 16^3 bricks; bricks
+ * present only where some voxel is nonzero, each holding 8^3 voxel values. Memory grows with
+ * the occupied bricks rather than the volume's bounding box.
+ *
+ * walk() visits the nonzero voxels along a ray in order, stepping through each level with a
+ * DDA (Amanatides and Woo), so an empty node is crossed in one step and an empty brick in
+ * one step of its node: the steps taken grow with the logarithm of the empty space crossed,
+ * not its size. Voxel densities are constant within each voxel.
+ *
+ * Grids load from a compact binary format (see read() and write()) storing, per brick, its
+ * position, a bitmask of its nonzero voxels and their values.
+ */
+class sparse_voxel_grid {
+  public:
+    static const int brick_size = 8;   // Voxels along each side of a brick
+    static const int node_size  = 16;  // Bricks along each side of a node
+
+    sparse_voxel_grid(real voxel_size, const point3& origin = point3(0,0,0))
+      : voxel_size(voxel_size), origin(origin) {}
+
+    void set(int i, int j, int k, float density) {
+        // Sets the density of voxel (i,j,k), whose corner nearest -infinity is at
+        // origin + voxel_size * (i,j,k). Zeros in empty bricks don't add a brick.
+
+        auto child = brick_at(i, j, k, density != 0);
+        if (child < 0)
+            return;
+
+        auto& b = bricks[child];
+        b.values[voxel_index(i, j, k)] = density;
+        b.max = std::max(b.max, density);
+    }
+
+    float get(int i, int j, int k) const {
+        auto found = root.find(node_key(i >> 7, j >> 7, k >> 7));
+        if (found == root.end())
+            return 0;
+        auto child = nodes[found->second].children[child_index(i >> 3, j >> 3, k >> 3)];
+        return child < 0 ? 0 : bricks[child].values[voxel_index(i, j, k)];
+    }
+
+    aabb bounds() const {
+        if (bricks.empty())
+            return aabb();
+        return aabb(origin + voxel_size * vec3(min_brick[0], min_brick[1], min_brick[2])
+                           * brick_size,
+                    origin + voxel_size * vec3(max_brick[0] + 1, max_brick[1] + 1,
+                                               max_brick[2] + 1) * brick_size);
+    }
+
+    size_t brick_count() const { return bricks.size(); }
+
+    size_t memory_bytes() const {
+        return bricks.size() * sizeof(brick) + nodes.size() * sizeof(node)
+             + root.size() * (sizeof(uint64_t) + sizeof(int32_t));
+    }
+
+    template <typename voxel_visitor>
+    void walk(const ray& r, interval ray_t, const voxel_visitor& visit) const {
+        // Calls visit(t_enter, t_exit, density) for each nonzero voxel the ray crosses within
+        // ray_t, in order, until visit returns true.
+
+        if (bricks.empty() || !bounds().clip(r, ray_t))
+            return;
+
+        // Walk in voxel coordinates, where the ray keeps its parameter t.
+        auto o = (r.origin() - origin) / voxel_size;
+        auto d = r.direction() / voxel_size;
+        const int node_voxels = brick_size * node_size;
+
+        int node_lo[3], node_hi[3];
+        for (int axis = 0; axis < 3; axis++) {
+            node_lo[axis] = min_brick[axis] >> 4;
+            node_hi[axis] = max_brick[axis] >> 4;
+        }
+
+        dda(o, d, ray_t.min, ray_t.max, node_voxels, node_lo, node_hi,
+            [&](const int n[3], real node_enter, real node_exit) {
+                auto found = root.find(node_key(n[0], n[1], n[2]));
+                if (found == root.end())
+                    return false;
+                const auto& children = nodes[found->second].children;
+
+                int brick_lo[3], brick_hi[3];
+                for (int axis = 0; axis < 3; axis++) {
+                    brick_lo[axis] = n[axis] * node_size;
+                    brick_hi[axis] = brick_lo[axis] + node_size - 1;
+                }
+
+                return dda(o, d, node_enter, node_exit, brick_size, brick_lo, brick_hi,
+                    [&](const int b[3], real brick_enter, real brick_exit) {
+                        auto child = children[child_index(b[0], b[1], b[2])];
+                        if (child < 0 || bricks[child].max <= 0)
+                            return false;
+                        const auto& values = bricks[child].values;
+
+                        int voxel_lo[3], voxel_hi[3];
+                        for (int axis = 0; axis < 3; axis++) {
+                            voxel_lo[axis] = b[axis] * brick_size;
+                            voxel_hi[axis] = voxel_lo[axis] + brick_size - 1;
+                        }
+
+                        return dda(o, d, brick_enter, brick_exit, 1, voxel_lo, voxel_hi,
+                            [&](const int v[3], real voxel_enter, real voxel_exit) {
+                                auto density = values[voxel_index(v[0], v[1], v[2])];
+                                return density > 0 && visit(voxel_enter, voxel_exit, density);
+                            });
+                    });
+            });
+    }
+
+    void write(std::ostream& out) const {
+        put_bytes(out, magic, 4);
+        put<uint32_t>(out, version);
+        put<double>(out, voxel_size);
+        for (int axis = 0; axis < 3; axis++)
+            put<double>(out, origin[axis]);
+
+        put<uint32_t>(out, uint32_t(bricks.size()));
+        for (const auto& b : bricks) {
+            for (int axis = 0; axis < 3; axis++)
+                put<int32_t>(out, b.position[axis]);
+
+            uint64_t mask[voxels_per_brick / 64] = {};
+            for (int v = 0; v < voxels_per_brick; v++)
+                if (b.values[v] != 0)
+                    mask[v / 64] |= uint64_t(1) << (v % 64);
+            put_bytes(out, mask, sizeof(mask));
+
+            for (int v = 0; v < voxels_per_brick; v++)
+                if (b.values[v] != 0)
+                    put<float>(out, b.values[v]);
+        }
+    }
+
+    static sparse_voxel_grid read(std::istream& in, const std::string& source_name) {
+        auto fail = [&](const std::string& message) {
+            throw std::runtime_error(source_name + ": " + message);
+        };
+        auto get_bytes = [&](void* dest, size_t count) {
+            if (!in.read(static_cast<char*>(dest), count))
+                fail("unexpected end of file");
+        };
+        auto get = [&](auto value) {
+            get_bytes(&value, sizeof(value));
+            return value;
+        };
+
+        char header[4];
+        get_bytes(header, 4);
+        if (std::memcmp(header, magic, 4) != 0)
+            fail("not a voxel grid file");
+        if (get(uint32_t()) != version)
+            fail("unsupported voxel grid version");
+
+        auto voxel_size = get(double());
+        point3 origin;
+        for (int axis = 0; axis < 3; axis++)
+            origin[axis] = get(double());
+        if (!(voxel_size > 0))
+            fail("voxel size must be positive");
+
+        sparse_voxel_grid grid(voxel_size, origin);
+        auto count = get(uint32_t());
+        for (uint32_t i = 0; i < count; i++) {
+            int32_t position[3];
+            for (int axis = 0; axis < 3; axis++)
+                position[axis] = get(int32_t());
+
+            uint64_t mask[voxels_per_brick / 64];
+            get_bytes(mask, sizeof(mask));
+
+            for (int v = 0; v < voxels_per_brick; v++) {
+                if (!(mask[v / 64] >> (v % 64) & 1))
+                    continue;
+                int vi = v % brick_size, vj = v / brick_size % brick_size;
+                int vk = v / (brick_size * brick_size);
+                grid.set(position[0] * brick_size + vi, position[1] * brick_size + vj,
+                         position[2] * brick_size + vk, get(float()));
+            }
+        }
+
+        return grid;
+    }
+
+    static sparse_voxel_grid load(const std::string& filename) {
+        std::ifstream in(filename, std::ios::binary);
+        if (!in)
+            throw std::runtime_error("Error: Cannot open file " + filename);
+        return read(in, filename);
+    }
+
+    void save(const std::string& filename) const {
+        std::ofstream out(filename, std::ios::binary);
+        if (!out)
+            throw std::runtime_error("Error: Cannot write file " + filename);
+        write(out);
+    }
+
+  private:
+    static constexpr char     magic[4] = { 'F', 'R', 'T', 'V' };
+    static constexpr uint32_t version  = 1;
+    static const int voxels_per_brick = brick_size * brick_size * brick_size;
+
+    struct brick {
+        std::array<float, voxels_per_brick> values{};  // x fastest, then y, then z
+        float   max = 0;
+        int32_t position[3];                           // In bricks
+    };
+
+    struct node {
+        std::array<int32_t, node_size * node_size * node_size> children;  // Brick index or -1
+    };
+
+    real   voxel_size;
+    point3 origin;
+    std::unordered_map<uint64_t, int32_t> root;  // Node index by node position
+    std::vector<node>  nodes;
+    std::vector<brick> bricks;
+    int min_brick[3] = {}, max_brick[3] = {};    // Bounds of the bricks, inclusive
+
+    static uint64_t node_key(int i, int j, int k) {
+        auto bits = [](int x) { return uint64_t(uint32_t(x)) & 0x1fffff; };
+        return bits(i) | bits(j) << 21 | bits(k) << 42;
+    }
+
+    static int child_index(int bi, int bj, int bk) {
+        // Index of brick (bi,bj,bk) in its node's children.
+        auto mask = node_size - 1;
+        return ((bk & mask) * node_size + (bj & mask)) * node_size + (bi & mask);
+    }
+
+    static int voxel_index(int i, int j, int k) {
+        // Index of voxel (i,j,k) in its brick's values.
+        auto mask = brick_size - 1;
+        return ((k & mask) * brick_size + (j & mask)) * brick_size + (i & mask);
+    }
+
+    int32_t brick_at(int i, int j, int k, bool create) {
+        // Returns the index of the brick holding voxel (i,j,k), adding it (and its node) if
+        // asked to, or -1.
+
+        int b[3] = { i >> 3, j >> 3, k >> 3 };
+        auto key = node_key(b[0] >> 4, b[1] >> 4, b[2] >> 4);
+
+        auto found = root.find(key);
+        if (found == root.end()) {
+            if (!create)
+                return -1;
+            found = root.emplace(key, int32_t(nodes.size())).first;
+            nodes.emplace_back();
+            nodes.back().children.fill(-1);
+        }
+
+        auto& child = nodes[found->second].children[child_index(b[0], b[1], b[2])];
+        if (child < 0 && create) {
+            child = int32_t(bricks.size());
+            bricks.emplace_back();
+            for (int axis = 0; axis < 3; axis++) {
+                bricks.back().position[axis] = b[axis];
+                auto first = bricks.size() == 1;
+                min_brick[axis] = first ? b[axis] : std::min(min_brick[axis], b[axis]);
+                max_brick[axis] = first ? b[axis] : std::max(max_brick[axis], b[axis]);
+            }
+        }
+        return child;
+    }
+
+    template <typename cell_visitor>
+    static bool dda(const point3& o, const vec3& d, real t_enter, real t_exit, int cell_size,
+                    const int lo[3], const int hi[3], const cell_visitor& visit) {
+        // Calls visit(cell, t0, t1) for each cell of the given size, between cells lo and hi
+        // inclusive, that the ray o + t d crosses for t in [t_enter, t_exit], in order, until
+        // visit returns true. Returns whether it did.
+
+        auto start = o + t_enter * d;
+        int cell[3], step[3];
+        real t_next[3], t_delta[3];
+        for (int axis = 0; axis < 3; axis++) {
+            auto offset = int(std::floor(start[axis] / cell_size));
+            cell[axis] = std::clamp(offset, lo[axis], hi[axis]);
+
+            if (d[axis] == 0) {
+                step[axis] = 0;
+                t_next[axis] = t_delta[axis] = infinity;
+                continue;
+            }
+
+            step[axis] = d[axis] > 0 ? 1 : -1;
+            auto boundary = real(cell[axis] + (step[axis] > 0)) * cell_size;
+            t_next[axis] = (boundary - o[axis]) / d[axis];
+            t_delta[axis] = cell_size / std::fabs(d[axis]);
+        }
+
+        auto t = t_enter;
+        while (t < t_exit) {
+            int axis = t_next[0] < t_next[1]
+                     ? (t_next[0] < t_next[2] ? 0 : 2) : (t_next[1] < t_next[2] ? 1 : 2);
+            auto t_leave = std::fmin(t_next[axis], t_exit);
+
+            if (t_leave > t && visit(cell, t, t_leave))
+                return true;
+
+            cell[axis] += step[axis];
+            if (cell[axis] < lo[axis] || cell[axis] > hi[axis])
+                return false;
+            t = t_leave;
+            t_next[axis] += t_delta[axis];
+        }
+        return false;
+    }
+
+    template <typename T>
+    static void put(std::ostream& out, T value) { put_bytes(out, &value, sizeof(T)); }
+
+    static void put_bytes(std::ostream& out, const void* data, size_t count) {
+        out.write(static_cast<const char*>(data), count);
+    }
+};
+
+#endif
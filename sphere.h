@@ -6,7 +6,7 @@
 class sphere : public hittable {
   public:
     // Stationary Sphere
-    sphere(const point3& static_center, double radius, shared_ptr<material> mat)
+    sphere(const point3& static_center, real radius, shared_ptr<material> mat)
       : center(static_center, vec3(0,0,0)), radius(std::fmax(0,radius)), mat(mat)
     {
         auto rvec = vec3(radius, radius, radius);
@@ -14,7 +14,7 @@ class sphere : public hittable {
     }
 
     // Moving Sphere
-    sphere(const point3& center1, const point3& center2, double radius,
+    sphere(const point3& center1, const point3& center2, real radius,
            shared_ptr<material> mat)
       : center(center1, center2 - center1), radius(std::fmax(0,radius)), mat(mat)
     {
@@ -45,25 +45,49 @@ class sphere : public hittable {
                 return false;
         }
 
-        rec.t = root;
-        rec.p = r.at(rec.t);
-        vec3 outward_normal = (rec.p - current_center) / radius;
-        rec.set_face_normal(r, outward_normal);
-        get_sphere_uv(outward_normal, rec.u, rec.v);
-        rec.mat = mat;
-
+        set_hit_record(r, root, current_center, rec);
         return true;
     }
 
     aabb bounding_box() const override { return bbox; }
 
+    aabb bounding_box_at(real time) const override {
+        auto rvec = vec3(radius, radius, radius);
+        point3 current_center = center.at(time);
+        return aabb(current_center - rvec, current_center + rvec);
+    }
+
   private:
+    friend class typed_primitives;  // Keeps the geometry in its SoA sphere arrays, and fills
+                                    // in hit records for the spheres it finds hit
+
     ray center;
-    double radius;
+    real radius;
     shared_ptr<material> mat;
     aabb bbox;
 
-    static void get_sphere_uv(const point3& p, double& u, double& v) {
+    void set_hit_record(const ray& r, real root, const point3& current_center,
+                        hit_record& rec) const {
+        rec.t = root;
+        rec.p = r.at(rec.t);
+
+        // Project the point back onto the sphere, so its error no longer depends on the ray
+        // origin's distance. What remains scales with the center and radius, which for a large
+        // sphere can far exceed round-off in the point itself.
+        auto radial = rec.p - current_center;
+        rec.p = current_center + radial * (std::fabs(radius) / radial.length());
+        auto center_size = std::fmax(std::fabs(current_center.x()),
+                           std::fmax(std::fabs(current_center.y()), std::fabs(current_center.z())));
+        rec.p_error = 4 * std::numeric_limits<real>::epsilon() * (center_size + std::fabs(radius));
+
+        vec3 outward_normal = (rec.p - current_center) / radius;
+        rec.set_face_normal(r, outward_normal);
+        get_sphere_uv(outward_normal, rec.u, rec.v);
+        rec.uv_scale = pi * std::sqrt(real(2)) * std::fabs(radius);  // u spans 2 pi r, v pi r
+        rec.mat = mat.get();
+    }
+
+    static void get_sphere_uv(const point3& p, real& u, real& v) {
         // p: a given point on the sphere of radius one, centered at the origin.
         // u: returned value [0,1] of angle around the Y axis from X=-1.
         // v: returned value [0,1] of angle from Y=-1 to Y=+1.
@@ -1,24 +1,37 @@
 #ifndef TEXTURE_H
 #define TEXTURE_H
 
+#include "aabb.h"
+#include "image_cache.h"
 #include "perlin.h"
-#include "rtw_stb_image.h"
+
+#include <algorithm>
+#include <array>
+#include <vector>
 
 
 class texture {
   public:
     virtual ~texture() = default;
 
-    virtual color value(double u, double v, const point3& p) const = 0;
+    virtual color value(real u, real v, const point3& p) const = 0;
+
+    virtual color filtered_value(real u, real v, const point3& p, real uv_footprint,
+                                 real footprint) const {
+        // Returns the texture averaged over what a pixel sees of it, a footprint around the
+        // point of the given width in (u,v) and in space (see hit_record). Textures that don't
+        // filter return their value at the point.
+        return value(u, v, p);
+    }
 };
 
 class solid_color : public texture {
   public:
     solid_color(const color& albedo) : albedo(albedo) {}
 
-    solid_color(double red, double green, double blue) : solid_color(color(red,green,blue)) {}
+    solid_color(real red, real green, real blue) : solid_color(color(red,green,blue)) {}
 
-    color value(double u, double v, const point3& p) const override {
+    color value(real u, real v, const point3& p) const override {
         return albedo;
     }
 
@@ -28,13 +41,13 @@ class solid_color : public texture {
 
 class checker_texture : public texture {
   public:
-    checker_texture(double scale, shared_ptr<texture> even, shared_ptr<texture> odd)
+    checker_texture(real scale, shared_ptr<texture> even, shared_ptr<texture> odd)
       : inv_scale(1.0 / scale), even(even), odd(odd) {}
 
-    checker_texture(double scale, const color& c1, const color& c2)
+    checker_texture(real scale, const color& c1, const color& c2)
       : checker_texture(scale, make_shared<solid_color>(c1), make_shared<solid_color>(c2)) {}
 
-    color value(double u, double v, const point3& p) const override {
+    color value(real u, real v, const point3& p) const override {
         auto xInteger = int(std::floor(inv_scale * p.x()));
         auto yInteger = int(std::floor(inv_scale * p.y()));
         auto zInteger = int(std::floor(inv_scale * p.z()));
@@ -44,47 +57,140 @@ class checker_texture : public texture {
         return isEven ? even->value(u, v, p) : odd->value(u, v, p);
     }
 
+    color filtered_value(real u, real v, const point3& p, real uv_footprint,
+                         real footprint) const override {
+        // The checks themselves are solid in 3D, so only the textures inside them filter.
+        auto xInteger = int(std::floor(inv_scale * p.x()));
+        auto yInteger = int(std::floor(inv_scale * p.y()));
+        auto zInteger = int(std::floor(inv_scale * p.z()));
+
+        bool isEven = (xInteger + yInteger + zInteger) % 2 == 0;
+
+        return isEven ? even->filtered_value(u, v, p, uv_footprint, footprint)
+                      : odd->filtered_value(u, v, p, uv_footprint, footprint);
+    }
+
   private:
-    double inv_scale;
+    real inv_scale;
     shared_ptr<texture> even;
     shared_ptr<texture> odd;
 };
 
 class image_texture : public texture {
   public:
-    image_texture(const char* filename) : image(filename) {}
+    // Images are decoded once per path and shared (see image_cache).
+    image_texture(const char* filename) : image(image_cache::get(filename)) {}
 
-    color value(double u, double v, const point3& p) const override {
-        // If we have no texture data, then return solid cyan as a debugging aid.
-        if (image.height() <= 0) return color(0,1,1);
-
-        // Clamp input texture coordinates to [0,1] x [1,0]
-        u = interval(0,1).clamp(u);
-        v = 1.0 - interval(0,1).clamp(v);  // Flip V to image coordinates
+    color value(real u, real v, const point3& p) const override {
+        return filtered_value(u, v, p, 0, 0);
+    }
 
-        auto i = int(u * image.width());
-        auto j = int(v * image.height());
-        auto pixel = image.pixel_data(i,j);
+    color filtered_value(real u, real v, const point3& p, real uv_footprint,
+                         real footprint) const override {
+        // If we have no texture data, then return solid cyan as a debugging aid.
+        if (image->height() <= 0) return color(0,1,1);
 
-        auto color_scale = 1.0 / 255.0;
-        return color(color_scale*pixel[0], color_scale*pixel[1], color_scale*pixel[2]);
+        return image->sample(u, v, uv_footprint);
     }
 
   private:
-    rtw_image image;
+    shared_ptr<const mip_image> image;
 };
 
 class noise_texture : public texture {
   public:
-    noise_texture(double scale) : scale(scale) {}
+    noise_texture(real scale) : scale(scale) {}
 
-    color value(double u, double v, const point3& p) const override {
+    color value(real u, real v, const point3& p) const override {
        return color(.5, .5, .5) * (1 + std::sin(scale * p.z() + 10 * noise.turb(p, 7)));
     }
 
+    color filtered_value(real u, real v, const point3& p, real uv_footprint,
+                         real footprint) const override {
+       return color(.5, .5, .5) * (1 + std::sin(scale * p.z() + 10 * noise.turb(p, 7, footprint)));
+    }
+
   private:
     perlin noise;
-    double scale;
+    real scale;
+};
+
+/**
+ * Texture sampled ahead of time at the points of a grid through a box, trading memory for
+ * the cost of evaluating a procedural texture at every hit. Lookups inside the box blend the
+ * eight nearest grid colors, so detail finer than the grid spacing is smoothed away; lookups
+ * outside it fall back to the source texture. Only textures that depend on the point alone,
+ * as the built-in procedural ones do, give the same result when baked.
+ */
+class baked_texture : public texture {
+  public:
+    baked_texture(shared_ptr<texture> source, const aabb& bounds, int resolution)
+      : source(source), bounds(bounds)
+    {
+        // The longest side of the box gets `resolution` grid points, the others proportionally
+        // fewer, and the grid is filled in parallel.
+
+        real longest = 0;
+        for (int axis = 0; axis < 3; axis++)
+            longest = std::fmax(longest, bounds.axis_interval(axis).size());
+
+        for (int axis = 0; axis < 3; axis++) {
+            auto size = bounds.axis_interval(axis).size();
+            counts[axis] = std::max(2, int(std::ceil(size / longest * (resolution - 1))) + 1);
+            spacing[axis] = size / (counts[axis] - 1);
+        }
+
+        samples.resize(size_t(counts[0]) * counts[1] * counts[2]);
+
+        #pragma omp parallel for schedule(dynamic, 1)
+        for (int k = 0; k < counts[2]; k++) {
+            for (int j = 0; j < counts[1]; j++) {
+                for (int i = 0; i < counts[0]; i++) {
+                    point3 p(bounds.x.min + i*spacing[0], bounds.y.min + j*spacing[1],
+                             bounds.z.min + k*spacing[2]);
+                    auto c = source->value(0, 0, p);
+                    samples[index(i, j, k)] = { float(c.x()), float(c.y()), float(c.z()) };
+                }
+            }
+        }
+    }
+
+    color value(real u, real v, const point3& p) const override {
+        if (!bounds.x.contains(p.x()) || !bounds.y.contains(p.y()) || !bounds.z.contains(p.z()))
+            return source->value(u, v, p);
+
+        int cell[3];
+        real fraction[3];
+        for (int axis = 0; axis < 3; axis++) {
+            auto x = (p[axis] - bounds.axis_interval(axis).min) / spacing[axis];
+            cell[axis] = std::min(int(x), counts[axis] - 2);
+            fraction[axis] = x - cell[axis];
+        }
+
+        color result(0,0,0);
+        for (int corner = 0; corner < 8; corner++) {
+            int di = corner & 1, dj = (corner >> 1) & 1, dk = corner >> 2;
+            auto weight = (di ? fraction[0] : 1 - fraction[0])
+                        * (dj ? fraction[1] : 1 - fraction[1])
+                        * (dk ? fraction[2] : 1 - fraction[2]);
+            const auto& sample = samples[index(cell[0] + di, cell[1] + dj, cell[2] + dk)];
+            result += weight * color(sample[0], sample[1], sample[2]);
+        }
+        return result;
+    }
+
+    size_t memory_bytes() const { return samples.size() * sizeof(samples[0]); }
+
+  private:
+    shared_ptr<texture> source;
+    aabb bounds;
+    int  counts[3];                               // Grid points along each axis
+    real spacing[3];                              // Distance between them
+    std::vector<std::array<float, 3>> samples;    // Colors, x fastest, then y, then z
+
+    size_t index(int i, int j, int k) const {
+        return (size_t(k) * counts[1] + j) * counts[0] + i;
+    }
 };
 
 #endif
\ No newline at end of file
@@ -8,11 +8,16 @@ class triangle : public hittable {
     triangle(const point3& Q, const vec3& u, const vec3& v, shared_ptr<material> mat)
       : Q(Q), u(u), v(v), mat(mat)
     {
-        // Compute the normal vector.
-        normal = unit_vector(cross(u, v));
-        D = dot(normal, Q);
-        w = cross(u, v) / dot(cross(u, v), cross(u, v)); // Used for barycentric coordinates.
+        set_plane();
+        set_bounding_box();
+    }
 
+    void set_vertices(const point3& a, const point3& b, const point3& c) {
+        // Moves the triangle's corners, for meshes that deform between animation frames.
+        Q = a;
+        u = b - a;
+        v = c - a;
+        set_plane();
         set_bounding_box();
     }
 
@@ -33,6 +38,11 @@ class triangle : public hittable {
 
     aabb bounding_box() const override { return bbox; }
 
+    aabb bounding_box_in(const aabb& clip) const override {
+        point3 corners[3] = { Q, Q + u, Q + v };
+        return clipped_polygon_bounds(corners, 3, clip);
+    }
+
     bool hit(const ray& r, interval ray_t, hit_record& rec) const override {
         auto denom = dot(normal, r.direction());
 
@@ -46,7 +56,10 @@ class triangle : public hittable {
             return false;
 
         // Calculate barycentric coordinates to test if the point is inside the triangle.
+        // Project the point back onto the plane, so its error is on the scale of its own
+        // coordinates rather than the ray origin's (see offset_ray_origin).
         auto intersection = r.at(t);
+        intersection = intersection - (dot(normal, intersection) - D) * normal;
         vec3 planar_hitpt_vector = intersection - Q;
 
         auto alpha = dot(w, cross(planar_hitpt_vector, v));
@@ -59,13 +72,15 @@ class triangle : public hittable {
         // Ray hits the triangle; set hit record and return true.
         rec.t = t;
         rec.p = intersection;
-        rec.mat = mat;
+        rec.p_error = 0;
+        rec.uv_scale = uv_scale;
+        rec.mat = mat.get();
         rec.set_face_normal(r, normal);
 
         return true;
     }
 
-    virtual bool is_interior(double a, double b, double g, hit_record& rec) const {
+    virtual bool is_interior(real a, real b, real g, hit_record& rec) const {
         // Check if barycentric coordinates are inside the triangle.
         if (a < 0 || b < 0 || g < 0)
             return false;
@@ -76,13 +91,22 @@ class triangle : public hittable {
     }
 
   private:
+    void set_plane() {
+        // Compute the normal vector.
+        normal = unit_vector(cross(u, v));
+        D = dot(normal, Q);
+        w = cross(u, v) / dot(cross(u, v), cross(u, v)); // Used for barycentric coordinates.
+        uv_scale = std::sqrt(cross(u, v).length());
+    }
+
     point3 Q;             // One vertex of the triangle.
     vec3 u, v;            // Edges of the triangle: Q+u, Q+v.
     vec3 w;               // Precomputed value for barycentric coordinates.
     shared_ptr<material> mat;
     aabb bbox;            // Bounding box of the triangle.
     vec3 normal;          // Surface normal of the triangle.
-    double D;             // Plane constant for the triangle.
+    real D;               // Plane constant for the triangle.
+    real uv_scale;        // Square root of the area a unit square of (u,v) covers.
 };
 
 #endif
\ No newline at end of file
@@ -2,78 +2,136 @@
 #define TRIANGLE_MESH_H
 
 #include <vector>
-#include <array> 
+#include <array>
 #include <fstream>
 #include <sstream>
+#include "arena.h"
 #include "triangle.h"
 #include "hittable_list.h"
+#include "flat_bvh.h"
+
+/**
+ * Vertex and face data parsed from an OBJ file. Several meshes loaded from the same file can
+ * share one copy of this.
+ */
+struct mesh_data {
+    std::vector<point3> vertices;
+    std::vector<std::array<int, 3>> faces;  // Zero-based vertex indices
+
+    static shared_ptr<mesh_data> load_obj(const std::string& filename) {
+        auto data = make_shared<mesh_data>();
+        std::ifstream file(filename);
+
+        if (!file) {
+            throw std::runtime_error("Error: Cannot open file " + filename);
+        }
+
+        std::string line;
+        while (std::getline(file, line)) {
+            std::istringstream iss(line);
+            std::string prefix;
+            iss >> prefix;
+
+            if (prefix == "v") {
+                real x, y, z;
+                iss >> x >> y >> z;
+                data->vertices.emplace_back(x, y, z);
+            } else if (prefix == "f") {
+                std::array<int, 3> indices;
+
+                for (int i = 0; i < 3; ++i) {
+                    std::string vertex_str;
+                    iss >> vertex_str;
+
+                    std::istringstream vertex_ss(vertex_str);
+                    int vertex_index;
+                    vertex_ss >> vertex_index;
+                    vertex_index--;
+                    indices[i] = vertex_index;
+                }
+
+                data->faces.push_back(indices);
+            }
+        }
+
+        return data;
+    }
+};
 
 class triangle_mesh : public hittable {
   public:
     triangle_mesh(const std::string& filename, shared_ptr<material> mat, const point3& center = point3(0, 0, 0))
-        : mat(mat), center(center)
+        : triangle_mesh(mesh_data::load_obj(filename), mat, center)
+    {}
+
+    triangle_mesh(shared_ptr<const mesh_data> data, shared_ptr<material> mat, const point3& center = point3(0, 0, 0),
+                  const shared_ptr<arena>& memory = nullptr)
+        : data(data), mat(mat), center(center)
     {
-        load_mesh(filename);
+        // The triangles are allocated in the given arena if there is one.
+        build_triangles(memory);
         set_bounding_box();
     }
 
     bool hit(const ray& r, interval ray_t, hit_record& rec) const override {
-        return triangles.hit(r, ray_t, rec); 
+        return triangles->hit(r, ray_t, rec);
     }
 
     aabb bounding_box() const override {
         return bbox;
     }
 
+    void set_vertices(const std::vector<point3>& vertices, double rebuild_threshold = 1.5) {
+        // Moves the mesh's vertices, keeping its faces, and refits its BVH. The BVH is only
+        // rebuilt once refitting has made it rebuild_threshold times costlier to trace (see
+        // flat_bvh::update).
+
+        if (vertices.size() != data->vertices.size()) {
+            throw std::runtime_error("Error: Mesh has " + std::to_string(data->vertices.size())
+                                     + " vertices, got " + std::to_string(vertices.size()));
+        }
+
+        #pragma omp parallel for schedule(static)
+        for (size_t i = 0; i < faces.size(); i++) {
+            const auto& face = data->faces[i];
+            faces[i]->set_vertices(vertices[face[0]] + center, vertices[face[1]] + center,
+                                   vertices[face[2]] + center);
+        }
+
+        triangles->update(rebuild_threshold);
+        set_bounding_box();
+    }
+
   private:
-    hittable_list triangles; 
+    shared_ptr<const mesh_data> data;
+    std::vector<shared_ptr<triangle>> faces;  // One triangle per face of data, in order
+    shared_ptr<flat_bvh> triangles;           // BVH over the mesh's triangles
     shared_ptr<material> mat;
     aabb bbox;
     point3 center;
 
-    void load_mesh(const std::string& filename) {
-    std::vector<point3> vertices;
-    std::ifstream file(filename);
+    void build_triangles(const shared_ptr<arena>& memory) {
+        hittable_list list;
 
-    if (!file) {
-        throw std::runtime_error("Error: Cannot open file " + filename);
-    }
+        for (const auto& face : data->faces) {
+            auto v0 = data->vertices[face[0]] + center;
+            auto v1 = data->vertices[face[1]] + center;
+            auto v2 = data->vertices[face[2]] + center;
 
-    std::string line;
-    while (std::getline(file, line)) {
-        std::istringstream iss(line);
-        std::string prefix;
-        iss >> prefix;
-
-        if (prefix == "v") { 
-            double x, y, z;
-            iss >> x >> y >> z;
-            vertices.emplace_back(x + center.x(), y + center.y(), z + center.z());
-        } else if (prefix == "f") { 
-            std::array<int, 3> indices;
-
-            for (int i = 0; i < 3; ++i) {
-                std::string vertex_str;
-                iss >> vertex_str;
-
-                std::istringstream vertex_ss(vertex_str);
-                int vertex_index;
-                vertex_ss >> vertex_index;
-                vertex_index--;
-                indices[i] = vertex_index;
-            }
-
-            const auto& v0 = vertices[indices[0]];
-            const auto& v1 = vertices[indices[1]];
-            const auto& v2 = vertices[indices[2]];
-
-            triangles.add(make_shared<triangle>(v0, v1 - v0, v2 - v0, mat));
+            faces.push_back(arena_make<triangle>(memory, v0, v1 - v0, v2 - v0, mat));
+            list.add(faces.back());
         }
+
+        // Meshes often mix large and small triangles, which spatial splits handle far better
+        // than splitting by centroid alone.
+        bvh_build_options options;
+        options.spatial_splits = true;
+        options.typed_leaves = true;
+        triangles = make_shared<flat_bvh>(list, options);
     }
-}
 
     void set_bounding_box() {
-        bbox = triangles.bounding_box();
+        bbox = triangles->bounding_box();
     }
 };
 
@@ -0,0 +1,264 @@
+#ifndef TYPED_PRIMITIVES_H
+#define TYPED_PRIMITIVES_H
+
+#include "constant_medium.h"
+#include "hittable.h"
+#include "quad.h"
+#include "sphere.h"
+#include "triangle.h"
+
+#include <array>
+#include <cstdint>
+#include <cstring>
+#include <typeinfo>
+#include <vector>
+
+#if defined(__SSE__)
+#include <immintrin.h>
+#endif
+
+/**
+ * Copies of a list of objects kept in one array per built-in primitive type, so that they
+ * can be hit without virtual calls. The arrays hold the objects by value, so hitting an
+ * element is a direct call the compiler can inline into the caller's loop. Only objects of
+ * exactly a built-in type are copied: subclasses, which may override a primitive's virtual
+ * hooks such as quad::is_interior(), and other user extensions stay behind their pointers
+ * and are hit through the hittable interface.
+ *
+ * Spheres are also laid out as structure-of-arrays (center, velocity and radius, one array
+ * per coordinate), and hit_range() tests consecutive spheres a SIMD register at a time: two
+ * or four doubles, or four or eight floats, depending on whether the build enables AVX.
+ * Only the nearest sphere hit then fills in the hit record.
+ *
+ * The copies are taken by assign(); assign the list again after changing its objects.
+ */
+class typed_primitives {
+  public:
+    enum class primitive_type : uint8_t { sphere, quad, triangle, medium, other };
+
+#if defined(__AVX__)
+    static const int lane_count = 32 / sizeof(real);  // Spheres hit together
+#else
+    static const int lane_count = 16 / sizeof(real);
+#endif
+
+    static primitive_type type_of(const hittable& object) {
+        // Matches the exact type, as copying a subclass would slice off its overrides.
+        const auto& type = typeid(object);
+        if (type == typeid(sphere))
+            return primitive_type::sphere;
+        if (type == typeid(quad))
+            return primitive_type::quad;
+        if (type == typeid(triangle))
+            return primitive_type::triangle;
+        if (type == typeid(constant_medium))
+            return primitive_type::medium;
+        return primitive_type::other;
+    }
+
+    void assign(const std::vector<shared_ptr<hittable>>& objects) {
+        clear();
+        refs.reserve(objects.size());
+
+        for (const auto& object : objects) {
+            auto type = type_of(*object);
+            switch (type) {
+              case primitive_type::sphere:
+                refs.push_back({ uint32_t(spheres.size()), type });
+                spheres.push_back(static_cast<const sphere&>(*object));
+                add_sphere_lanes(spheres.back());
+                break;
+              case primitive_type::quad:
+                refs.push_back({ uint32_t(quads.size()), type });
+                quads.push_back(static_cast<const quad&>(*object));
+                break;
+              case primitive_type::triangle:
+                refs.push_back({ uint32_t(triangles.size()), type });
+                triangles.push_back(static_cast<const triangle&>(*object));
+                break;
+              case primitive_type::medium:
+                refs.push_back({ uint32_t(media.size()), type });
+                media.push_back(static_cast<const constant_medium&>(*object));
+                break;
+              default:
+                refs.push_back({ uint32_t(others.size()), type });
+                others.push_back(object.get());
+            }
+        }
+
+        // Pad the sphere arrays so a group of lanes can be loaded from any sphere.
+        for (int i = 0; i < lane_count - 1; i++)
+            add_sphere_lanes(sphere(point3(0,0,0), 0, nullptr));
+    }
+
+    void clear() {
+        refs.clear();
+        spheres.clear();
+        quads.clear();
+        triangles.clear();
+        media.clear();
+        others.clear();
+        for (auto& lanes : sphere_soa)
+            lanes.clear();
+    }
+
+    bool empty() const { return refs.empty(); }
+
+    bool hit(size_t index, const ray& r, interval ray_t, hit_record& rec) const {
+        // Hits the object at the given index of the assigned list.
+        auto ref = refs[index];
+        switch (ref.type) {
+          case primitive_type::sphere:   return spheres[ref.index].hit(r, ray_t, rec);
+          case primitive_type::quad:     return quads[ref.index].hit(r, ray_t, rec);
+          case primitive_type::triangle: return triangles[ref.index].hit(r, ray_t, rec);
+          case primitive_type::medium:   return media[ref.index].hit(r, ray_t, rec);
+          default:                       return others[ref.index]->hit(r, ray_t, rec);
+        }
+    }
+
+    bool hit_range(size_t begin, size_t end, const ray& r, interval ray_t, hit_record& rec) const {
+        // Hits the objects [begin,end) of the assigned list, keeping the nearest hit. Each run
+        // of spheres is hit together, as consecutive objects of one type are also consecutive
+        // in that type's arrays.
+
+        bool hit_anything = false;
+        size_t i = begin;
+        while (i < end) {
+            bool hit_object;
+            if (refs[i].type == primitive_type::sphere) {
+                size_t run_end = i + 1;
+                while (run_end < end && refs[run_end].type == primitive_type::sphere)
+                    run_end++;
+                hit_object = hit_spheres(refs[i].index, run_end - i, r, ray_t, rec);
+                i = run_end;
+            } else {
+                hit_object = hit(i, r, ray_t, rec);
+                i++;
+            }
+
+            if (hit_object) {
+                hit_anything = true;
+                ray_t.max = rec.t;
+            }
+        }
+
+        return hit_anything;
+    }
+
+    size_t memory_bytes() const {
+        return refs.size() * sizeof(primitive_ref) + spheres.size() * sizeof(sphere)
+             + sphere_soa[0].size() * sizeof(real) * sphere_soa.size()
+             + quads.size() * sizeof(quad) + triangles.size() * sizeof(triangle)
+             + media.size() * sizeof(constant_medium) + others.size() * sizeof(hittable*);
+    }
+
+  private:
+    typedef real lanes __attribute__((vector_size(lane_count * sizeof(real))));
+
+    // Indices of the sphere_soa arrays
+    enum {
+        center_x, center_y, center_z, velocity_x, velocity_y, velocity_z, radius, sphere_fields
+    };
+
+    struct primitive_ref {
+        uint32_t       index;  // Index in the array of the object's type
+        primitive_type type;
+    };
+
+    std::vector<primitive_ref>   refs;  // One per object of the assigned list, in order
+    std::vector<sphere>          spheres;
+    std::vector<quad>            quads;
+    std::vector<triangle>        triangles;
+    std::vector<constant_medium> media;
+    std::vector<const hittable*> others;
+    std::array<std::vector<real>, sphere_fields> sphere_soa;  // Spheres, padded to whole lanes
+
+    void add_sphere_lanes(const sphere& s) {
+        const auto& origin = s.center.origin();
+        const auto& velocity = s.center.direction();
+        sphere_soa[center_x].push_back(origin.x());
+        sphere_soa[center_y].push_back(origin.y());
+        sphere_soa[center_z].push_back(origin.z());
+        sphere_soa[velocity_x].push_back(velocity.x());
+        sphere_soa[velocity_y].push_back(velocity.y());
+        sphere_soa[velocity_z].push_back(velocity.z());
+        sphere_soa[radius].push_back(s.radius);
+    }
+
+    lanes load(int field, size_t index) const {
+        lanes result;
+        std::memcpy(&result, &sphere_soa[field][index], sizeof(result));
+        return result;
+    }
+
+    static lanes lane_sqrt(lanes x) {
+#if defined(__AVX__) && defined(FRT_USE_FLOAT)
+        return _mm256_sqrt_ps(x);
+#elif defined(__AVX__)
+        return _mm256_sqrt_pd(x);
+#elif defined(__SSE__) && defined(FRT_USE_FLOAT)
+        return _mm_sqrt_ps(x);
+#elif defined(__SSE2__)
+        return _mm_sqrt_pd(x);
+#else
+        for (int i = 0; i < lane_count; i++)
+            x[i] = std::sqrt(x[i]);
+        return x;
+#endif
+    }
+
+    bool hit_spheres(size_t first, size_t count, const ray& r, interval ray_t,
+                     hit_record& rec) const {
+        // Finds the nearest root among the spheres [first, first+count) in lanes, with the
+        // same arithmetic as sphere::hit, then has that sphere fill in the record.
+
+        const auto& orig = r.origin();
+        const auto& dir = r.direction();
+        const real time = r.time();
+        const real a = dir.length_squared();
+        lanes lane_index;
+        for (int lane = 0; lane < lane_count; lane++)
+            lane_index[lane] = lane;
+
+        size_t nearest = count;
+        real nearest_t = ray_t.max;
+
+        for (size_t base = 0; base < count; base += lane_count) {
+            size_t index = first + base;
+            lanes ocx = load(center_x, index) + time * load(velocity_x, index) - orig.x();
+            lanes ocy = load(center_y, index) + time * load(velocity_y, index) - orig.y();
+            lanes ocz = load(center_z, index) + time * load(velocity_z, index) - orig.z();
+            lanes rad = load(radius, index);
+
+            lanes h = dir.x()*ocx + dir.y()*ocy + dir.z()*ocz;
+            lanes c = (ocx*ocx + ocy*ocy + ocz*ocz) - rad*rad;
+            lanes discriminant = h*h - a*c;
+            auto in_run = lane_index < real(count - base);
+            auto real_roots = discriminant >= 0;
+
+            lanes sqrtd = lane_sqrt(real_roots ? discriminant : lanes{});
+            lanes near_root = (h - sqrtd) / a;
+            lanes far_root = (h + sqrtd) / a;
+            auto near_ok = (ray_t.min < near_root) & (near_root < ray_t.max);
+            auto far_ok = (ray_t.min < far_root) & (far_root < ray_t.max);
+            lanes root = near_ok ? near_root : far_root;
+            auto ok = in_run & real_roots & (near_ok | far_ok);
+
+            for (int lane = 0; lane < lane_count; lane++) {
+                if (ok[lane] && root[lane] < nearest_t) {
+                    nearest = base + lane;
+                    nearest_t = root[lane];
+                }
+            }
+        }
+
+        if (nearest == count)
+            return false;
+
+        const auto& s = spheres[first + nearest];
+        s.set_hit_record(r, nearest_t, s.center.at(time), rec);
+        return true;
+    }
+};
+
+#endif
@@ -1,20 +1,53 @@
 #ifndef VEC3_H
 #define VEC3_H
 
+#ifdef FRT_SIMD_VEC3
+// Build with -DFRT_SIMD_VEC3 to pad vec3 to four lanes of real held in one GCC/Clang vector,
+// so its arithmetic compiles to packed SSE instructions (AVX for doubles with -mavx). The
+// fourth lane is always zero and the public interface is the same as the scalar vec3's.
+typedef real vec3_lanes __attribute__((vector_size(4 * sizeof(real))));
+typedef decltype(vec3_lanes{} < vec3_lanes{}) vec3_lane_mask;  // Integer lanes of the same width
+#endif
+
 class vec3 {
   public:
-    double e[3];
+#ifdef FRT_SIMD_VEC3
+    union {
+        vec3_lanes v;
+        real e[4];
+    };
+
+    vec3() : v{0,0,0,0} {}
+    vec3(real e0, real e1, real e2) : v{e0, e1, e2, 0} {}
+    explicit vec3(const vec3_lanes& lanes) : v(lanes) {}
+#else
+    real e[3];
 
     vec3() : e{0,0,0} {}
-    vec3(double e0, double e1, double e2) : e{e0, e1, e2} {}
+    vec3(real e0, real e1, real e2) : e{e0, e1, e2} {}
+#endif
+
+    real x() const { return e[0]; }
+    real y() const { return e[1]; }
+    real z() const { return e[2]; }
+
+    real operator[](int i) const { return e[i]; }
+    real& operator[](int i) { return e[i]; }
 
-    double x() const { return e[0]; }
-    double y() const { return e[1]; }
-    double z() const { return e[2]; }
+#ifdef FRT_SIMD_VEC3
+    vec3 operator-() const { return vec3(-v); }
 
+    vec3& operator+=(const vec3& u) {
+        v += u.v;
+        return *this;
+    }
+
+    vec3& operator*=(real t) {
+        v *= t;
+        return *this;
+    }
+#else
     vec3 operator-() const { return vec3(-e[0], -e[1], -e[2]); }
-    double operator[](int i) const { return e[i]; }
-    double& operator[](int i) { return e[i]; }
 
     vec3& operator+=(const vec3& v) {
         e[0] += v.e[0];
@@ -23,23 +56,29 @@ class vec3 {
         return *this;
     }
 
-    vec3& operator*=(double t) {
+    vec3& operator*=(real t) {
         e[0] *= t;
         e[1] *= t;
         e[2] *= t;
         return *this;
     }
+#endif
 
-    vec3& operator/=(double t) {
+    vec3& operator/=(real t) {
         return *this *= 1/t;
     }
 
-    double length() const {
+    real length() const {
         return std::sqrt(length_squared());
     }
 
-    double length_squared() const {
+    real length_squared() const {
+#ifdef FRT_SIMD_VEC3
+        vec3_lanes squares = v * v;
+        return squares[0] + squares[1] + squares[2];
+#else
         return e[0]*e[0] + e[1]*e[1] + e[2]*e[2];
+#endif
     }
 
     bool near_zero() const {
@@ -52,7 +91,7 @@ class vec3 {
         return vec3(random_double(), random_double(), random_double());
     }
 
-    static vec3 random(double min, double max) {
+    static vec3 random(real min, real max) {
         return vec3(random_double(min,max), random_double(min,max), random_double(min,max));
     }
 };
@@ -67,6 +106,54 @@ inline std::ostream& operator<<(std::ostream& out, const vec3& v) {
     return out << v.e[0] << ' ' << v.e[1] << ' ' << v.e[2];
 }
 
+#ifdef FRT_SIMD_VEC3
+
+inline vec3 operator+(const vec3& u, const vec3& v) {
+    return vec3(u.v + v.v);
+}
+
+inline vec3 operator-(const vec3& u, const vec3& v) {
+    return vec3(u.v - v.v);
+}
+
+inline vec3 operator*(const vec3& u, const vec3& v) {
+    return vec3(u.v * v.v);
+}
+
+inline vec3 operator*(real t, const vec3& v) {
+    return vec3(t * v.v);
+}
+
+inline vec3 operator*(const vec3& v, real t) {
+    return t * v;
+}
+
+inline vec3 operator/(const vec3& v, real t) {
+    return (1/t) * v;
+}
+
+inline real dot(const vec3& u, const vec3& v) {
+    vec3_lanes products = u.v * v.v;
+    return products[0] + products[1] + products[2];
+}
+
+inline vec3 rotate_yzx(const vec3& u) {
+    // Returns (u.y, u.z, u.x). GCC and Clang name their vector shuffles differently.
+#ifdef __clang__
+    return vec3(__builtin_shufflevector(u.v, u.v, 1, 2, 0, 3));
+#else
+    return vec3(__builtin_shuffle(u.v, vec3_lane_mask{1, 2, 0, 3}));
+#endif
+}
+
+inline vec3 cross(const vec3& u, const vec3& v) {
+    // u * v.yzx - u.yzx * v gives the cross product in zxy order, so one more rotation puts it
+    // right: three shuffles instead of the four of the textbook form.
+    return rotate_yzx(vec3(u.v * rotate_yzx(v).v - rotate_yzx(u).v * v.v));
+}
+
+#else
+
 inline vec3 operator+(const vec3& u, const vec3& v) {
     return vec3(u.e[0] + v.e[0], u.e[1] + v.e[1], u.e[2] + v.e[2]);
 }
@@ -79,19 +166,19 @@ inline vec3 operator*(const vec3& u, const vec3& v) {
     return vec3(u.e[0] * v.e[0], u.e[1] * v.e[1], u.e[2] * v.e[2]);
 }
 
-inline vec3 operator*(double t, const vec3& v) {
+inline vec3 operator*(real t, const vec3& v) {
     return vec3(t*v.e[0], t*v.e[1], t*v.e[2]);
 }
 
-inline vec3 operator*(const vec3& v, double t) {
+inline vec3 operator*(const vec3& v, real t) {
     return t * v;
 }
 
-inline vec3 operator/(const vec3& v, double t) {
+inline vec3 operator/(const vec3& v, real t) {
     return (1/t) * v;
 }
 
-inline double dot(const vec3& u, const vec3& v) {
+inline real dot(const vec3& u, const vec3& v) {
     return u.e[0] * v.e[0]
          + u.e[1] * v.e[1]
          + u.e[2] * v.e[2];
@@ -103,6 +190,8 @@ inline vec3 cross(const vec3& u, const vec3& v) {
                 u.e[0] * v.e[1] - u.e[1] * v.e[0]);
 }
 
+#endif
+
 inline vec3 unit_vector(const vec3& v) {
     return v / v.length();
 }
@@ -136,7 +225,7 @@ inline vec3 reflect(const vec3& v, const vec3& n) {
     return v - 2*dot(v,n)*n;
 }
 
-inline vec3 refract(const vec3& uv, const vec3& n, double etai_over_etat) {
+inline vec3 refract(const vec3& uv, const vec3& n, real etai_over_etat) {
     auto cos_theta = std::fmin(dot(-uv, n), 1.0);
     vec3 r_out_perp =  etai_over_etat * (uv + cos_theta*n);
     vec3 r_out_parallel = -std::sqrt(std::fabs(1.0 - r_out_perp.length_squared())) * n;
@@ -0,0 +1,82 @@
+#ifndef VOXEL_MEDIUM_H
+#define VOXEL_MEDIUM_H
+
+#include "hittable.h"
+#include "material.h"
+#include "sparse_voxel_grid.h"
+#include "texture.h"
+
+/**
+ * Participating medium whose density is read from a sparse_voxel_grid, such as smoke exported
+ * from a simulation. Density is constant within each voxel, so where a ray scatters is found
+ * exactly: the grid's walk() hands over the nonzero voxels along the ray, and the optical
+ * depth of each is subtracted from an exponentially distributed draw until it runs out. Empty
+ * space costs only the steps of the walk, and there are no rejected collisions as in delta
+ * tracking (see heterogeneous_medium). Shadow rays take transmittance() instead, which sums the
+ * same optical depths along the whole ray, so the light they let through is exact.
+ */
+class voxel_medium final : public hittable {
+  public:
+    voxel_medium(shared_ptr<const sparse_voxel_grid> grid, real density,
+                 shared_ptr<material> phase_function)
+      : grid(grid), density_scale(density), phase_function(phase_function),
+        bbox(grid->bounds())
+    {}
+
+    voxel_medium(shared_ptr<const sparse_voxel_grid> grid, real density,
+                 shared_ptr<texture> tex)
+      : voxel_medium(grid, density, make_shared<isotropic>(tex))
+    {}
+
+    bool hit(const ray& r, interval ray_t, hit_record& rec) const override {
+        auto ray_length = r.direction().length();
+        auto remaining = -std::log(1 - random_double());  // Optical depth left to travel
+        bool scattered = false;
+
+        grid->walk(r, ray_t, [&](real t_enter, real t_exit, float density) {
+            auto sigma = density_scale * density * ray_length;
+            auto depth = sigma * (t_exit - t_enter);
+            if (depth < remaining) {
+                remaining -= depth;
+                return false;
+            }
+            rec.t = t_enter + remaining / sigma;
+            scattered = true;
+            return true;
+        });
+
+        if (!scattered)
+            return false;
+
+        rec.p = r.at(rec.t);
+        rec.p_error = 0;
+        rec.uv_scale = 0;
+        rec.normal = vec3(1,0,0);  // arbitrary
+        rec.front_face = true;     // also arbitrary
+        rec.mat = phase_function.get();
+        return true;
+    }
+
+    bool hit_surface(const ray&, interval, hit_record&) const override { return false; }
+
+    bool contains_media() const override { return true; }
+
+    real transmittance(const ray& r, interval ray_t) const override {
+        real depth = 0;
+        grid->walk(r, ray_t, [&](real t_enter, real t_exit, float density) {
+            depth += density * (t_exit - t_enter);
+            return false;
+        });
+        return std::exp(-density_scale * r.direction().length() * depth);
+    }
+
+    aabb bounding_box() const override { return bbox; }
+
+  private:
+    shared_ptr<const sparse_voxel_grid> grid;
+    real density_scale;
+    shared_ptr<material> phase_function;
+    aabb bbox;
+};
+
+#endif